@@ -0,0 +1,124 @@
+//===-------- block_reader.cpp, Newline aligned block input --------------===//
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "block_reader.h"
+
+void Block_reader::set_stream(std::istream* stream)
+{
+  input = stream;
+  carry.clear();
+}
+
+size_t Block_reader::read(std::vector<char>& buf)
+{
+  if (!input)
+    return 0;
+  if (buf.size() < block_size)
+    buf.resize(block_size);
+  // The carried partial line is never longer than the buffer it came from,
+  // but buf may be another, smaller, buffer.
+  if (buf.size() < carry.size() + block_size)
+    buf.resize(carry.size() + block_size);
+  size_t length = carry.size();
+  std::copy(carry.begin(), carry.end(), buf.begin());
+  carry.clear();
+  // The carried characters hold no newline.
+  size_t searched = length;
+  while (*input) {
+    if (length == buf.size())
+      buf.resize(buf.size() * 2);
+    input->read(buf.data() + length,
+                static_cast<std::streamsize>(buf.size() - length));
+    length += static_cast<size_t>(input->gcount());
+    if (!*input)
+      break;
+    // walk back to the last newline, and carry what follows it.
+    size_t last_newline = length;
+    for (; last_newline > searched && buf[last_newline - 1] != '\n';
+         --last_newline) {
+    }
+    if (last_newline > searched) {
+      carry.assign(buf.begin() + static_cast<long>(last_newline),
+                   buf.begin() + static_cast<long>(length));
+      return last_newline;
+    }
+    // No newline yet: the line is longer than the buffer, so keep reading.
+    searched = length;
+  }
+  // End of input: the block holds everything that is left, including a
+  // final line without a newline.
+  return length;
+}
+
+Read_ahead::Read_ahead(Block_reader& r, size_t count)
+    : reader(r), buffers(std::max<size_t>(count, 2))
+{
+  for (auto& buf : buffers)
+    free_buffers.push_back(&buf);
+  reading = std::thread(&Read_ahead::fill, this);
+}
+
+Read_ahead::~Read_ahead()
+{
+  {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    stopping = true;
+  }
+  buffer_free.notify_all();
+  reading.join();
+}
+
+const char* Read_ahead::next(size_t& length)
+{
+  std::unique_lock<std::mutex> lock(buffer_mutex);
+  if (current) {
+    free_buffers.push_back(current);
+    current = nullptr;
+    buffer_free.notify_one();
+  }
+  buffer_ready.wait(lock, [this] { return !ready.empty() || input_done; });
+  if (ready.empty()) {
+    length = 0;
+    return nullptr;
+  }
+  current = ready.front();
+  ready.pop_front();
+  length = current->length;
+  return current->data.data();
+}
+
+void Read_ahead::fill()
+{
+  for (;;) {
+    Buffer* buf;
+    {
+      std::unique_lock<std::mutex> lock(buffer_mutex);
+      buffer_free.wait(lock,
+                       [this] { return !free_buffers.empty() || stopping; });
+      if (stopping)
+        return;
+      buf = free_buffers.front();
+      free_buffers.pop_front();
+    }
+    buf->length = reader.read(buf->data);
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (buf->length == 0) {
+      free_buffers.push_back(buf);
+      input_done = true;
+      buffer_ready.notify_all();
+      return;
+    }
+    ready.push_back(buf);
+    buffer_ready.notify_all();
+  }
+}
@@ -0,0 +1,121 @@
+//===-------- block_reader.h, Newline aligned block input ----------------===//
+
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ *
+ * \brief block_reader splits an input stream into blocks of whole lines.
+ *
+ * The stream is only read forward.  The partial line at the end of each
+ * read is carried over to the front of the next block instead of seeking
+ * back, so pipes, sockets and other non-seekable streams can be read.
+ */
+#ifndef BLOCK_READER_H
+#define BLOCK_READER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <istream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+ * \brief The Block_reader fills buffers with complete lines from a stream.
+ *
+ * Every block ends with a newline except the last one, which holds the
+ * final line of the input when that line is not terminated.  A line longer
+ * than the block size makes the buffer grow until the whole line fits.
+ */
+class Block_reader {
+public:
+  /*!
+   * \param size the number of characters read into a block at once.
+   */
+  explicit Block_reader(size_t size) : block_size(size) {}
+
+  /*!
+   * \brief Designate the stream to read.  Anything carried over from the
+   *        previous stream is discarded.  nullptr detaches the reader.
+   */
+  void set_stream(std::istream* stream);
+
+  /*!
+   * \brief True if a stream is set.
+   */
+  bool has_stream() const { return input != nullptr; }
+
+  /*!
+   * \brief Reads the next block into buf, which is grown to at least the
+   *        block size.
+   *
+   * \returns the number of characters in the block, or 0 at the end of the
+   *          input.
+   */
+  size_t read(std::vector<char>& buf);
+
+private:
+  std::istream* input{nullptr};
+  std::vector<char> carry;
+  size_t block_size;
+};
+
+/*!
+ * \brief The Read_ahead reads blocks from a Block_reader on a background
+ *        thread, so the next blocks are read while the current one is
+ *        scanned.
+ *
+ * The reader must not be used by anyone else until the Read_ahead is
+ * destroyed.
+ */
+class Read_ahead {
+public:
+  /*!
+   * \param reader the reader to read blocks from.
+   * \param buffers the number of blocks held at once, including the one
+   *        returned by next().  At least two.
+   */
+  Read_ahead(Block_reader& reader, size_t buffers);
+  Read_ahead(const Read_ahead&) = delete;
+  Read_ahead& operator=(const Read_ahead&) = delete;
+  ~Read_ahead();
+
+  /*!
+   * \brief Waits for the next block.  The block returned by the previous
+   *        call is given back to be refilled.
+   *
+   * \param length set to the number of characters in the block, or 0 at
+   *        the end of the input.
+   *
+   * \returns the block, which stays valid until the next call.
+   */
+  const char* next(size_t& length);
+
+private:
+  struct Buffer {
+    std::vector<char> data;
+    size_t length{0};
+  };
+
+  /*!
+   * \brief Body of the reading thread.
+   */
+  void fill();
+
+  // member variables.
+  Block_reader& reader;
+  std::vector<Buffer> buffers;
+  std::deque<Buffer*> ready;
+  std::deque<Buffer*> free_buffers;
+  Buffer* current{nullptr};
+  std::mutex buffer_mutex;
+  std::condition_variable buffer_ready;
+  std::condition_variable buffer_free;
+  std::thread reading;
+  bool input_done{false};
+  bool stopping{false};
+  char _padding[6]{0};
+};
+
+#endif /*BLOCK_READER_H*/
@@ -0,0 +1,480 @@
+//===-------- compressed_input.cpp, Decompressing input streams ----------===//
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "compressed_input.h"
+
+namespace {
+
+/*!
+ * \brief Decompresses one format incrementally.
+ */
+class Decoder {
+public:
+  virtual ~Decoder() = default;
+
+  /*!
+   * \brief Decompresses from [in, in_end) into [out, out_end), advancing
+   *        in and out past what was consumed and produced.  With no input
+   *        left, output still buffered in the decoder is flushed.
+   *
+   * \returns false if the input is corrupt.
+   */
+  virtual bool decode(const char*& in, const char* in_end, char*& out,
+                      char* out_end) = 0;
+
+  /*!
+   * \brief True if the input so far ends on a frame boundary, which means
+   *        it is not truncated.
+   */
+  bool at_boundary() const { return boundary; }
+
+protected:
+  bool boundary{true};
+  char _padding[7]{0};
+};
+
+#ifdef HAVE_ZLIB
+class Gzip_decoder : public Decoder {
+public:
+  Gzip_decoder()
+  {
+    // 32 makes zlib accept the gzip header.
+    if (inflateInit2(&stream, 15 + 32) != Z_OK)
+      throw std::runtime_error("cannot initialize zlib");
+  }
+  Gzip_decoder(const Gzip_decoder&) = delete;
+  Gzip_decoder& operator=(const Gzip_decoder&) = delete;
+  ~Gzip_decoder() override { inflateEnd(&stream); }
+
+  bool decode(const char*& in, const char* in_end, char*& out,
+              char* out_end) override
+  {
+    stream.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(in));
+    stream.avail_in = static_cast<uInt>(in_end - in);
+    stream.next_out = reinterpret_cast<Bytef*>(out);
+    stream.avail_out = static_cast<uInt>(out_end - out);
+    int ret = inflate(&stream, Z_NO_FLUSH);
+    bool consumed = stream.next_in != reinterpret_cast<const Bytef*>(in);
+    in = reinterpret_cast<const char*>(stream.next_in);
+    out = reinterpret_cast<char*>(stream.next_out);
+    if (ret == Z_STREAM_END) {
+      // Another member may follow.
+      boundary = true;
+      return inflateReset(&stream) == Z_OK;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+      return false;
+    if (consumed)
+      boundary = false;
+    return true;
+  }
+
+private:
+  z_stream stream{};
+};
+#endif
+
+#ifdef HAVE_ZSTD
+class Zstd_decoder : public Decoder {
+public:
+  Zstd_decoder() : stream(ZSTD_createDStream())
+  {
+    if (!stream)
+      throw std::runtime_error("cannot initialize zstd");
+  }
+  Zstd_decoder(const Zstd_decoder&) = delete;
+  Zstd_decoder& operator=(const Zstd_decoder&) = delete;
+  ~Zstd_decoder() override { ZSTD_freeDStream(stream); }
+
+  bool decode(const char*& in, const char* in_end, char*& out,
+              char* out_end) override
+  {
+    ZSTD_inBuffer input = {in, static_cast<size_t>(in_end - in), 0};
+    ZSTD_outBuffer output = {out, static_cast<size_t>(out_end - out), 0};
+    size_t ret = ZSTD_decompressStream(stream, &output, &input);
+    in += input.pos;
+    out += output.pos;
+    if (ZSTD_isError(ret))
+      return false;
+    if (ret == 0)
+      boundary = true;
+    else if (input.pos > 0)
+      boundary = false;
+    return true;
+  }
+
+private:
+  ZSTD_DStream* stream;
+};
+#endif
+
+#ifdef HAVE_LZ4
+class Lz4_decoder : public Decoder {
+public:
+  Lz4_decoder()
+  {
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&context, LZ4F_VERSION)))
+      throw std::runtime_error("cannot initialize lz4");
+  }
+  Lz4_decoder(const Lz4_decoder&) = delete;
+  Lz4_decoder& operator=(const Lz4_decoder&) = delete;
+  ~Lz4_decoder() override { LZ4F_freeDecompressionContext(context); }
+
+  bool decode(const char*& in, const char* in_end, char*& out,
+              char* out_end) override
+  {
+    size_t in_size = static_cast<size_t>(in_end - in);
+    size_t out_size = static_cast<size_t>(out_end - out);
+    size_t ret =
+        LZ4F_decompress(context, out, &out_size, in, &in_size, nullptr);
+    in += in_size;
+    out += out_size;
+    if (LZ4F_isError(ret))
+      return false;
+    if (ret == 0)
+      boundary = true;
+    else if (in_size > 0)
+      boundary = false;
+    return true;
+  }
+
+private:
+  LZ4F_dctx* context{nullptr};
+};
+#endif
+
+std::unique_ptr<Decoder> make_decoder(Compression format)
+{
+  switch (format) {
+#ifdef HAVE_ZLIB
+  case Compression::gzip:
+    return std::make_unique<Gzip_decoder>();
+#endif
+#ifdef HAVE_ZSTD
+  case Compression::zstd:
+    return std::make_unique<Zstd_decoder>();
+#endif
+#ifdef HAVE_LZ4
+  case Compression::lz4:
+    return std::make_unique<Lz4_decoder>();
+#endif
+  default:
+    return nullptr;
+  }
+}
+
+/*!
+ * \brief An istream that owns its Decompressing_streambuf.
+ */
+class Decompressing_stream : public std::istream {
+public:
+  Decompressing_stream(std::unique_ptr<std::istream> source,
+                       Compression format)
+      : std::istream(nullptr), buf(std::move(source), format)
+  {
+    rdbuf(&buf);
+  }
+
+private:
+  Decompressing_streambuf buf;
+};
+
+/*!
+ * \brief A streambuf reading a file forward through a buffer of its own,
+ *        so its first bytes can be looked at without consuming them.
+ *        Pipes and devices cannot seek back to the start of the file.
+ */
+class Input_file_buf : public std::streambuf {
+public:
+  Input_file_buf() : buffer(65536)
+  {
+    setg(buffer.data(), buffer.data(), buffer.data());
+  }
+
+  bool open(const std::string& filename)
+  {
+    // Characters are only buffered in buffer.
+    file.pubsetbuf(nullptr, 0);
+    return file.open(filename, std::ios_base::in | std::ios_base::binary) !=
+           nullptr;
+  }
+
+  /*!
+   * \brief The next size characters, or fewer at the end of the file,
+   *        which are still read afterwards.
+   */
+  std::string_view peek(size_t size)
+  {
+    while (static_cast<size_t>(egptr() - gptr()) < size && fill()) {
+    }
+    return std::string_view(gptr(), std::min(size, buffered()));
+  }
+
+protected:
+  int_type underflow() override
+  {
+    if (gptr() == egptr() && !fill())
+      return traits_type::eof();
+    return traits_type::to_int_type(*gptr());
+  }
+
+  std::streamsize xsgetn(char* s, std::streamsize n) override
+  {
+    // Large reads take what is buffered and go straight to the file for
+    // the rest.
+    auto count = std::min(n, static_cast<std::streamsize>(buffered()));
+    std::memcpy(s, gptr(), static_cast<size_t>(count));
+    setg(eback(), gptr() + count, egptr());
+    if (n - count < static_cast<std::streamsize>(buffer.size()))
+      return count + std::streambuf::xsgetn(s + count, n - count);
+    return count + file.sgetn(s + count, n - count);
+  }
+
+private:
+  size_t buffered() const { return static_cast<size_t>(egptr() - gptr()); }
+
+  /*!
+   * \brief Reads more of the file after the characters not read yet.
+   *        Returns false at the end of the file.
+   */
+  bool fill()
+  {
+    size_t unread = buffered();
+    std::memmove(buffer.data(), gptr(), unread);
+    auto count =
+        file.sgetn(buffer.data() + unread,
+                   static_cast<std::streamsize>(buffer.size() - unread));
+    count = std::max<std::streamsize>(count, 0);
+    setg(buffer.data(), buffer.data(),
+         buffer.data() + unread + static_cast<size_t>(count));
+    return count > 0;
+  }
+
+  std::filebuf file;
+  std::vector<char> buffer;
+};
+
+/*!
+ * \brief An istream that owns its Input_file_buf.
+ */
+class Input_file_stream : public std::istream {
+public:
+  explicit Input_file_stream(const std::string& filename)
+      : std::istream(nullptr)
+  {
+    rdbuf(&buf);
+    if (!buf.open(filename))
+      setstate(std::ios_base::failbit);
+  }
+
+  std::string_view peek_bytes(size_t size) { return buf.peek(size); }
+
+private:
+  Input_file_buf buf;
+};
+
+} // namespace
+
+Compression detect_compression(const char* data, size_t size)
+{
+  if (size >= 2 && std::memcmp(data, "\x1f\x8b", 2) == 0)
+    return Compression::gzip;
+  if (size >= 4 && std::memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0)
+    return Compression::zstd;
+  if (size >= 4 && std::memcmp(data, "\x04\x22\x4d\x18", 4) == 0)
+    return Compression::lz4;
+  return Compression::none;
+}
+
+bool compression_supported(Compression format)
+{
+  switch (format) {
+  case Compression::none:
+    return true;
+  case Compression::gzip:
+#ifdef HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+  case Compression::zstd:
+#ifdef HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  case Compression::lz4:
+#ifdef HAVE_LZ4
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+Decompressing_streambuf::Decompressing_streambuf(
+    std::unique_ptr<std::istream> src, Compression fmt, size_t chunk_size)
+    : source(std::move(src)), format(fmt)
+{
+  for (auto& chunk : chunks)
+    chunk.data.resize(chunk_size);
+  decoder = std::thread(&Decompressing_streambuf::decompress, this);
+}
+
+Decompressing_streambuf::~Decompressing_streambuf()
+{
+  {
+    std::lock_guard<std::mutex> lock(chunk_mutex);
+    stopping = true;
+  }
+  chunk_free.notify_all();
+  decoder.join();
+}
+
+std::string Decompressing_streambuf::error() const
+{
+  std::lock_guard<std::mutex> lock(chunk_mutex);
+  return failure;
+}
+
+Decompressing_streambuf::int_type Decompressing_streambuf::underflow()
+{
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+  std::unique_lock<std::mutex> lock(chunk_mutex);
+  for (;;) {
+    if (in_use) {
+      // Hand the chunk just read back to the decompressing thread.
+      chunks[reading].full = false;
+      reading ^= 1;
+      in_use = false;
+      chunk_free.notify_all();
+    }
+    chunk_ready.wait(lock, [this] { return chunks[reading].full || finished; });
+    if (!chunks[reading].full)
+      return traits_type::eof();
+    in_use = true;
+    if (chunks[reading].length > 0)
+      break;
+  }
+  char* begin = chunks[reading].data.data();
+  setg(begin, begin, begin + chunks[reading].length);
+  return traits_type::to_int_type(*gptr());
+}
+
+void Decompressing_streambuf::decompress()
+{
+  std::unique_ptr<Decoder> codec;
+  try {
+    codec = make_decoder(format);
+  } catch (const std::runtime_error& e) {
+    std::lock_guard<std::mutex> lock(chunk_mutex);
+    failure = e.what();
+  }
+  if (!codec) {
+    std::lock_guard<std::mutex> lock(chunk_mutex);
+    if (failure.empty())
+      failure = "unsupported compression format";
+    finished = true;
+    chunk_ready.notify_all();
+    return;
+  }
+
+  std::vector<char> input(chunks[0].data.size());
+  const char* next = input.data();
+  const char* input_end = next;
+  bool source_done = false;
+  for (size_t writing = 0;; writing ^= 1) {
+    Chunk& chunk = chunks[writing];
+    {
+      std::unique_lock<std::mutex> lock(chunk_mutex);
+      chunk_free.wait(lock, [&] { return !chunk.full || stopping; });
+      if (stopping)
+        return;
+    }
+    char* out = chunk.data.data();
+    char* out_end = out + chunk.data.size();
+    bool failed = false;
+    while (out < out_end) {
+      if (next == input_end && !source_done) {
+        source->read(input.data(), static_cast<std::streamsize>(input.size()));
+        next = input.data();
+        input_end = next + source->gcount();
+        source_done = next == input_end;
+      }
+      char* produced = out;
+      if (!codec->decode(next, input_end, out, out_end)) {
+        failed = true;
+        break;
+      }
+      if (source_done && out == produced)
+        break;
+    }
+    std::lock_guard<std::mutex> lock(chunk_mutex);
+    chunk.length = static_cast<size_t>(out - chunk.data.data());
+    chunk.full = true;
+    if (failed)
+      failure = "corrupt compressed input";
+    else if (source_done && out < out_end && !codec->at_boundary())
+      failure = "truncated compressed input";
+    if (failed || (source_done && out < out_end)) {
+      finished = true;
+      chunk_ready.notify_all();
+      return;
+    }
+    chunk_ready.notify_all();
+  }
+}
+
+std::unique_ptr<std::istream> open_input_file(const std::string& filename)
+{
+  // The magic bytes are looked at without seeking back, so pipes and
+  // devices are read from their start.
+  auto file = std::make_unique<Input_file_stream>(filename);
+  if (!*file)
+    return file;
+  auto magic = file->peek_bytes(4);
+  auto format = detect_compression(magic.data(), magic.size());
+  if (format == Compression::none)
+    return file;
+  if (!compression_supported(format)) {
+    file->setstate(std::ios_base::failbit);
+    return file;
+  }
+  return std::make_unique<Decompressing_stream>(std::move(file), format);
+}
+
+std::string input_error(const std::istream& stream)
+{
+  const auto* buf =
+      dynamic_cast<const Decompressing_streambuf*>(stream.rdbuf());
+  return buf ? buf->error() : std::string();
+}
@@ -0,0 +1,125 @@
+//===-------- compressed_input.h, Decompressing input streams ------------===//
+
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ *
+ * \brief compressed_input reads gzip, zstd and lz4 compressed files as plain
+ *        streams.
+ *
+ * The compression format is detected from the magic bytes at the start of
+ * the file.  Decompression runs on its own thread into two chunks: while
+ * the reader consumes one chunk, the other one is being filled, so the cost
+ * of decompressing is hidden behind the scanning of the previous block.
+ */
+#ifndef COMPRESSED_INPUT_H
+#define COMPRESSED_INPUT_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * \brief The compression formats that can be detected.
+ */
+enum class Compression : char { none, gzip, zstd, lz4 };
+
+/*!
+ * \brief Detects the compression format from the first bytes of a file.
+ *        Four bytes are enough for every format.
+ */
+Compression detect_compression(const char* data, size_t size);
+
+/*!
+ * \brief True if this build can decompress the format.  gzip needs zlib,
+ *        zstd needs libzstd and lz4 needs liblz4 at build time.
+ */
+bool compression_supported(Compression format);
+
+/*!
+ * \brief The Decompressing_streambuf decompresses a source stream on a
+ *        separate thread.
+ *
+ * Concatenated gzip members, zstd frames and lz4 frames are decompressed
+ * one after another, as the command line tools do.  Corrupt or truncated
+ * input ends the stream early, after everything decompressed before the
+ * damage; error() tells why.
+ */
+class Decompressing_streambuf : public std::streambuf {
+public:
+  /*!
+   * \param source the compressed input, read only forward.
+   * \param format the compression format of source.  It must be supported.
+   * \param chunk_size the number of decompressed characters in each of the
+   *        two chunks.
+   */
+  Decompressing_streambuf(std::unique_ptr<std::istream> source,
+                          Compression format, size_t chunk_size = 1048576);
+  Decompressing_streambuf(const Decompressing_streambuf&) = delete;
+  Decompressing_streambuf& operator=(const Decompressing_streambuf&) = delete;
+  ~Decompressing_streambuf() override;
+
+  /*!
+   * \brief Why the stream ended early, or an empty string if it did not.
+   */
+  std::string error() const;
+
+protected:
+  int_type underflow() override;
+
+private:
+  /*!
+   * \brief One chunk of decompressed output.  A full chunk belongs to the
+   *        reader, any other to the decompressing thread.
+   */
+  struct Chunk {
+    std::vector<char> data;
+    size_t length{0};
+    bool full{false};
+    char _padding[7]{0};
+  };
+
+  /*!
+   * \brief Body of the decompressing thread.
+   */
+  void decompress();
+
+  // member variables.
+  std::unique_ptr<std::istream> source;
+  Chunk chunks[2];
+  mutable std::mutex chunk_mutex;
+  std::condition_variable chunk_ready;
+  std::condition_variable chunk_free;
+  std::string failure;
+  std::thread decoder;
+  size_t reading{0};
+  Compression format;
+  bool in_use{false};
+  bool finished{false};
+  bool stopping{false};
+  char _padding[4]{0};
+};
+
+/*!
+ * \brief Opens filename for reading, decompressing it if it is compressed
+ *        in a supported format.  The file is only read forward, so it may
+ *        be a named pipe or a device such as /dev/stdin.
+ *
+ * \returns the stream to read, which is in a failed state if the file cannot
+ *          be opened or its format is not supported.
+ */
+std::unique_ptr<std::istream> open_input_file(const std::string& filename);
+
+/*!
+ * \brief Why a stream opened by open_input_file() ended early, because its
+ *        compressed input is corrupt or truncated, or an empty string.
+ */
+std::string input_error(const std::istream& stream);
+
+#endif /*COMPRESSED_INPUT_H*/
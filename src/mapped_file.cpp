@@ -0,0 +1,52 @@
+//===-------- mapped_file.cpp, Read-only memory mapped files -------------===//
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ */
+
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+
+bool Mapped_file::open(const std::string& filename)
+{
+  close();
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat file_stats;
+  if (fstat(fd, &file_stats) != 0) {
+    ::close(fd);
+    return false;
+  }
+  auto size = static_cast<size_t>(file_stats.st_size);
+  if (size > 0) {
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      return false;
+    }
+    // The file is read front to back once, so let the kernel read ahead
+    // aggressively and drop pages behind us.
+    madvise(addr, size, MADV_SEQUENTIAL);
+    map_data = static_cast<const char*>(addr);
+  }
+  ::close(fd);
+  map_size = size;
+  opened = true;
+  return true;
+}
+
+void Mapped_file::close()
+{
+  if (map_data)
+    munmap(const_cast<char*>(map_data), map_size);
+  map_data = nullptr;
+  map_size = 0;
+  opened = false;
+}
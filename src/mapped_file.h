@@ -0,0 +1,61 @@
+//===-------- mapped_file.h, Read-only memory mapped files ---------------===//
+
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ *
+ * \brief mapped_file maps a whole file read-only into memory so it can be
+ *        scanned in place without copying it into a block.
+ */
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+/*!
+ * \brief The Mapped_file maps a file for sequential reading.  The mapping
+ *        stays valid until close() is called or the object is destroyed.
+ */
+class Mapped_file {
+public:
+  Mapped_file() = default;
+  Mapped_file(const Mapped_file&) = delete;
+  Mapped_file& operator=(const Mapped_file&) = delete;
+  ~Mapped_file() { close(); }
+
+  /*!
+   * \brief Maps filename, replacing any previous mapping.
+   *
+   * \returns true on success, false if the file cannot be opened or mapped.
+   */
+  bool open(const std::string& filename);
+
+  /*!
+   * \brief Unmaps the file.
+   */
+  void close();
+
+  /*!
+   * \brief The mapped bytes, or nullptr if the file is empty or not open.
+   */
+  const char* data() const { return map_data; }
+
+  /*!
+   * \brief The number of bytes mapped.
+   */
+  size_t size() const { return map_size; }
+
+  /*!
+   * \brief True if a file has been opened, even an empty one.
+   */
+  bool is_open() const { return opened; }
+
+private:
+  const char* map_data{nullptr};
+  size_t map_size{0};
+  bool opened{false};
+  char _padding[7]{0};
+};
+
+#endif /*MAPPED_FILE_H*/
@@ -0,0 +1,68 @@
+//===-------- metrics.cpp, Timers and counters of the normalizer ---------===//
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "metrics.h"
+
+const char* phase_name(Phase phase)
+{
+  switch (phase) {
+  case Phase::build_database:
+    return "build_database";
+  case Phase::read:
+    return "read";
+  case Phase::scan:
+    return "scan";
+  case Phase::callback:
+    return "callback";
+  case Phase::resolve:
+    return "resolve";
+  case Phase::materialize:
+    return "materialize";
+  }
+  return "unknown";
+}
+
+double ticks_per_second()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  // Calibrate the time stamp counter against the steady clock once.
+  static const double rate = [] {
+    auto clock_start = std::chrono::steady_clock::now();
+    uint64_t ticks_start = read_ticks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t ticks = read_ticks() - ticks_start;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - clock_start;
+    return static_cast<double>(ticks) / elapsed.count();
+  }();
+  return rate;
+#else
+  return 1e9;
+#endif
+}
+
+void Normal_metrics::merge(const struct Normal_metrics& other)
+{
+  for (size_t i = 0; i < phase_count; ++i) {
+    phase_ticks[i] += other.phase_ticks[i];
+    phase_calls[i] += other.phase_calls[i];
+  }
+  bytes += other.bytes;
+  lines += other.lines;
+  matches += other.matches;
+  line_cache_hits += other.line_cache_hits;
+  line_cache_misses += other.line_cache_misses;
+  line_cache_too_large += other.line_cache_too_large;
+  line_cache_evictions += other.line_cache_evictions;
+  if (type_matches.size() < other.type_matches.size())
+    type_matches.resize(other.type_matches.size());
+  for (size_t id = 0; id < other.type_matches.size(); ++id)
+    type_matches[id] += other.type_matches[id];
+}
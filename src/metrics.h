@@ -0,0 +1,159 @@
+//===-------- metrics.h, Timers and counters of the normalizer -----------===//
+
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ *
+ * \brief metrics times the phases of normalization with the time stamp
+ *        counter and counts bytes, lines and matches.
+ *
+ * Collection is switched on at run time (Line_normalizer::set_metrics) and
+ * can be compiled out entirely by defining NORMALIZOR_NO_METRICS, which the
+ * NORMALIZOR_METRICS=OFF cmake option does.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+/*!
+ * \brief The timed phases.  Phases nest: callback time includes resolve and
+ *        materialize, and scan time includes callback time.
+ */
+enum class Phase : char {
+  build_database, //!< compiling or loading the hyperscan database.
+  read,           //!< reading or mapping the next block.
+  scan,           //!< hs_scan of a block.
+  callback,       //!< the match callback.
+  resolve,        //!< resolving overlapping sections of a line.
+  materialize     //!< building the Normal_line, view or columns of a line.
+};
+
+constexpr size_t phase_count = 6;
+
+/*!
+ * \brief The name of phase, as used by testor and Python.
+ */
+const char* phase_name(Phase phase);
+
+#ifdef NORMALIZOR_NO_METRICS
+constexpr bool metrics_compiled = false;
+#else
+constexpr bool metrics_compiled = true;
+#endif
+
+/*!
+ * \brief Reads the time stamp counter, or a nanosecond clock where there is
+ *        none.
+ */
+inline uint64_t read_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<uint64_t>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+/*!
+ * \brief The number of ticks of read_ticks() per second, measured once.
+ */
+double ticks_per_second();
+
+/*!
+ * \brief The Normal_metrics struct holds the timers and counters.
+ */
+struct Normal_metrics {
+  void add(Phase phase, uint64_t ticks)
+  {
+    auto i = static_cast<size_t>(phase);
+    phase_ticks[i] += ticks;
+    ++phase_calls[i];
+  }
+
+  void count_match(size_t id)
+  {
+    ++matches;
+    if (id >= type_matches.size())
+      type_matches.resize(id + 1);
+    ++type_matches[id];
+  }
+
+  /*!
+   * \brief The time spent in phase.
+   */
+  double seconds(Phase phase) const
+  {
+    return static_cast<double>(phase_ticks[static_cast<size_t>(phase)]) /
+           ticks_per_second();
+  }
+
+  /*!
+   * \brief The number of times phase was entered.
+   */
+  uint64_t calls(Phase phase) const
+  {
+    return phase_calls[static_cast<size_t>(phase)];
+  }
+
+  /*!
+   * \brief Adds the timers and counters of other to these.
+   */
+  void merge(const struct Normal_metrics& other);
+
+  void clear() { *this = Normal_metrics(); }
+
+  std::array<uint64_t, phase_count> phase_ticks{};
+  std::array<uint64_t, phase_count> phase_calls{};
+  uint64_t bytes{0};
+  uint64_t lines{0};
+  // matches reported by hyperscan, before overlapping ones are resolved.
+  uint64_t matches{0};
+  // matches of each Normal_type, indexed by its id.
+  std::vector<uint64_t> type_matches;
+  // lines found in the line cache, lines resolved because they were not
+  // found, lines resolved but too large to be cached, and lines evicted
+  // from it.  See Line_normalizer::set_line_cache.
+  uint64_t line_cache_hits{0};
+  uint64_t line_cache_misses{0};
+  uint64_t line_cache_too_large{0};
+  uint64_t line_cache_evictions{0};
+};
+
+/*!
+ * \brief Adds the time from its construction to its destruction to a phase
+ *        of metrics.  Does nothing if metrics is nullptr.
+ */
+class Phase_timer {
+public:
+  Phase_timer(struct Normal_metrics* m, Phase p)
+      : metrics(metrics_compiled ? m : nullptr), phase(p),
+        start(metrics ? read_ticks() : 0)
+  {
+  }
+  Phase_timer(const Phase_timer&) = delete;
+  Phase_timer& operator=(const Phase_timer&) = delete;
+  ~Phase_timer()
+  {
+    if (metrics)
+      metrics->add(phase, read_ticks() - start);
+  }
+
+private:
+  struct Normal_metrics* metrics;
+  Phase phase;
+  char _padding[7]{0};
+  uint64_t start;
+};
+
+#endif /*METRICS_H*/
@@ -0,0 +1,219 @@
+//===-------- normal_file.cpp, Normalized results on disk ----------------===//
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ */
+
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mapped_file.h"
+#include "normal_file.h"
+#include "normalizor.h"
+
+namespace {
+
+/*!
+ * \brief Identifies files written by Normal_file_writer.  Bump the trailing
+ *        digit when the layout changes.
+ */
+constexpr std::array<char, 8> normal_file_magic = {'N', 'R', 'M', 'Z',
+                                                   'O', 'U', 'T', '2'};
+
+/*!
+ * \brief The size of the counts that start every block.
+ */
+constexpr size_t block_header_size = 4 * sizeof(uint64_t);
+
+void put_varint(std::vector<unsigned char>& out, uint64_t value)
+{
+  for (; value >= 0x80; value >>= 7)
+    out.push_back(static_cast<unsigned char>(value | 0x80));
+  out.push_back(static_cast<unsigned char>(value));
+}
+
+/*!
+ * \brief Decodes the varint at pos, moving pos past it.  Returns false if
+ *        it runs past end or is too long.
+ */
+bool get_varint(const unsigned char*& pos, const unsigned char* end,
+                uint64_t& value)
+{
+  value = 0;
+  for (unsigned shift = 0; pos < end && shift < 64; shift += 7) {
+    auto byte = *pos++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (byte < 0x80)
+      return true;
+  }
+  return false;
+}
+
+} // namespace
+
+bool Normal_file_writer::open(const std::string& filename, uint64_t types_hash)
+{
+  close();
+  out.open(filename, std::ios_base::out | std::ios_base::binary |
+                         std::ios_base::trunc);
+  out.write(normal_file_magic.data(), normal_file_magic.size());
+  out.write(reinterpret_cast<const char*>(&types_hash), sizeof(types_hash));
+  return static_cast<bool>(out);
+}
+
+bool Normal_file_writer::write_block(const struct Normal_block& block)
+{
+  if (!out.is_open())
+    return false;
+  encoded.clear();
+  for (size_t i = 0; i < block.size(); ++i) {
+    put_varint(encoded, block.line_offsets[i + 1] - block.line_offsets[i]);
+    size_t first = block.section_offsets[i];
+    size_t last = block.section_offsets[i + 1];
+    put_varint(encoded, last - first);
+    uint32_t prev_start = 0;
+    for (size_t s = first; s < last; ++s) {
+      // Sections of a line are sorted by start, but a section may nest in
+      // or overlap the previous one, so starts are relative to its start.
+      if (block.section_starts[s] < prev_start ||
+          block.section_ends[s] < block.section_starts[s])
+        return false;
+      put_varint(encoded, block.section_starts[s] - prev_start);
+      put_varint(encoded, block.section_ends[s] - block.section_starts[s]);
+      put_varint(encoded, static_cast<uint32_t>(block.section_ids[s]));
+      prev_start = block.section_starts[s];
+    }
+  }
+  std::array<uint64_t, 4> counts = {block.data.size(), block.size(),
+                                    block.section_starts.size(),
+                                    encoded.size()};
+  out.write(reinterpret_cast<const char*>(counts.data()), block_header_size);
+  out.write(block.data.data(), static_cast<std::streamsize>(block.data.size()));
+  out.write(reinterpret_cast<const char*>(encoded.data()),
+            static_cast<std::streamsize>(encoded.size()));
+  return static_cast<bool>(out);
+}
+
+bool Normal_file_writer::close()
+{
+  if (!out.is_open())
+    return true;
+  out.flush();
+  bool written = static_cast<bool>(out);
+  out.close();
+  return written;
+}
+
+bool Normal_file_reader::open(const std::string& filename)
+{
+  offset = 0;
+  types_hash = 0;
+  if (!file.open(filename))
+    return false;
+  if (file.size() < normal_file_magic.size() + sizeof(types_hash) ||
+      std::memcmp(file.data(), normal_file_magic.data(),
+                  normal_file_magic.size()) != 0) {
+    file.close();
+    return false;
+  }
+  std::memcpy(&types_hash, file.data() + normal_file_magic.size(),
+              sizeof(types_hash));
+  rewind();
+  return true;
+}
+
+void Normal_file_reader::rewind()
+{
+  offset = file.is_open() ? normal_file_magic.size() + sizeof(types_hash) : 0;
+}
+
+bool Normal_file_reader::next_block(const char** data, size_t* size)
+{
+  size_t remaining = file.size() - offset;
+  if (remaining < block_header_size)
+    return false;
+  std::array<uint64_t, 4> counts;
+  std::memcpy(counts.data(), file.data() + offset, block_header_size);
+  remaining -= block_header_size;
+  if (counts[0] > remaining || counts[3] > remaining - counts[0])
+    return false;
+  const char* bytes = file.data() + offset + block_header_size;
+  auto pos = reinterpret_cast<const unsigned char*>(bytes + counts[0]);
+  auto end = pos + counts[3];
+  line_offsets.assign(1, 0);
+  section_offsets.assign(1, 0);
+  sections.clear();
+  for (uint64_t line = 0; line < counts[1]; ++line) {
+    uint64_t length = 0;
+    uint64_t count = 0;
+    if (!get_varint(pos, end, length) || !get_varint(pos, end, count) ||
+        length > counts[0] - line_offsets.back())
+      return false;
+    size_t prev_start = 0;
+    for (uint64_t s = 0; s < count; ++s) {
+      uint64_t gap = 0;
+      uint64_t span = 0;
+      uint64_t id = 0;
+      if (!get_varint(pos, end, gap) || !get_varint(pos, end, span) ||
+          !get_varint(pos, end, id) || gap > length - prev_start)
+        return false;
+      size_t start = prev_start + gap;
+      // Sections must lie within their line, so end <= length, and have an
+      // int id.
+      if (span > length - start || id > INT_MAX)
+        return false;
+      prev_start = start;
+      sections.push_back(
+          Normal_section{start, start + span, static_cast<int>(id)});
+    }
+    line_offsets.push_back(line_offsets.back() + length);
+    section_offsets.push_back(sections.size());
+  }
+  if (line_offsets.back() != counts[0] || sections.size() != counts[2])
+    return false;
+  *data = bytes;
+  *size = counts[0];
+  offset += block_header_size + counts[0] + counts[3];
+  return true;
+}
+
+bool Normal_file_reader::read_block(struct Normal_block& columns)
+{
+  columns.clear();
+  const char* data = nullptr;
+  size_t size = 0;
+  if (!next_block(&data, &size))
+    return false;
+  columns.data.assign(data, data + size);
+  columns.line_offsets = line_offsets;
+  columns.section_offsets = section_offsets;
+  for (const auto& sec : sections) {
+    columns.section_starts.push_back(static_cast<uint32_t>(sec.start));
+    columns.section_ends.push_back(static_cast<uint32_t>(sec.end));
+    columns.section_ids.push_back(static_cast<int32_t>(sec.id));
+  }
+  return true;
+}
+
+const Normal_view_list& Normal_file_reader::read_view_block()
+{
+  views.clear();
+  const char* data = nullptr;
+  size_t size = 0;
+  if (!next_block(&data, &size))
+    return views;
+  for (size_t i = 0; i + 1 < line_offsets.size(); ++i) {
+    views.emplace_back(
+        std::string_view(data + line_offsets[i],
+                         line_offsets[i + 1] - line_offsets[i]),
+        Section_span(sections, section_offsets[i],
+                     section_offsets[i + 1] - section_offsets[i]));
+  }
+  return views;
+}
@@ -0,0 +1,157 @@
+//===-------- normal_file.h, Normalized results on disk ------------------===//
+
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ *
+ * \brief normal_file stores normalized blocks in a compact file and maps
+ *        them back, so the same input is scanned once for many analyses.
+ *
+ * The file starts with a header of 16 bytes: the magic "NRMZOUT2" and the
+ * normal_types_hash() of the Normal_types that produced the results.  Each
+ * block follows as four 64-bit counts (bytes of line data, lines, sections
+ * and bytes of encoded sections), the raw bytes of its lines, and its
+ * encoded lines and sections.  Every line is encoded as LEB128 varints:
+ * its length, its number of sections, and for each section the distance of
+ * its start from the start of the previous section, its length and its
+ * Normal_type id.  Sections are sorted by start but may overlap.  Integers are stored in the byte order of the host.
+ */
+#ifndef NORMAL_FILE_H
+#define NORMAL_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "normalizor.h"
+
+/*!
+ * \brief The Normal_file_writer writes normalized blocks to a file.
+ *
+ * \code{.cpp}
+ * Normal_file_writer writer;
+ * writer.open(my_output_name, norm.normal_types_hash());
+ * while (norm.get_normalized_block(columns))
+ *   writer.write_block(columns);
+ * writer.close();
+ * \endcode
+ */
+class Normal_file_writer {
+public:
+  Normal_file_writer() = default;
+  Normal_file_writer(const Normal_file_writer&) = delete;
+  Normal_file_writer& operator=(const Normal_file_writer&) = delete;
+  ~Normal_file_writer() { close(); }
+
+  /*!
+   * \brief Creates filename, replacing any file of that name, and writes
+   *        the header.
+   *
+   * \param types_hash the normal_types_hash() of the Normal_types the
+   *        blocks are normalized with.
+   *
+   * \returns true on success, false if the file cannot be written.
+   */
+  bool open(const std::string& filename, uint64_t types_hash);
+
+  /*!
+   * \brief Appends block.  Fingerprints and section values are not stored.
+   *
+   * \returns true on success, false if the file cannot be written or the
+   *          sections of a line are not sorted by start, or end before
+   *          they start, in which case nothing is written.
+   */
+  bool write_block(const struct Normal_block& block);
+
+  /*!
+   * \brief Flushes and closes the file.
+   *
+   * \returns true if every block was written.
+   */
+  bool close();
+
+private:
+  std::ofstream out;
+  // encoded lines and sections of the block being written.
+  std::vector<unsigned char> encoded;
+};
+
+/*!
+ * \brief The Normal_file_reader maps a file written by a Normal_file_writer
+ *        and returns its blocks in the forms a live scan returns them.
+ *
+ * \code{.cpp}
+ * Normal_file_reader reader;
+ * if (reader.open(my_output_name) &&
+ *     reader.normal_types_hash() == norm.normal_types_hash()) {
+ *   for (auto* views = &reader.read_view_block(); !views->empty();
+ *        views = &reader.read_view_block())
+ *     ... do something ...
+ * }
+ * \endcode
+ */
+class Normal_file_reader {
+public:
+  Normal_file_reader() = default;
+  Normal_file_reader(const Normal_file_reader&) = delete;
+  Normal_file_reader& operator=(const Normal_file_reader&) = delete;
+
+  /*!
+   * \brief Maps filename and reads its header.
+   *
+   * \returns true on success, false if the file cannot be mapped or was
+   *          not written by a Normal_file_writer.
+   */
+  bool open(const std::string& filename);
+
+  /*!
+   * \brief The normal_types_hash() recorded in the header.
+   */
+  uint64_t normal_types_hash() const { return types_hash; }
+
+  /*!
+   * \brief Stores the next block in columns, replacing its contents.
+   *
+   * \returns false at the end of the file, or at a block that is cut
+   *          short or corrupt.
+   */
+  bool read_block(struct Normal_block& columns);
+
+  /*!
+   * \brief The next block as views.  The lines point into the mapping and
+   *        stay valid until the file is closed; the sections are valid
+   *        until the next block is read.
+   *
+   * \returns the views, or an empty list at the end of the file, or at a
+   *          block that is cut short or corrupt.
+   */
+  const Normal_view_list& read_view_block();
+
+  /*!
+   * \brief Goes back to the first block.
+   */
+  void rewind();
+
+private:
+  /*!
+   * \brief Decodes the next block into line_offsets and sections, and
+   *        points data to its line bytes.  Returns false at the end of the
+   *        file or at a corrupt block.
+   */
+  bool next_block(const char** data, size_t* size);
+
+  Mapped_file file;
+  size_t offset{0};
+  uint64_t types_hash{0};
+  // offsets of the lines of the block, followed by its size, and the first
+  // section of every line, followed by the number of sections.
+  std::vector<size_t> line_offsets;
+  std::vector<size_t> section_offsets;
+  std::vector<struct Normal_section> sections;
+  Normal_view_list views;
+};
+
+#endif /*NORMAL_FILE_H*/
@@ -4,16 +4,30 @@
  * All rights reserved.
  */
 
-#include <cassert>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <istream>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
+#include <ostream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
 #include <hs/hs_common.h>
 #include <hs/hs_compile.h>
 #include <hs/hs_runtime.h>
@@ -22,52 +36,803 @@
 
 const size_t Line_normalizer::line_end_id = 0;
 
+/*!
+ * \brief Marks a hot loop to be compiled for several instruction sets, one
+ *        of which is picked when the library is loaded, in builds with
+ *        NORMALIZOR_TARGET_CLONES.
+ */
+#if defined(NORMALIZOR_TARGET_CLONES) && defined(__x86_64__) &&               \
+    defined(__GNUC__)
+#define NORMALIZOR_HOT_KERNEL                                                 \
+  __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3",             \
+                               "default")))
+#else
+#define NORMALIZOR_HOT_KERNEL
+#endif
+
+namespace {
+
+/*!
+ * \brief Identifies database files written by save_cached_database.  Bump
+ *        the trailing digit when the layout changes.
+ */
+constexpr std::array<char, 8> database_magic = {'N', 'R', 'M', 'Z',
+                                                'H', 'S', 'D', '2'};
+
+/*!
+ * \brief FNV-1a, used for hashing the Normal_types since std::hash is not
+ *        stable across builds.
+ */
+uint64_t fnv1a(uint64_t hash, const void* data, size_t len)
+{
+  auto bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/*!
+ * \brief Mixes data into hash a word at a time.  Faster than fnv1a on long
+ *        lines, which matters because every line is hashed.
+ */
+NORMALIZOR_HOT_KERNEL uint64_t mix_words(uint64_t hash, const char* data,
+                                         size_t len)
+{
+  for (; len >= sizeof(uint64_t); data += sizeof(uint64_t),
+                                  len -= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  return fnv1a(hash, data, len);
+}
+
+/*!
+ * \brief The template fingerprint of a line: its text without the line end,
+ *        with every section replaced by a marker and its Normal_type id.
+ */
+uint64_t line_fingerprint(const char* line, size_t length,
+                          const std::vector<struct Normal_section>& secs)
+{
+  if (length > 0 && line[length - 1] == '\n')
+    --length;
+  if (length > 0 && line[length - 1] == '\r')
+    --length;
+  uint64_t hash = 14695981039346656037ULL;
+  size_t pos = 0;
+  for (const auto& sec : secs) {
+    if (sec.start >= length)
+      break;
+    // A section nested in an earlier one is covered by its marker, as
+    // Line_renderer drops it.
+    if (sec.start < pos)
+      continue;
+    hash = mix_words(hash, line + pos, sec.start - pos);
+    unsigned char marker[5] = {0xff};
+    std::memcpy(marker + 1, &sec.id, sizeof(int32_t));
+    hash = fnv1a(hash, marker, sizeof(marker));
+    pos = std::max(pos, std::min(sec.end, length));
+  }
+  return mix_words(hash, line + pos, length - pos);
+}
+
+/*!
+ * \brief The cache file for the current Normal_types is named after their
+ *        hash and the platform the databases were compiled for, since a
+ *        database tuned for one CPU may not run on another.  The file holds
+ *        the magic, the hash and the serialized hyperscan databases.
+ */
+std::string cache_file_name(const std::string& dir, uint64_t hash,
+                            const hs_platform_info_t& platform)
+{
+  std::array<char, 48> name{};
+  std::snprintf(name.data(), name.size(), "%016llx-%02x%016llx.hsdb",
+                static_cast<unsigned long long>(hash), platform.tune,
+                static_cast<unsigned long long>(platform.cpu_features));
+  return (boost::filesystem::path(dir) / name.data()).string();
+}
+
+/*!
+ * \brief Adds the characters of the class escape \c (d, w, s or their
+ *        negations) to chars.  Returns false for any other escape.
+ */
+bool add_class_escape(char c, std::bitset<256>& chars)
+{
+  std::bitset<256> set;
+  switch (c) {
+  case 'd':
+  case 'D':
+    for (int ch = '0'; ch <= '9'; ++ch)
+      set.set(static_cast<size_t>(ch));
+    break;
+  case 'w':
+  case 'W':
+    for (int ch = 0; ch < 256; ++ch)
+      set[static_cast<size_t>(ch)] =
+          ch < 128 && (std::isalnum(ch) || ch == '_');
+    break;
+  case 's':
+  case 'S':
+    for (char ch : {' ', '\t', '\n', '\r', '\f', '\v'})
+      set.set(static_cast<unsigned char>(ch));
+    break;
+  default:
+    if (std::isalnum(static_cast<unsigned char>(c)))
+      return false;
+    set.set(static_cast<unsigned char>(c));
+    chars |= set;
+    return true;
+  }
+  chars |= std::isupper(static_cast<unsigned char>(c)) ? ~set : set;
+  return true;
+}
+
+/*!
+ * \brief Parses the bracket expression starting after the [ at re[pos].
+ *        Leaves pos after the closing ].
+ */
+bool parse_bracket(const std::string& re, size_t& pos, std::bitset<256>& chars)
+{
+  bool negate = pos < re.size() && re[pos] == '^';
+  if (negate)
+    ++pos;
+  std::bitset<256> set;
+  for (bool first = true; pos < re.size(); first = false) {
+    char c = re[pos++];
+    if (c == ']' && !first) {
+      chars |= negate ? ~set : set;
+      return true;
+    }
+    if (c == '\\') {
+      if (pos == re.size())
+        return false;
+      char escaped = re[pos++];
+      if (!std::isalnum(static_cast<unsigned char>(escaped))) {
+        c = escaped;
+      } else {
+        if (!add_class_escape(escaped, set))
+          return false;
+        continue;
+      }
+    }
+    auto lo = static_cast<unsigned char>(c);
+    auto hi = lo;
+    if (pos + 1 < re.size() && re[pos] == '-' && re[pos + 1] != ']') {
+      hi = static_cast<unsigned char>(re[pos + 1]);
+      pos += 2;
+      if (hi == '\\' || hi < lo)
+        return false;
+    }
+    for (size_t ch = lo; ch <= hi; ++ch)
+      set.set(ch);
+  }
+  return false;
+}
+
+/*!
+ * \brief Parses a regular expression made of one character class and a
+ *        quantifier that allows any longer run: X+ or X{n,}.  X is \d, \w,
+ *        \s, their negations, ., a bracket expression or a single character.
+ *
+ * \returns false if re is not of that form.
+ */
+bool parse_run(const std::string& re, unsigned int flags, struct Run_class& run)
+{
+  std::bitset<256> chars;
+  size_t pos = 0;
+  if (re.empty())
+    return false;
+  char c = re[pos++];
+  if (c == '[') {
+    if (!parse_bracket(re, pos, chars))
+      return false;
+  } else if (c == '\\') {
+    if (pos == re.size() || !add_class_escape(re[pos++], chars))
+      return false;
+  } else if (c == '.') {
+    chars.set();
+    if (!(flags & HS_FLAG_DOTALL))
+      chars.reset('\n');
+  } else if (std::strchr("()|*+?{", c)) {
+    return false;
+  } else {
+    chars.set(static_cast<unsigned char>(c));
+  }
+  if (flags & HS_FLAG_CASELESS) {
+    for (int ch = 'a'; ch <= 'z'; ++ch) {
+      auto lower = static_cast<size_t>(ch);
+      auto upper = static_cast<size_t>(ch - 'a' + 'A');
+      bool either = chars[lower] || chars[upper];
+      chars[lower] = either;
+      chars[upper] = either;
+    }
+  }
+  size_t min_length = 0;
+  if (re.compare(pos, std::string::npos, "+") == 0) {
+    min_length = 1;
+  } else if (pos < re.size() && re[pos] == '{' && re.size() > pos + 2 &&
+             re.compare(re.size() - 2, 2, ",}") == 0) {
+    auto digits = re.substr(pos + 1, re.size() - pos - 3);
+    if (digits.empty() || digits.size() > 6 ||
+        digits.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    min_length = std::stoul(digits);
+  }
+  if (min_length == 0 || chars.none())
+    return false;
+  run.chars = chars;
+  run.min_length = min_length;
+  return true;
+}
+
+/*!
+ * \brief True if the line end Normal_type matches exactly a newline or a
+ *        carriage return and newline, so lines can be split on newlines.
+ */
+bool has_standard_line_end(const std::map<size_t, struct Normal_type>& types)
+{
+  auto line_end = types.find(Line_normalizer::line_end_id);
+  if (line_end == types.end())
+    return false;
+  const auto& re = line_end->second.regex;
+  return line_end->second.mode == Match_mode::leftmost &&
+         (re == R"(\n|\r\n)" || re == R"(\r\n|\n)" || re == R"(\r?\n)" ||
+          re == R"(\n)");
+}
+
+/*!
+ * \brief True if the Normal_type belongs to the filtered database.
+ */
+bool is_filtered(size_t id, const struct Normal_type& nt)
+{
+  return id != Line_normalizer::line_end_id &&
+         nt.mode == Match_mode::leftmost && !nt.required_literal.empty();
+}
+
+/*!
+ * \brief The offset just past the first newline of data at or after from, or
+ *        the largest size_t if there is none.  memchr is vectorized by the C
+ *        library, so this runs at memory speed.
+ */
+size_t next_newline(const char* data, size_t length, size_t from)
+{
+  auto found =
+      static_cast<const char*>(std::memchr(data + from, '\n', length - from));
+  return found ? static_cast<size_t>(found - data) + 1
+               : std::numeric_limits<size_t>::max();
+}
+
+/*!
+ * \brief Hash of the parts of types that are compiled into the database.
+ *        Replacements and decoders are not.
+ */
+uint64_t types_hash(const std::map<size_t, struct Normal_type>& types)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (const auto& nt : types) {
+    auto id = static_cast<uint64_t>(nt.first);
+    auto flags = static_cast<uint64_t>(nt.second.flags);
+    hash = fnv1a(hash, &id, sizeof(id));
+    hash = fnv1a(hash, &flags, sizeof(flags));
+    hash = fnv1a(hash, &nt.second.mode, sizeof(nt.second.mode));
+    hash = fnv1a(hash, nt.second.regex.data(), nt.second.regex.size() + 1);
+    hash = fnv1a(hash, nt.second.required_literal.data(),
+                 nt.second.required_literal.size() + 1);
+  }
+  return hash;
+}
+
+} // namespace
+
 bool Line_normalizer::build_hs_database()
 {
+  std::shared_ptr<const struct Pattern_set> set;
+  {
+    Phase_timer timer(collect_metrics ? &metrics : nullptr,
+                      Phase::build_database);
+    set = compile_pattern_set(normal_types);
+  }
+  if (!set)
+    return false;
+  publish_pattern_set(std::move(set));
+  return adopt_pattern_set();
+}
+
+std::shared_ptr<const struct Pattern_set>
+Line_normalizer::compile_pattern_set(
+    std::map<size_t, struct Normal_type> types) const
+{
+  static std::atomic<uint64_t> last_version{0};
+  auto set = std::make_shared<struct Pattern_set>();
+  set->normal_types = std::move(types);
+  set->hash = types_hash(set->normal_types);
+  auto& plan = set->plan;
+  // Normal_types that differ from the published ones only in their
+  // replacements or decoders are scanned with the same database.
+  auto last = get_pattern_set();
+  if (last && last->hash == set->hash) {
+    set->db = last->db;
+    plan = last->plan;
+  } else if (!compile_databases(*set)) {
+    return nullptr;
+  }
+  plan.decoders.clear();
+  for (const auto& nt : set->normal_types) {
+    if (nt.second.decoder == Value_decoder::none)
+      continue;
+    if (nt.first >= plan.decoders.size())
+      plan.decoders.resize(nt.first + 1, Value_decoder::none);
+    plan.decoders[nt.first] = nt.second.decoder;
+  }
+  set->version = ++last_version;
+  return set;
+}
+
+bool Line_normalizer::compile_databases(struct Pattern_set& set) const
+{
+  auto& plan = set.plan;
+  bool standard_end = has_standard_line_end(set.normal_types);
+  bool scanned = false;
+  for (const auto& nt : set.normal_types) {
+    if (nt.second.mode == Match_mode::greedy_extend) {
+      if (nt.first >= plan.runs.size())
+        plan.runs.resize(nt.first + 1);
+      if (!parse_run(nt.second.regex, nt.second.flags, plan.runs[nt.first]))
+        return false;
+    }
+    if (standard_end && is_filtered(nt.first, nt.second)) {
+      if (nt.second.required_literal.find('\n') != std::string::npos)
+        return false;
+      plan.literals.push_back(nt.second.required_literal);
+    } else if (nt.first != line_end_id) {
+      scanned = true;
+    }
+  }
+  // The database must match something, so it keeps the line end if every
+  // other Normal_type is filtered.
+  plan.split_lines = standard_end && scanned;
+  bool filtered = !plan.literals.empty();
+
+  uint64_t hash = set.hash;
   hs_database_t* db = nullptr;
+  hs_database_t* filtered_db = nullptr;
+  if (!load_cached_database(hash, &db, filtered ? &filtered_db : nullptr)) {
+    if (!compile_hs_database(set.normal_types, plan, false, &db))
+      return false;
+    if (filtered &&
+        !compile_hs_database(set.normal_types, plan, true, &filtered_db)) {
+      hs_free_database(db);
+      return false;
+    }
+    save_cached_database(hash, db, filtered_db);
+  }
+  set.db.reset(db, &hs_free_database);
+  if (filtered_db)
+    plan.filtered_db.reset(filtered_db, &hs_free_database);
+  return true;
+}
+
+bool Line_normalizer::adopt_pattern_set()
+{
+  auto set = get_pattern_set();
+  if (!set || set == patterns)
+    return true;
+  // Growing the scratch keeps it large enough for the sets still used by
+  // blocks scanned elsewhere with clones of it.
+  hs_scratch_t* hs_sc = hs_scratch.release();
+  bool allocated =
+      hs_alloc_scratch(set->db.get(), &hs_sc) == HS_SUCCESS &&
+      (!set->plan.filtered_db ||
+       hs_alloc_scratch(set->plan.filtered_db.get(), &hs_sc) == HS_SUCCESS);
+  hs_scratch.reset(hs_sc);
+  if (!allocated)
+    return false;
+  patterns = std::move(set);
+  renderer.set_normal_types(patterns->normal_types);
+  if (!batch_update)
+    normal_types = patterns->normal_types;
+  return true;
+}
+
+bool Line_normalizer::compile_hs_database(
+    const std::map<size_t, struct Normal_type>& types,
+    const struct Scan_plan& plan, bool filtered, hs_database_t** db)
+{
   hs_compile_error_t* err = nullptr;
   std::vector<const char*> regexes;
   std::vector<unsigned int> ids;
   std::vector<unsigned int> flags;
-  regexes.reserve(normal_types.size());
-  for (const auto& nt : this->normal_types) {
+  regexes.reserve(types.size());
+  for (const auto& nt : types) {
+    bool in_filtered =
+        !plan.literals.empty() && is_filtered(nt.first, nt.second);
+    if (in_filtered != filtered ||
+        (nt.first == line_end_id && plan.split_lines))
+      continue;
     regexes.push_back(nt.second.regex.c_str());
-    flags.push_back(nt.second.flags | HS_FLAG_SOM_LEFTMOST);
+    // Runs are compiled without start of match, so they carry no SOM cost
+    // to bound.  The SOM horizon modes only apply to streaming databases,
+    // and hs_expr_ext has no horizon of its own, so blocks of leftmost
+    // types keep exact starts.
+    flags.push_back(nt.second.mode == Match_mode::leftmost
+                        ? nt.second.flags | HS_FLAG_SOM_LEFTMOST
+                        : nt.second.flags);
     ids.push_back(static_cast<unsigned int>(nt.first));
   }
 
   if (hs_compile_multi(regexes.data(), flags.data(), ids.data(),
-                       static_cast<unsigned int>(regexes.size()), HS_MODE_BLOCK,
-                       nullptr, &db, &err) != HS_SUCCESS) {
-    hs_free_database(db);
+                       static_cast<unsigned int>(regexes.size()),
+                       HS_MODE_BLOCK, &host_platform(), db,
+                       &err) != HS_SUCCESS) {
+    hs_free_database(*db);
     hs_free_compile_error(err);
+    *db = nullptr;
     return false;
   }
-  this->hs_db.reset(db);
-  hs_scratch_t* hs_sc = nullptr;
-  if (hs_alloc_scratch(hs_db.get(), &hs_sc) != HS_SUCCESS) {
-    hs_free_database(db);
-    hs_free_scratch(hs_sc);
+  return true;
+}
+
+uint64_t Line_normalizer::normal_types_hash() const
+{
+  return types_hash(normal_types);
+}
+
+const hs_platform_info_t& host_platform()
+{
+  static const hs_platform_info_t platform = [] {
+    hs_platform_info_t host{};
+    if (hs_populate_platform(&host) != HS_SUCCESS)
+      host = hs_platform_info_t{};
+    return host;
+  }();
+  return platform;
+}
+
+std::string Line_normalizer::database_cache_file() const
+{
+  if (database_cache.empty())
+    return std::string();
+  return cache_file_name(database_cache, normal_types_hash(), host_platform());
+}
+
+bool Line_normalizer::set_database_cache(const std::string& dir)
+{
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(dir, ec);
+  if (ec)
+    return false;
+  database_cache = dir;
+  // A database already built for these Normal_types is reused by
+  // build_hs_database() rather than loaded or compiled, so it is saved here.
+  auto set = get_pattern_set();
+  if (set && set->hash == normal_types_hash())
+    save_cached_database(set->hash, set->db.get(), set->plan.filtered_db.get());
+  return build_hs_database();
+}
+
+bool Line_normalizer::load_cached_database(uint64_t hash, hs_database_t** db,
+                                           hs_database_t** filtered) const
+{
+  if (database_cache.empty())
+    return false;
+  std::ifstream in(cache_file_name(database_cache, hash, host_platform()),
+                   std::ios_base::in | std::ios_base::binary);
+  std::array<char, database_magic.size()> magic{};
+  uint64_t file_hash = 0;
+  uint64_t length = 0;
+  if (!in.read(magic.data(), magic.size()) || magic != database_magic ||
+      !in.read(reinterpret_cast<char*>(&file_hash), sizeof(file_hash)) ||
+      file_hash != hash ||
+      !in.read(reinterpret_cast<char*>(&length), sizeof(length)))
+    return false;
+  std::string bytes((std::istreambuf_iterator<char>(in)),
+                    std::istreambuf_iterator<char>());
+  if (length > bytes.size() || (length < bytes.size()) != (filtered != nullptr))
+    return false;
+  if (hs_deserialize_database(bytes.data(), length, db) != HS_SUCCESS)
+    return false;
+  if (filtered &&
+      hs_deserialize_database(bytes.data() + length, bytes.size() - length,
+                              filtered) != HS_SUCCESS) {
+    hs_free_database(*db);
+    *db = nullptr;
     return false;
   }
-  this->hs_scratch.reset(hs_sc);
   return true;
 }
 
+bool Line_normalizer::save_cached_database(uint64_t hash,
+                                           const hs_database_t* db,
+                                           const hs_database_t* filtered) const
+{
+  if (database_cache.empty())
+    return false;
+  char* bytes = nullptr;
+  size_t length = 0;
+  if (hs_serialize_database(db, &bytes, &length) != HS_SUCCESS)
+    return false;
+  std::unique_ptr<char, decltype(&free)> owned(bytes, &free);
+  char* filtered_bytes = nullptr;
+  size_t filtered_length = 0;
+  if (filtered && hs_serialize_database(filtered, &filtered_bytes,
+                                        &filtered_length) != HS_SUCCESS)
+    return false;
+  std::unique_ptr<char, decltype(&free)> filtered_owned(filtered_bytes, &free);
+  auto stored_length = static_cast<uint64_t>(length);
+  // Write to a temporary name first so concurrent workers never load a
+  // partially written database.  Sets may be compiled on several threads
+  // of one process at once, so the name is unique within the process too.
+  static std::atomic<unsigned long> saves{0};
+  auto file_name = cache_file_name(database_cache, hash, host_platform());
+  auto tmp_name = file_name + ".tmp" + std::to_string(::getpid()) + "." +
+                  std::to_string(++saves);
+  {
+    std::ofstream out(tmp_name, std::ios_base::out | std::ios_base::binary |
+                                    std::ios_base::trunc);
+    out.write(database_magic.data(), database_magic.size());
+    out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+    out.write(reinterpret_cast<const char*>(&stored_length),
+              sizeof(stored_length));
+    out.write(bytes, static_cast<std::streamsize>(length));
+    out.write(filtered_bytes, static_cast<std::streamsize>(filtered_length));
+    if (!out) {
+      std::remove(tmp_name.c_str());
+      return false;
+    }
+  }
+  return std::rename(tmp_name.c_str(), file_name.c_str()) == 0;
+}
+
 const Normal_list& Line_normalizer::get_normalized_block()
 {
-  context.block = block.data();
-  context.parsed_lines.clear();
+  context.output = Line_output::lines;
+  normalize_next_block();
+  return context.parsed_lines;
+}
+
+const Normal_view_list& Line_normalizer::get_normalized_view_block()
+{
+  context.output = Line_output::views;
+  normalize_next_block();
+  return context.parsed_views;
+}
+
+bool Line_normalizer::get_normalized_block(struct Normal_block& columns)
+{
+  columns.clear();
+  context.output = Line_output::columns;
+  context.columns = &columns;
+  normalize_next_block();
+  context.columns = nullptr;
+  columns.data.assign(context.block, context.block + context.last_boundary);
+  return !columns.empty();
+}
+
+bool Line_normalizer::get_normalized_block(Normal_list& lines)
+{
+  context.recycle_lines(lines);
+  context.output = Line_output::lines;
+  normalize_next_block();
+  std::swap(lines, context.parsed_lines);
+  return !lines.empty();
+}
+
+bool Line_normalizer::get_rendered_block(std::string& out,
+                                         std::vector<size_t>& line_offsets)
+{
+  bool found = get_normalized_block(rendered_columns);
+  renderer.render_block(rendered_columns, out, line_offsets);
+  return found;
+}
+
+void Line_normalizer::begin_block()
+{
+  context.block = nullptr;
+  context.recycle_lines(context.parsed_lines);
+  context.parsed_views.clear();
+  context.block_sections.clear();
   context.cur_sections.clear();
   context.last_boundary = 0;
-  if (!stream_to_normalize || !build_hs_database())
-    return context.parsed_lines;
-  size_t char_read = read_block();
-  if (char_read == 0)
-    return context.parsed_lines;
-  hs_scan(hs_db.get(), block.data(), static_cast<unsigned int>(char_read), 0,
-          hs_scratch.get(), on_match, static_cast<void*>(&context));
-  return context.parsed_lines;
+  context.line_base = 0;
+  block_stats.clear();
+  context.fingerprints = statistics;
+  context.stats = statistics ? &block_stats : nullptr;
+  context.metrics = collect_metrics ? &metrics : nullptr;
+  // Sets published while the last block was scanned take effect here.
+  adopt_pattern_set();
+  context.plan = patterns ? &patterns->plan : nullptr;
+  block_version = patterns ? patterns->version : 0;
+  line_cache.set_pattern_version(block_version);
+  context.line_cache = line_cache.get_capacity() > 0 ? &line_cache : nullptr;
+}
+
+void Line_normalizer::normalize_next_block()
+{
+  begin_block();
+  if (!patterns)
+    return;
+  size_t char_read = 0;
+  {
+    Phase_timer timer(context.metrics, Phase::read);
+    if (mapped_file)
+      char_read = next_mapped_block(&context.block);
+    else if (read_ahead)
+      context.block = read_ahead->next(char_read);
+    else if (reader.has_stream()) {
+      char_read = reader.read(block);
+      context.block = block.data();
+    }
+  }
+  if (char_read == 0) {
+    // A damaged compressed input is reported once, and then stays at its
+    // end.
+    auto error = file_to_normalize ? input_error(*file_to_normalize)
+                                   : std::string();
+    if (!error.empty()) {
+      read_ahead.reset();
+      reader.set_stream(nullptr);
+      file_to_normalize.reset();
+      throw std::runtime_error(error);
+    }
+    return;
+  }
+  if (!scan_block(patterns->db.get(), hs_scratch.get(), char_read, context))
+    throw std::runtime_error("hyperscan failed to scan a block");
+  if (statistics)
+    run_stats.merge(block_stats);
+}
+
+const Normal_view_list& Line_normalizer::normalize_messages(
+    const std::vector<std::string_view>& messages,
+    std::vector<size_t>& message_lines)
+{
+  context.output = Line_output::views;
+  scan_messages(messages, message_lines);
+  return context.parsed_views;
+}
+
+void Line_normalizer::normalize_messages(
+    const std::vector<std::string_view>& messages,
+    struct Normal_block& columns, std::vector<size_t>& message_lines)
+{
+  columns.clear();
+  context.output = Line_output::columns;
+  context.columns = &columns;
+  scan_messages(messages, message_lines);
+  context.columns = nullptr;
+}
+
+void Line_normalizer::scan_messages(
+    const std::vector<std::string_view>& messages,
+    std::vector<size_t>& message_lines)
+{
+  begin_block();
+  context.scan_failed = false;
+  message_lines.assign(1, 0);
+  message_lines.reserve(messages.size() + 1);
+  auto* columns = context.output == Line_output::columns ? context.columns
+                                                          : nullptr;
+  for (auto message : messages) {
+    if (patterns && !message.empty()) {
+      // Each message is scanned where it is, as a block of its own.
+      context.block = message.data();
+      context.line_base = columns ? columns->data.size() : 0;
+      scan_text(patterns->db.get(), hs_scratch.get(), message.size(),
+                context);
+      if (columns)
+        columns->data.insert(columns->data.end(), message.begin(),
+                             message.end());
+    }
+    message_lines.push_back(columns ? columns->size()
+                                    : context.parsed_views.size());
+  }
+  context.block = nullptr;
+  if (context.scan_failed)
+    throw std::runtime_error("hyperscan failed to scan a message");
+  if (statistics)
+    run_stats.merge(block_stats);
+}
+
+bool Line_normalizer::scan_block(const hs_database_t* db,
+                                 hs_scratch_t* scratch, size_t length,
+                                 struct Line_context& ctx)
+{
+  ctx.recycle_lines(ctx.parsed_lines);
+  ctx.parsed_views.clear();
+  ctx.block_sections.clear();
+  ctx.scan_failed = false;
+  scan_text(db, scratch, length, ctx);
+  return !ctx.scan_failed;
+}
+
+void Line_normalizer::scan_text(const hs_database_t* db,
+                                hs_scratch_t* scratch, size_t length,
+                                struct Line_context& ctx)
+{
+  ctx.cur_sections.clear();
+  ctx.line_crossed = false;
+  ctx.filtered_sections.clear();
+  ctx.next_filtered = 0;
+  ctx.last_boundary = 0;
+  ctx.block_length = length;
+  ctx.last_runs.assign(ctx.plan ? ctx.plan->runs.size() : 0,
+                       Normal_section{0, 0, 0});
+  ctx.next_line_end = std::numeric_limits<size_t>::max();
+  if (ctx.plan && ctx.plan->split_lines)
+    ctx.next_line_end = next_newline(ctx.block, length, 0);
+  {
+    Phase_timer timer(ctx.metrics, Phase::scan);
+    if (ctx.plan && ctx.plan->filtered_db)
+      scan_filtered(scratch, ctx);
+    if (hs_scan(db, ctx.block, static_cast<unsigned int>(length), 0,
+                scratch, on_match, static_cast<void*>(&ctx)) != HS_SUCCESS)
+      ctx.scan_failed = true;
+  }
+  if (ctx.metrics)
+    ctx.metrics->bytes += length;
+  // Lines after the last match, and the final line of the input, which
+  // may have no line end.
+  end_lines(ctx, length);
+  if (ctx.last_boundary < length)
+    end_line(ctx, length);
+}
+
+void Line_normalizer::scan_filtered(hs_scratch_t* scratch,
+                                    struct Line_context& ctx)
+{
+  std::string_view data(ctx.block, ctx.block_length);
+  auto& starts = ctx.filtered_lines;
+  starts.clear();
+  for (const auto& literal : ctx.plan->literals) {
+    size_t pos = data.find(literal);
+    while (pos != std::string_view::npos) {
+      size_t start = data.rfind('\n', pos);
+      starts.push_back(start == std::string_view::npos ? 0 : start + 1);
+      size_t end = data.find('\n', pos);
+      if (end == std::string_view::npos)
+        break;
+      pos = data.find(literal, end + 1);
+    }
+  }
+  std::sort(starts.begin(), starts.end());
+  starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+  for (size_t start : starts) {
+    size_t end = next_newline(ctx.block, ctx.block_length, start);
+    end = std::min(end, ctx.block_length);
+    ctx.filtered_line = start;
+    if (hs_scan(ctx.plan->filtered_db.get(), ctx.block + start,
+                static_cast<unsigned int>(end - start), 0, scratch,
+                on_filtered_match, static_cast<void*>(&ctx)) != HS_SUCCESS)
+      ctx.scan_failed = true;
+  }
+}
+
+int Line_normalizer::on_filtered_match(unsigned int id,
+                                       unsigned long long start,
+                                       unsigned long long to, unsigned int,
+                                       void* scratch_ctx)
+{
+  auto ctx = static_cast<struct Line_context*>(scratch_ctx);
+  Phase_timer timer(ctx->metrics, Phase::callback);
+  if (ctx->metrics)
+    ctx->metrics->count_match(id);
+  ctx->filtered_sections.push_back(
+      Normal_section{ctx->filtered_line + static_cast<size_t>(start),
+                     ctx->filtered_line + static_cast<size_t>(to),
+                     static_cast<int>(id)});
+  return 0;
+}
+
+void Line_normalizer::end_lines(struct Line_context& ctx, size_t to)
+{
+  while (ctx.next_line_end <= to) {
+    size_t end = ctx.next_line_end;
+    ctx.next_line_end = next_newline(ctx.block, ctx.block_length, end);
+    end_line(ctx, end);
+  }
 }
 
 int Line_normalizer::on_match(unsigned int id, unsigned long long start,
@@ -75,95 +840,571 @@ int Line_normalizer::on_match(unsigned int id, unsigned long long start,
                               void* scractch_ctx)
 {
   auto ctx = static_cast<struct Line_context*>(scractch_ctx);
+  Phase_timer timer(ctx->metrics, Phase::callback);
+  // A match that ends with a line belongs to the next line, as if the line
+  // end had been reported first.
+  end_lines(*ctx, static_cast<size_t>(to));
   if (id == line_end_id) {
     // Finished parsing a line, so need to build a Normal_line.
-    if (!ctx->cur_sections.empty()) {
-      size_t longest = ctx->cur_sections.begin()->second.second;
-      auto sec_it = ctx->cur_sections.begin();
-      ++sec_it;
-      auto end_it = ctx->cur_sections.end();
-      // This section is to remove sections that are contained in larger ones.
-      while (sec_it != end_it) {
-        if (sec_it->first < longest) {
-          if (sec_it->second.second < longest) {
-            // Wholly contained in previous--Must be shorter so remove.
-            sec_it = ctx->cur_sections.erase(sec_it);
-          } else {
-            // Intersection--must pick longer match or lower id
-            auto prev_it = std::prev(sec_it);
-            assert(prev_it != end_it);
-            if (prev_it->second.second - prev_it->first >
-                    sec_it->second.second - sec_it->first ||
-                (prev_it->second.second - prev_it->first ==
-                     sec_it->second.second - sec_it->first &&
-                 prev_it->second.first < sec_it->second.first)) {
-              // Previous is longer or lower ID--so keep previous.
-              sec_it = ctx->cur_sections.erase(sec_it);
-            } else {
-              // Previous is shorter, or higher id, delete previous.
-              sec_it = ctx->cur_sections.erase(prev_it);
-              ++sec_it;
-            }
-          }
-        } else {
-          longest = sec_it->second.second;
-          ++sec_it;
-        }
-      }
+    end_line(*ctx, static_cast<size_t>(to));
+  } else {
+    if (ctx->metrics)
+      ctx->metrics->count_match(id);
+    if (id < ctx->last_runs.size() && ctx->plan->runs[id].min_length > 0) {
+      extend_run(*ctx, id, static_cast<size_t>(to));
+    } else if (start >= ctx->last_boundary) {
+      ctx->cur_sections.push_back(
+          Normal_section{static_cast<size_t>(start - ctx->last_boundary),
+                         static_cast<size_t>(to - ctx->last_boundary),
+                         static_cast<int>(id)});
+    } else if (to > ctx->last_boundary) {
+      ctx->line_crossed = true;
+    }
+  }
+  return 0;
+}
+
+void Line_normalizer::extend_run(struct Line_context& ctx, unsigned int id,
+                                 size_t to)
+{
+  // Every later match of a run that was already grown ends inside it.
+  auto& last = ctx.last_runs[id];
+  if (to <= last.end && to > last.start)
+    return;
+  const auto& run = ctx.plan->runs[id];
+  auto data = reinterpret_cast<const unsigned char*>(ctx.block);
+  size_t end = to;
+  if (end > ctx.last_boundary && data[end - 1] == '\n')
+    --end;
+  size_t start = end;
+  while (start > ctx.last_boundary && run.chars[data[start - 1]])
+    --start;
+  while (end < ctx.block_length && data[end] != '\n' && run.chars[data[end]])
+    ++end;
+  last = Normal_section{start, end, static_cast<int>(id)};
+  if (end - start < run.min_length)
+    return;
+  ctx.cur_sections.push_back(Normal_section{start - ctx.last_boundary,
+                                            end - ctx.last_boundary,
+                                            static_cast<int>(id)});
+}
+
+void Line_normalizer::end_line(struct Line_context& ctx, size_t to)
+{
+  for (; ctx.next_filtered < ctx.filtered_sections.size() &&
+         ctx.filtered_sections[ctx.next_filtered].start < to;
+       ++ctx.next_filtered) {
+    const auto& sec = ctx.filtered_sections[ctx.next_filtered];
+    ctx.cur_sections.push_back(Normal_section{sec.start - ctx.last_boundary,
+                                              sec.end - ctx.last_boundary,
+                                              sec.id});
+  }
+  // The matches of a line depend only on its bytes unless one was dropped
+  // for starting in an earlier line, and a line that failed to scan may
+  // lack sections, so only the others are looked up and cached.
+  bool cacheable = ctx.line_cache && ctx.plan->split_lines &&
+                   !ctx.line_crossed && !ctx.scan_failed;
+  ctx.line_crossed = false;
+  std::string_view line(ctx.block + ctx.last_boundary,
+                        to - ctx.last_boundary);
+  uint64_t hash = 0;
+  if (cacheable) {
+    hash = mix_words(14695981039346656037ULL, line.data(), line.size());
+    const auto* secs = ctx.line_cache->find(line, hash);
+    if (secs) {
+      if (ctx.metrics)
+        ++ctx.metrics->line_cache_hits;
+      ctx.cur_sections.assign(secs->begin(), secs->end());
+      emit_line(ctx, to);
+      return;
     }
-    ctx->parsed_lines.emplace_back(
-        std::string(&ctx->block[ctx->last_boundary], to - ctx->last_boundary),
-        ctx->cur_sections);
-    ctx->last_boundary = to;
+  }
+  {
+    Phase_timer timer(ctx.metrics, Phase::resolve);
+    resolve_sections(ctx.cur_sections);
+  }
+  bool too_large =
+      cacheable && !ctx.line_cache->fits(line, ctx.cur_sections.size());
+  if (ctx.line_cache && ctx.metrics) {
+    if (too_large)
+      ++ctx.metrics->line_cache_too_large;
+    else
+      ++ctx.metrics->line_cache_misses;
+  }
+  if (cacheable && !too_large) {
+    size_t evicted = ctx.line_cache->insert(line, hash, ctx.cur_sections);
+    if (ctx.metrics)
+      ctx.metrics->line_cache_evictions += evicted;
+  }
+  emit_line(ctx, to);
+}
+
+void Line_normalizer::decode_sections(struct Line_context& ctx, size_t to)
+{
+  const auto& decoders = ctx.plan->decoders;
+  std::string_view line(ctx.block + ctx.last_boundary, to - ctx.last_boundary);
+  for (const auto& sec : ctx.cur_sections) {
+    auto id = static_cast<size_t>(sec.id);
+    auto decoder = id < decoders.size() ? decoders[id] : Value_decoder::none;
+    ctx.columns->section_values.push_back(
+        decoder == Value_decoder::none
+            ? no_value
+            : decode_value(decoder,
+                           line.substr(sec.start, sec.end - sec.start)));
+  }
+}
+
+void Line_normalizer::emit_line(struct Line_context& ctx, size_t to)
+{
+  Phase_timer timer(ctx.metrics, Phase::materialize);
+  if (ctx.metrics)
+    ++ctx.metrics->lines;
+  uint64_t fingerprint = 0;
+  if (ctx.fingerprints) {
+    fingerprint = line_fingerprint(ctx.block + ctx.last_boundary,
+                                   to - ctx.last_boundary, ctx.cur_sections);
+    if (ctx.stats)
+      ctx.stats->count_line(fingerprint, ctx.cur_sections);
+  }
+  if (ctx.output == Line_output::columns) {
+    auto& cols = *ctx.columns;
+    for (const auto& sec : ctx.cur_sections) {
+      cols.section_starts.push_back(static_cast<uint32_t>(sec.start));
+      cols.section_ends.push_back(static_cast<uint32_t>(sec.end));
+      cols.section_ids.push_back(static_cast<int32_t>(sec.id));
+    }
+    if (ctx.plan && !ctx.plan->decoders.empty())
+      decode_sections(ctx, to);
+    cols.section_offsets.push_back(cols.section_starts.size());
+    cols.line_offsets.push_back(ctx.line_base + to);
+    if (ctx.fingerprints)
+      cols.fingerprints.push_back(fingerprint);
+  } else if (ctx.output == Line_output::views) {
+    size_t first = ctx.block_sections.size();
+    ctx.block_sections.insert(ctx.block_sections.end(),
+                              ctx.cur_sections.begin(),
+                              ctx.cur_sections.end());
+    ctx.parsed_views.emplace_back(
+        std::string_view(&ctx.block[ctx.last_boundary], to - ctx.last_boundary),
+        Section_span(ctx.block_sections, first, ctx.cur_sections.size()),
+        fingerprint);
   } else {
-    if (start >= ctx->last_boundary) {
-      auto relative_start = static_cast<size_t>(start - ctx->last_boundary);
-      auto relative_end = static_cast<size_t>(to - ctx->last_boundary);
-      auto start_it = ctx->cur_sections.find(relative_start);
-      if (start_it == ctx->cur_sections.end() ||
-          ctx->cur_sections[relative_start].second < relative_end ||
-          (ctx->cur_sections[relative_start].second == relative_end &&
-           static_cast<unsigned int>(ctx->cur_sections[relative_start].first) >
-               id)) {
-        ctx->cur_sections[relative_start] = std::make_pair(id, relative_end);
+    if (ctx.spare_lines.empty()) {
+      Sections secs;
+      ctx.parsed_lines.emplace_back(std::string(), secs);
+    } else {
+      ctx.parsed_lines.push_back(std::move(ctx.spare_lines.back()));
+      ctx.spare_lines.pop_back();
+    }
+    auto& line = ctx.parsed_lines.back();
+    line.line.assign(&ctx.block[ctx.last_boundary], to - ctx.last_boundary);
+    for (const auto& sec : ctx.cur_sections) {
+      if (ctx.spare_sections.empty()) {
+        line.sections.emplace_hint(line.sections.end(), sec.start,
+                                   std::make_pair(sec.id, sec.end));
+        continue;
       }
+      auto node = std::move(ctx.spare_sections.back());
+      ctx.spare_sections.pop_back();
+      node.key() = sec.start;
+      node.mapped() = std::make_pair(sec.id, sec.end);
+      line.sections.insert(line.sections.end(), std::move(node));
     }
+    line.fingerprint = fingerprint;
   }
-  return 0;
+  ctx.cur_sections.clear();
+  ctx.last_boundary = to;
 }
 
-size_t Line_normalizer::read_block()
+void Line_cache::set_capacity(size_t bytes)
 {
-  if (!stream_to_normalize)
-    return 0;
-  stream_to_normalize->read(block.data(), blocksize);
-  if (stream_to_normalize->eof()) {
-    return static_cast<size_t>(stream_to_normalize->gcount());
+  capacity = bytes;
+  while (used > capacity)
+    evict_one();
+}
+
+void Line_cache::set_pattern_version(uint64_t pattern_version)
+{
+  if (pattern_version != version) {
+    clear();
+    version = pattern_version;
   }
-  if (!stream_to_normalize)
+}
+
+const std::vector<struct Normal_section>*
+Line_cache::find(std::string_view line, uint64_t hash)
+{
+  auto found = index.find(hash);
+  if (found == index.end())
+    return nullptr;
+  auto& entry = entries[found->second];
+  if (entry.line != line)
+    return nullptr;
+  entry.referenced = true;
+  return &entry.sections;
+}
+
+size_t Line_cache::insert(std::string_view line, uint64_t hash,
+                          const std::vector<struct Normal_section>& secs)
+{
+  if (!fits(line, secs.size()))
     return 0;
+  size_t needed = entry_memory(line.size(), secs.size());
+  // A line with the hash of another one replaces it.
+  auto found = index.find(hash);
+  if (found != index.end()) {
+    auto& entry = entries[found->second];
+    used -= entry_memory(entry.line.size(), entry.sections.size());
+    entry.live = false;
+    free_slots.push_back(found->second);
+    index.erase(found);
+  }
+  size_t evicted = 0;
+  for (; used + needed > capacity; ++evicted)
+    evict_one();
+  size_t slot = entries.size();
+  if (free_slots.empty()) {
+    entries.emplace_back();
+  } else {
+    slot = free_slots.back();
+    free_slots.pop_back();
+  }
+  auto& entry = entries[slot];
+  entry.line.assign(line.data(), line.size());
+  entry.sections.assign(secs.begin(), secs.end());
+  entry.hash = hash;
+  entry.live = true;
+  entry.referenced = false;
+  index.emplace(hash, slot);
+  used += needed;
+  return evicted;
+}
+
+void Line_cache::evict_one()
+{
+  for (;;) {
+    if (hand >= entries.size())
+      hand = 0;
+    auto& entry = entries[hand++];
+    if (!entry.live)
+      continue;
+    if (entry.referenced) {
+      entry.referenced = false;
+      continue;
+    }
+    used -= entry_memory(entry.line.size(), entry.sections.size());
+    entry.live = false;
+    free_slots.push_back(hand - 1);
+    index.erase(entry.hash);
+    return;
+  }
+}
 
-  // walk stream back to last newline.
-  long chars_read = stream_to_normalize->gcount();
-  long last_newline = chars_read;
-  for (;
-       last_newline > 0 && block[static_cast<size_t>(last_newline - 1)] != '\n';
-       --last_newline) {
+void Line_cache::clear()
+{
+  index.clear();
+  entries.clear();
+  free_slots.clear();
+  hand = 0;
+  used = 0;
+}
+
+void Line_context::recycle_lines(Normal_list& lines)
+{
+  // In reverse, so line i of the next block reuses line i of this one.
+  for (auto it = lines.rbegin(); it != lines.rend(); ++it) {
+    while (!it->sections.empty())
+      spare_sections.push_back(it->sections.extract(it->sections.begin()));
+    spare_lines.push_back(std::move(*it));
   }
-  stream_to_normalize->seekg(
-      static_cast<std::streamoff>(last_newline - chars_read),
-      std::ios_base::cur);
-  return static_cast<size_t>(last_newline);
+  lines.clear();
+}
+
+void Normal_stats::count_line(uint64_t fingerprint,
+                              const std::vector<struct Normal_section>& secs)
+{
+  ++lines;
+  ++templates[fingerprint];
+  for (const auto& sec : secs) {
+    auto id = static_cast<size_t>(sec.id);
+    if (id >= type_matches.size())
+      type_matches.resize(id + 1);
+    ++type_matches[id];
+  }
+}
+
+void Normal_stats::merge(const struct Normal_stats& other)
+{
+  lines += other.lines;
+  for (const auto& tmpl : other.templates)
+    templates[tmpl.first] += tmpl.second;
+  if (type_matches.size() < other.type_matches.size())
+    type_matches.resize(other.type_matches.size());
+  for (size_t id = 0; id < other.type_matches.size(); ++id)
+    type_matches[id] += other.type_matches[id];
+}
+
+NORMALIZOR_HOT_KERNEL void
+resolve_sections(std::vector<struct Normal_section>& matches)
+{
+  if (matches.empty())
+    return;
+  // By start, then longest first, then lowest id first: the first match of
+  // each start is the one kept for that start.
+  std::sort(matches.begin(), matches.end(),
+            [](const struct Normal_section& lhs,
+               const struct Normal_section& rhs) {
+              if (lhs.start != rhs.start)
+                return lhs.start < rhs.start;
+              if (lhs.end != rhs.end)
+                return lhs.end > rhs.end;
+              return lhs.id < rhs.id;
+            });
+  // Kept sections are compacted to the front; kept is the last one kept.
+  size_t kept = 0;
+  size_t longest = matches.front().end;
+  size_t last_start = matches.front().start;
+  for (size_t i = 1; i < matches.size(); ++i) {
+    const auto sec = matches[i];
+    if (sec.start == last_start) {
+      // Shorter, or higher id, than the first match of this start.
+      continue;
+    }
+    last_start = sec.start;
+    if (sec.start < longest) {
+      if (sec.end < longest) {
+        // Wholly contained in previous--Must be shorter so remove.
+        continue;
+      }
+      // Intersection--must pick longer match or lower id
+      const auto& prev = matches[kept];
+      if (prev.end - prev.start > sec.end - sec.start ||
+          (prev.end - prev.start == sec.end - sec.start && prev.id < sec.id)) {
+        // Previous is longer or lower ID--so keep previous.
+        continue;
+      }
+      // Previous is shorter, or higher id, replace previous.
+      matches[kept] = sec;
+    } else {
+      longest = sec.end;
+      matches[++kept] = sec;
+    }
+  }
+  matches.resize(kept + 1);
+}
+
+size_t Line_normalizer::next_mapped_block(const char** data)
+{
+  size_t remaining = mapped_file->size() - mapped_offset;
+  if (remaining == 0)
+    return 0;
+  const char* first = mapped_file->data() + mapped_offset;
+  size_t length = std::min(remaining, blocksize);
+  if (length < remaining) {
+    // end the block at the last newline.
+    for (; length > 0 && first[length - 1] != '\n'; --length) {
+    }
+    if (length == 0) {
+      // The line is longer than a block, so the block is the whole line.
+      auto newline = static_cast<const char*>(
+          std::memchr(first + blocksize, '\n', remaining - blocksize));
+      length = newline ? static_cast<size_t>(newline - first) + 1 : remaining;
+    }
+  }
+  *data = first;
+  mapped_offset += length;
+  return length;
 }
 
 void Line_normalizer::set_input_stream(const std::string& stream)
 {
-  file_to_normalize =
-      std::make_unique<std::ifstream>(stream, std::ios_base::in);
-  stream_to_normalize = static_cast<std::istream*>(file_to_normalize.get());
+  set_input_stream(open_input_file(stream));
+}
+
+void Line_normalizer::set_input_stream(std::unique_ptr<std::istream> stream)
+{
+  read_ahead.reset();
+  mapped_file.reset();
+  file_to_normalize = std::move(stream);
+  reader.set_stream(file_to_normalize.get());
+  if (read_ahead_buffers > 1)
+    read_ahead = std::make_unique<Read_ahead>(reader, read_ahead_buffers);
 }
 
 void Line_normalizer::set_input_stream(std::istream& stream)
 {
-  stream_to_normalize = &stream;
+  read_ahead.reset();
+  mapped_file.reset();
+  reader.set_stream(&stream);
+  if (read_ahead_buffers > 1)
+    read_ahead = std::make_unique<Read_ahead>(reader, read_ahead_buffers);
+}
+
+bool Line_normalizer::map_input_file(const std::string& filename)
+{
+  read_ahead.reset();
+  reader.set_stream(nullptr);
+  file_to_normalize.reset();
+  mapped_offset = 0;
+  // A new mapping, since blocks of the previous one may still be scanned.
+  auto file = std::make_shared<Mapped_file>();
+  mapped_file.reset();
+  if (!file->open(filename))
+    return false;
+  mapped_file = std::move(file);
+  if (detect_compression(mapped_file->data(), mapped_file->size()) !=
+      Compression::none) {
+    set_input_stream(filename);
+    return static_cast<bool>(*file_to_normalize);
+  }
+  return true;
+}
+
+void Line_renderer::set_normal_types(
+    const std::map<size_t, struct Normal_type>& types)
+{
+  rules.clear();
+  if (types.empty())
+    return;
+  rules.resize(types.rbegin()->first + 1);
+  for (const auto& nt : types) {
+    rules[nt.first].replacement = nt.second.replacement;
+    rules[nt.first].policy = get_policy(nt.first);
+  }
+}
+
+void Line_renderer::set_policy(size_t nt_id, Render_policy policy)
+{
+  policies[nt_id] = policy;
+  if (nt_id < rules.size())
+    rules[nt_id].policy = policy;
+}
+
+Render_policy Line_renderer::get_policy(size_t nt_id) const
+{
+  auto policy_it = policies.find(nt_id);
+  return policy_it == policies.end() ? Render_policy::replace
+                                     : policy_it->second;
+}
+
+namespace {
+
+/*!
+ * \brief Appends rendered text to a string.
+ */
+struct String_sink {
+  std::string& out;
+  void write(const char* data, size_t length) { out.append(data, length); }
+};
+
+/*!
+ * \brief Writes rendered text to a stream.
+ */
+struct Stream_sink {
+  std::ostream& out;
+  void write(const char* data, size_t length)
+  {
+    out.write(data, static_cast<std::streamsize>(length));
+  }
+};
+
+/*!
+ * \brief Iterates over the sections of a line of a Normal_block.
+ */
+struct Column_section_iterator {
+  const struct Normal_block& block;
+  size_t index;
+
+  struct Normal_section operator*() const
+  {
+    return Normal_section{block.section_starts[index],
+                          block.section_ends[index],
+                          block.section_ids[index]};
+  }
+  Column_section_iterator& operator++()
+  {
+    ++index;
+    return *this;
+  }
+  bool operator!=(const Column_section_iterator& other) const
+  {
+    return index != other.index;
+  }
+};
+
+struct Normal_section as_section(const struct Normal_section& sec)
+{
+  return sec;
+}
+
+struct Normal_section as_section(const Sections::value_type& sec)
+{
+  return Normal_section{sec.first, sec.second.second, sec.second.first};
+}
+
+} // namespace
+
+template <typename Iterator, typename Sink>
+void Line_renderer::render(std::string_view line, Iterator first,
+                           Iterator last, Sink& sink) const
+{
+  size_t pos = 0;
+  for (; first != last; ++first) {
+    auto sec = as_section(*first);
+    const auto& r = rule(sec.id);
+    // resolve_sections() can leave a section nested in an earlier one,
+    // whose text is already replaced.
+    if (r.policy == Render_policy::keep || sec.start < pos)
+      continue;
+    sink.write(line.data() + pos, sec.start - pos);
+    if (r.policy == Render_policy::replace)
+      sink.write(r.replacement.data(), r.replacement.size());
+    pos = sec.end;
+  }
+  sink.write(line.data() + pos, line.size() - pos);
+}
+
+void Line_renderer::render_line(std::string_view line,
+                                const struct Normal_section* first,
+                                const struct Normal_section* last,
+                                std::string& out) const
+{
+  String_sink sink{out};
+  render(line, first, last, sink);
+}
+
+void Line_renderer::render_line(const struct Normal_line& line,
+                                std::string& out) const
+{
+  String_sink sink{out};
+  render(line.line, line.sections.begin(), line.sections.end(), sink);
+}
+
+void Line_renderer::render_block(const struct Normal_block& block,
+                                 std::string& out,
+                                 std::vector<size_t>& line_offsets) const
+{
+  out.clear();
+  out.reserve(block.data.size());
+  line_offsets.assign(1, 0);
+  String_sink sink{out};
+  for (size_t i = 0; i < block.size(); ++i) {
+    render(block.line(i),
+           Column_section_iterator{block, block.section_offsets[i]},
+           Column_section_iterator{block, block.section_offsets[i + 1]},
+           sink);
+    line_offsets.push_back(out.size());
+  }
+}
+
+void Line_renderer::render_block(const struct Normal_block& block,
+                                 std::ostream& out) const
+{
+  Stream_sink sink{out};
+  for (size_t i = 0; i < block.size(); ++i) {
+    render(block.line(i),
+           Column_section_iterator{block, block.section_offsets[i]},
+           Column_section_iterator{block, block.section_offsets[i + 1]},
+           sink);
+  }
 }
@@ -22,24 +22,35 @@
 #ifndef NORMALIZOR_H
 #define NORMALIZOR_H
 
-#include <array>
+#include <bitset>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <istream>
 #include <map>
 #include <memory>
+#include <ostream>
 #include <string>
+#include <string_view>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include <hs/hs_common.h>
 #include <hs/hs_compile.h>
 #include <hs/hs_runtime.h>
 
+#include "block_reader.h"
+#include "compressed_input.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "value_decoder.h"
+
 /*!
  * \brief The size of the number of characters (or bytes) processed at once.
  * This size was chosen after some tests on a local machine as offering
- * the best performance to memory usage.
+ * the best performance to memory usage.  A block grows beyond this size
+ * only to hold a line that is longer than it.
  */
 constexpr size_t blocksize = 2097152;
 
@@ -51,6 +62,26 @@ constexpr size_t blocksize = 2097152;
  */
 constexpr size_t base_lines = 32768;
 
+/*!
+ * \brief How the sections of a Normal_type are found.
+ */
+enum class Match_mode : char {
+  /*!
+   * hyperscan reports the leftmost start of every match
+   * (HS_FLAG_SOM_LEFTMOST).  Works for any regular expression.
+   */
+  leftmost,
+  /*!
+   * The regular expression is a run of one character class, such as \W+,
+   * \d{2,} or [0-9A-Fa-f]{4,}.  It is compiled without start of match, and
+   * each match is grown in place to the longest run of the class within
+   * its line, so the many overlapping matches of one run become a single
+   * section.  Unlike leftmost, a run at the start of a line is found even
+   * when the line end before it belongs to the class.
+   */
+  greedy_extend
+};
+
 /*!
  * \brief The Normal_type is a structure for storing the data used to identify
  *        sections in an line.
@@ -58,14 +89,26 @@ constexpr size_t base_lines = 32768;
  * A normal type consists of three attributes: a regular expression, a set of
  * flags modifying the regular expression, and a replacement value.  The
  * regular expression (and flags) are used to identify the section during
- * normalization.  The replacement string can be used to replace the normalize
- * section (it is not used in this code directly and is held here for
- * user convenience).
+ * normalization.  The replacement string is what a Line_renderer writes in
+ * place of each section under the default Render_policy::replace, and
+ * callers may also use it directly.  The Match_mode trades generality for
+ * speed.
+ *
+ * A Normal_type with a required_literal is only looked for in lines that
+ * hold the literal, byte for byte, which lets lines skip an expensive
+ * regular expression.  The literal is ignored by greedy_extend types.
+ *
+ * A Normal_type with a decoder has the value of each of its sections
+ * stored in Normal_block::section_values.
  */
 struct Normal_type {
   Normal_type() : regex(), replacement() {}
-  explicit Normal_type(std::string re, unsigned int f, std::string rep)
-      : regex(std::move(re)), flags(f), replacement(std::move(rep))
+  explicit Normal_type(std::string re, unsigned int f, std::string rep,
+                       Match_mode m = Match_mode::leftmost,
+                       std::string lit = std::string(),
+                       Value_decoder dec = Value_decoder::none)
+      : regex(std::move(re)), flags(f), mode(m), decoder(dec),
+        replacement(std::move(rep)), required_literal(std::move(lit))
   {
   }
   Normal_type(const struct Normal_type&) = default;
@@ -76,12 +119,85 @@ struct Normal_type {
 
   std::string regex;
   unsigned int flags{0};
-  char _padding[4]{0};
+  Match_mode mode{Match_mode::leftmost};
+  Value_decoder decoder{Value_decoder::none};
+  char _padding[2]{0};
   std::string replacement;
+  // text every match contains, if not empty.  See Line_normalizer.
+  std::string required_literal;
 };
 
 using Sections = std::map<size_t, std::pair<int, size_t>>;
 
+/*!
+ * \brief The Normal_section struct is one section of a line in the flat
+ *        representation used while scanning.  Offsets are relative to the
+ *        start of the line, as in Sections.
+ */
+struct Normal_section {
+  size_t start;
+  size_t end;
+  int id;
+  char _padding[4]{0};
+};
+
+inline bool operator==(const struct Normal_section& lhs,
+                       const struct Normal_section& rhs)
+{
+  return lhs.start == rhs.start && lhs.end == rhs.end && lhs.id == rhs.id;
+}
+
+/*!
+ * \brief Turns the raw matches of one line, in any order, into its sections.
+ *
+ * Of the matches that start at the same offset only the longest is kept,
+ * or the one with the lowest id among equally long ones.  Then, in order
+ * of start, a section wholly inside the previous kept one is dropped, and
+ * of two intersecting sections the longer one, or the one with the lower
+ * id, is kept.  The matches are sorted once and swept once, so a line with
+ * k matches takes O(k log k) time.
+ */
+void resolve_sections(std::vector<struct Normal_section>& matches);
+
+/*!
+ * \brief The Section_span refers to the sections of one line, which are
+ *        stored contiguously, sorted by start offset, in a vector shared by
+ *        every line of a block.
+ */
+class Section_span {
+public:
+  Section_span(const std::vector<struct Normal_section>& a, size_t f, size_t n)
+      : arena(&a), first(f), count(n)
+  {
+  }
+
+  const struct Normal_section* begin() const { return arena->data() + first; }
+  const struct Normal_section* end() const { return begin() + count; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const struct Normal_section& operator[](size_t i) const
+  {
+    return begin()[i];
+  }
+
+  /*!
+   * \brief Builds the Sections map holding the same sections, for code
+   *        written against Normal_line.
+   */
+  Sections to_sections() const
+  {
+    Sections secs;
+    for (const auto& sec : *this)
+      secs.emplace_hint(secs.end(), sec.start, std::make_pair(sec.id, sec.end));
+    return secs;
+  }
+
+private:
+  const std::vector<struct Normal_section>* arena;
+  size_t first;
+  size_t count;
+};
+
 /*!
  * \brief The Normal_line struct contains a single line of data as well as
  *        a data structure outlining all of the Normal_types in the line.
@@ -111,10 +227,375 @@ struct Normal_line {
 
   std::string line;
   Sections sections;
+  // template fingerprint, see Line_normalizer::set_statistics.
+  uint64_t fingerprint{0};
 };
 
 using Normal_list = std::vector<struct Normal_line>;
 
+/*!
+ * \brief The Normal_line_view struct is a Normal_line whose line refers to
+ *        the scanned data instead of holding a copy of it, and whose
+ *        sections are a span of a flat array shared by the whole block.
+ *
+ * When the input is a mapped file (see Line_normalizer::map_input_file) the
+ * line points into the mapping and stays valid until the input changes.
+ * Otherwise it points into the normalizer's block and is only valid until
+ * the next block is read.  The sections are only valid until the next block
+ * is read.
+ */
+struct Normal_line_view {
+  Normal_line_view(std::string_view l, Section_span secs, uint64_t fp = 0)
+      : line(l), sections(secs), fingerprint(fp)
+  {
+  }
+  Normal_line_view(const struct Normal_line_view&) = default;
+  Normal_line_view(struct Normal_line_view&&) noexcept(true) = default;
+  Normal_line_view&
+  operator=(struct Normal_line_view&&) noexcept(true) = default;
+  Normal_line_view& operator=(const struct Normal_line_view&) = default;
+  ~Normal_line_view() noexcept(true) = default;
+
+  std::string_view line;
+  Section_span sections;
+  // template fingerprint, see Line_normalizer::set_statistics.
+  uint64_t fingerprint{0};
+};
+
+using Normal_view_list = std::vector<struct Normal_line_view>;
+
+/*!
+ * \brief The Normal_block struct holds the normalized lines of one block in
+ *        columnar form.
+ *
+ * The bytes of every line are stored back to back in data.  Line i is
+ * data[line_offsets[i], line_offsets[i + 1]) and its sections are the
+ * entries [section_offsets[i], section_offsets[i + 1]) of section_starts,
+ * section_ends and section_ids.  Section offsets are relative to the start
+ * of their line, as in Sections.  If any Normal_type has a decoder,
+ * section_values holds the decoded value of every section, or no_value.
+ * Passing the same Normal_block to every call of
+ * Line_normalizer::get_normalized_block reuses its memory, so no memory is
+ * allocated per line.
+ */
+struct Normal_block {
+  Normal_block() { clear(); }
+
+  /*!
+   * \brief The number of lines in the block.
+   */
+  size_t size() const { return line_offsets.size() - 1; }
+  bool empty() const { return size() == 0; }
+
+  /*!
+   * \brief The bytes of line i.
+   */
+  std::string_view line(size_t i) const
+  {
+    return std::string_view(data.data() + line_offsets[i],
+                            line_offsets[i + 1] - line_offsets[i]);
+  }
+
+  /*!
+   * \brief Removes every line while keeping the memory for reuse.
+   */
+  void clear()
+  {
+    data.clear();
+    line_offsets.assign(1, 0);
+    section_offsets.assign(1, 0);
+    section_starts.clear();
+    section_ends.clear();
+    section_ids.clear();
+    section_values.clear();
+    fingerprints.clear();
+  }
+
+  std::vector<char> data;
+  std::vector<size_t> line_offsets;
+  std::vector<size_t> section_offsets;
+  std::vector<uint32_t> section_starts;
+  std::vector<uint32_t> section_ends;
+  std::vector<int32_t> section_ids;
+  // empty unless a Normal_type has a decoder.
+  std::vector<int64_t> section_values;
+  // template fingerprint of every line, empty unless
+  // Line_normalizer::set_statistics is on.
+  std::vector<uint64_t> fingerprints;
+};
+
+/*!
+ * \brief The Normal_stats struct counts templates and matches while lines
+ *        are normalized.
+ *
+ * A template is a line with the text of each section replaced by its
+ * Normal_type; lines that differ only inside sections share a template.
+ * Templates are identified by their 64-bit fingerprint.
+ */
+struct Normal_stats {
+  /*!
+   * \brief Counts one line with the given fingerprint and sections.
+   */
+  void count_line(uint64_t fingerprint,
+                  const std::vector<struct Normal_section>& secs);
+
+  /*!
+   * \brief Adds the counts of other to these.
+   */
+  void merge(const struct Normal_stats& other);
+
+  void clear()
+  {
+    lines = 0;
+    templates.clear();
+    type_matches.clear();
+  }
+
+  size_t lines{0};
+  // number of lines of each template fingerprint.
+  std::unordered_map<uint64_t, size_t> templates;
+  // number of sections of each Normal_type, indexed by its id.
+  std::vector<size_t> type_matches;
+};
+
+/*!
+ * \brief What a Line_renderer writes in place of a section.
+ */
+enum class Render_policy : char {
+  replace, //!< the replacement string of the Normal_type (the default).
+  keep,    //!< the original text of the section.
+  drop     //!< nothing.
+};
+
+/*!
+ * \brief The Line_renderer writes the normalized form of lines, where each
+ *        section is replaced according to the Render_policy of its
+ *        Normal_type.
+ *
+ * \code{.cpp}
+ * Line_renderer renderer(norm.get_current_normal_types());
+ * renderer.set_policy(8, Render_policy::keep);
+ * renderer.render_block(my_columns, my_output, my_line_offsets);
+ * \endcode
+ */
+class Line_renderer {
+public:
+  Line_renderer() = default;
+  explicit Line_renderer(const std::map<size_t, struct Normal_type>& types)
+  {
+    set_normal_types(types);
+  }
+
+  /*!
+   * \brief Takes the replacement strings of types.  Policies already set
+   *        are kept.
+   */
+  void set_normal_types(const std::map<size_t, struct Normal_type>& types);
+
+  /*!
+   * \brief Sets how sections of the Normal_type nt_id are rendered.
+   */
+  void set_policy(size_t nt_id, Render_policy policy);
+  Render_policy get_policy(size_t nt_id) const;
+
+  /*!
+   * \brief Appends the normalized form of line, whose sections are
+   *        [first, last), to out.
+   */
+  void render_line(std::string_view line, const struct Normal_section* first,
+                   const struct Normal_section* last, std::string& out) const;
+  void render_line(const struct Normal_line& line, std::string& out) const;
+
+  /*!
+   * \brief Renders every line of block into out, replacing its contents.
+   *        Line i of the output is out[line_offsets[i],
+   *        line_offsets[i + 1]).
+   */
+  void render_block(const struct Normal_block& block, std::string& out,
+                    std::vector<size_t>& line_offsets) const;
+
+  /*!
+   * \brief Writes every line of block, rendered, to out.
+   */
+  void render_block(const struct Normal_block& block, std::ostream& out) const;
+
+private:
+  struct Rule {
+    std::string replacement;
+    Render_policy policy{Render_policy::keep};
+    char _padding[7]{0};
+  };
+
+  /*!
+   * \brief Writes line to sink with the sections [first, last) rendered.
+   *        Sections are in start order and may nest; one that starts inside
+   *        a section already written is dropped.
+   */
+  template <typename Iterator, typename Sink>
+  void render(std::string_view line, Iterator first, Iterator last,
+              Sink& sink) const;
+
+  const Rule& rule(int nt_id) const
+  {
+    auto id = static_cast<size_t>(nt_id);
+    return id < rules.size() ? rules[id] : unknown;
+  }
+
+  // Indexed by Normal_type id.  Types that are not defined keep their text.
+  std::vector<Rule> rules;
+  std::map<size_t, Render_policy> policies;
+  Rule unknown;
+};
+
+/*!
+ * \brief The Line_cache holds the resolved sections of recently seen lines,
+ *        so those of a line repeated byte for byte need not be resolved
+ *        again.  It is a resolve cache: the line is still scanned.
+ *
+ * Entries are found by a hash of the line and checked against its bytes.
+ * When the entries would hold more memory than the capacity, they are
+ * evicted in clock order: an entry hit since the clock hand last passed it
+ * is kept for one more turn.  Sections depend on the Normal_types, so the
+ * cache empties itself when the Pattern_set version changes.
+ */
+class Line_cache {
+public:
+  explicit Line_cache(size_t bytes = 0) : capacity(bytes) {}
+
+  /*!
+   * \brief Sets the memory the entries may hold, evicting entries until
+   *        they fit.  0 disables the cache.
+   */
+  void set_capacity(size_t bytes);
+  size_t get_capacity() const { return capacity; }
+
+  /*!
+   * \brief Empties the cache unless its entries were found with the
+   *        Pattern_set of the given version.
+   */
+  void set_pattern_version(uint64_t pattern_version);
+
+  /*!
+   * \brief The sections of line, or nullptr if it is not cached.  hash is
+   *        the hash of line.  The sections stay valid until the next
+   *        insert().
+   */
+  const std::vector<struct Normal_section>* find(std::string_view line,
+                                                 uint64_t hash);
+
+  /*!
+   * \brief Whether line, with secs sections, fits in an entry.  An entry
+   *        may hold at most an eighth of the capacity.
+   */
+  bool fits(std::string_view line, size_t secs) const
+  {
+    return entry_memory(line.size(), secs) <= capacity / 8;
+  }
+
+  /*!
+   * \brief Caches the sections of line, whose hash is hash, unless it does
+   *        not fit().
+   *
+   * \returns the number of entries evicted to make room.
+   */
+  size_t insert(std::string_view line, uint64_t hash,
+                const std::vector<struct Normal_section>& secs);
+
+  /*!
+   * \brief Removes every entry.
+   */
+  void clear();
+
+  /*!
+   * \brief The number of lines cached, and the memory they hold.
+   */
+  size_t size() const { return index.size(); }
+  size_t memory() const { return used; }
+
+private:
+  struct Entry {
+    std::string line;
+    std::vector<struct Normal_section> sections;
+    uint64_t hash{0};
+    bool live{false};
+    bool referenced{false};
+    char _padding[6]{0};
+  };
+
+  /*!
+   * \brief The memory counted for an entry holding line and secs.
+   */
+  static size_t entry_memory(size_t line, size_t secs)
+  {
+    return sizeof(Entry) + 2 * sizeof(void*) + sizeof(uint64_t) +
+           sizeof(size_t) + line + secs * sizeof(struct Normal_section);
+  }
+
+  /*!
+   * \brief Evicts the entry at the clock hand, or the first one after it
+   *        that was not hit since its last turn.
+   */
+  void evict_one();
+
+  // slot in entries of each hash.
+  std::unordered_map<uint64_t, size_t> index;
+  std::vector<Entry> entries;
+  std::vector<size_t> free_slots;
+  size_t hand{0};
+  size_t used{0};
+  size_t capacity{0};
+  uint64_t version{0};
+};
+
+/*!
+ * \brief Selects what the Line_context builds for each line.
+ */
+enum class Line_output : char { lines, views, columns };
+
+/*!
+ * \brief The character class and minimum length of the runs of a
+ *        Match_mode::greedy_extend Normal_type.  A min_length of 0 marks a
+ *        Normal_type of another mode.
+ */
+struct Run_class {
+  std::bitset<256> chars;
+  size_t min_length{0};
+};
+
+/*!
+ * \brief How blocks are scanned besides the hyperscan database, derived from
+ *        the Normal_types along with it.
+ */
+struct Scan_plan {
+  // indexed by Normal_type id, empty if no Normal_type is a run.
+  std::vector<struct Run_class> runs;
+  // database of the Normal_types with a required literal, which is only
+  // scanned over the lines holding one of literals.  nullptr if none.
+  std::shared_ptr<hs_database_t> filtered_db;
+  std::vector<std::string> literals;
+  // indexed by Normal_type id, empty if no Normal_type has a decoder.
+  std::vector<Value_decoder> decoders;
+  // true if line ends are found with memchr instead of by the database.
+  bool split_lines{false};
+  char _padding[7]{0};
+};
+
+/*!
+ * \brief The Pattern_set struct is one compiled version of a set of
+ *        Normal_types.  It is never changed once built, so a block scanned
+ *        with it keeps it alive and unchanged while newer sets are
+ *        published.  See Line_normalizer::update_normal_types().
+ */
+struct Pattern_set {
+  std::map<size_t, struct Normal_type> normal_types;
+  std::shared_ptr<hs_database_t> db;
+  struct Scan_plan plan;
+  // normal_types_hash() of normal_types.
+  uint64_t hash{0};
+  // increases with every set built in the process, starting at 1.
+  uint64_t version{0};
+};
+
 /*!
  * \brief The Line_context is a structure used internally to facilitate the
  *        identification of lines and sections.
@@ -122,12 +603,62 @@ using Normal_list = std::vector<struct Normal_line>;
 struct Line_context {
   Line_context() = default;
   Line_context(const char* b) : block(b) {}
+
+  /*!
+   * \brief Takes the lines of a finished block back for reuse and empties
+   *        lines.  The strings keep their capacity and the nodes of their
+   *        sections are kept, so the lines of the next blocks are built
+   *        without allocating memory once enough has been recycled.
+   */
+  void recycle_lines(Normal_list& lines);
+
   const char* block{nullptr};
+  size_t block_length{0};
   size_t last_boundary{0};
-  Sections cur_sections;
+  // offset of the block in the data of columns.
+  size_t line_base{0};
+  // offset just past the next newline, if the plan splits lines.
+  size_t next_line_end{0};
+  const struct Scan_plan* plan{nullptr};
+  // matches of the filtered database in offsets of the block, in line
+  // order, the next one to add to its line, and the line being scanned.
+  std::vector<struct Normal_section> filtered_sections;
+  size_t next_filtered{0};
+  size_t filtered_line{0};
+  std::vector<size_t> filtered_lines;
+  // cache of the sections of repeated lines, or nullptr.
+  Line_cache* line_cache{nullptr};
+  // the last run found of each Normal_type, in offsets of the block.
+  std::vector<struct Normal_section> last_runs;
+  // raw matches of the current line in the order they were reported.
+  std::vector<struct Normal_section> cur_sections;
+  // resolved sections of every line in parsed_views.
+  std::vector<struct Normal_section> block_sections;
   Normal_list parsed_lines;
+  // recycled lines, taken from the back, and nodes of recycled sections.
+  Normal_list spare_lines;
+  std::vector<Sections::node_type> spare_sections;
+  Normal_view_list parsed_views;
+  struct Normal_block* columns{nullptr};
+  struct Normal_stats* stats{nullptr};
+  struct Normal_metrics* metrics{nullptr};
+  Line_output output{Line_output::lines};
+  bool fingerprints{false};
+  // set when a match of the current line was dropped for starting in an
+  // earlier line.
+  bool line_crossed{false};
+  // set when hyperscan fails to scan part of the block.
+  bool scan_failed{false};
+  char _padding[4]{0};
 };
 
+/*!
+ * \brief The platform of the host, as detected by hyperscan once.  Databases
+ *        are compiled for it, so they use the widest instruction set the
+ *        CPU supports.
+ */
+const hs_platform_info_t& host_platform();
+
 /*!
  * \brief The Line_normalizer is the core class for peforming normalization.
  *
@@ -152,6 +683,9 @@ public:
    * auto my_norm_types = norm.get_current_normal_types();
    * \endcode
    *
+   * Normal_types published from another thread (see
+   * update_normal_types()) replace these at the start of the next block.
+   *
    * \returns map of normal types where map key is the 'ID" for the normal_type
    *          and the value is the Normal_type object.
    */
@@ -160,6 +694,67 @@ public:
     return normal_types;
   }
 
+  /*!
+   * \brief Compiles types into a new Pattern_set without changing the
+   *        normalizer, using the database cache if one is set.  Types that
+   *        differ from the published ones only in their replacements or
+   *        decoders share their database.  May be called from any thread
+   *        while another one normalizes.
+   *
+   * \returns the new set, or nullptr if the types do not compile.
+   */
+  std::shared_ptr<const struct Pattern_set>
+  compile_pattern_set(std::map<size_t, struct Normal_type> types) const;
+
+  /*!
+   * \brief Makes set the Pattern_set of the blocks read from now on.  A
+   *        block that is being scanned finishes with the set it started
+   *        with.  May be called from any thread while another one
+   *        normalizes; the normalizing thread takes the set at the start of
+   *        its next block, and get_current_normal_types() returns its
+   *        Normal_types from then on.
+   */
+  void publish_pattern_set(std::shared_ptr<const struct Pattern_set> set)
+  {
+    std::atomic_store(&published, std::move(set));
+  }
+
+  /*!
+   * \brief Compiles types and publishes them, so patterns can be replaced
+   *        while blocks are being normalized, without stopping.
+   *
+   * \code{.cpp}
+   *  std::thread updater([&norm, my_types] {
+   *    norm.update_normal_types(my_types);
+   *  });
+   * \endcode
+   *
+   * \returns true if the types were published, false if they do not
+   *          compile, in which case the published set is unchanged.
+   */
+  bool update_normal_types(std::map<size_t, struct Normal_type> types)
+  {
+    auto set = compile_pattern_set(std::move(types));
+    if (!set)
+      return false;
+    publish_pattern_set(std::move(set));
+    return true;
+  }
+
+  /*!
+   * \brief The last Pattern_set published.  May be called from any thread.
+   */
+  std::shared_ptr<const struct Pattern_set> get_pattern_set() const
+  {
+    return std::atomic_load(&published);
+  }
+
+  /*!
+   * \brief The version of the Pattern_set the last block returned was
+   *        scanned with.
+   */
+  uint64_t get_block_pattern_version() const { return block_version; }
+
   /*!
    * \brief Allows the user to set new Normal_types.
    *
@@ -186,14 +781,73 @@ public:
   void modify_current_normal_types(size_t nt_id, struct Normal_type nt)
   {
     normal_types[nt_id] = std::move(nt);
-    build_hs_database();
+    if (!batch_update)
+      build_hs_database();
+  }
+
+  /*!
+   * \brief Starts a batch of changes to the Normal_types.  Calls to
+   *        modify_current_normal_types made after this will not recompile
+   *        the hyperscan database until commit_normal_types_update() is
+   *        called.
+   *
+   * \code{.cpp}
+   *  norm.begin_normal_types_update();
+   *  norm.modify_current_normal_types(1, my_ts_type);
+   *  norm.modify_current_normal_types(9, my_new_type);
+   *  norm.commit_normal_types_update();
+   * \endcode
+   */
+  void begin_normal_types_update() { batch_update = true; }
+
+  /*!
+   * \brief Ends a batch of changes started by begin_normal_types_update()
+   *        and compiles the hyperscan database once for all of them.
+   *
+   * \returns true if the database was built, false otherwise.
+   */
+  bool commit_normal_types_update()
+  {
+    batch_update = false;
+    return build_hs_database();
   }
 
+  /*!
+   * \brief Enables a cache of compiled hyperscan databases in the given
+   *        directory.  Databases are serialized to a file named by
+   *        normal_types_hash() and the host_platform(), so a normalizer
+   *        with the same Normal_types on the same kind of CPU loads the
+   *        database instead of compiling it.  The database for the current
+   *        Normal_types is loaded, or compiled and saved, at once.
+   *
+   * \param dir directory holding the cached databases.  It is created if
+   *        it does not exist.
+   *
+   * \returns true if the database was built, false otherwise.
+   */
+  bool set_database_cache(const std::string& dir);
+
+  /*!
+   * \brief Hash of the regular expressions, flags, match modes, required
+   *        literals and IDs of the current Normal_types.  Replacement
+   *        strings and decoders are not part of the hash as they do not
+   *        change the compiled database.
+   */
+  uint64_t normal_types_hash() const;
+
+  /*!
+   * \brief The file of the database cache holding the databases of the
+   *        current Normal_types, or an empty string if there is no cache.
+   */
+  std::string database_cache_file() const;
+
   /*!
    * \brief Parses one block of the input stream and returns a vector of normal
    * lines for that block of the input stream.  Continue to call
    * this function until it returns an empty vector.  The empty vector
-   * indicates the end of the input.
+   * indicates the end of the input.  The input is only read forward, so it
+   * may be a pipe or another stream that cannot seek.  A final line without
+   * a newline is returned as the last line.
    *
    * \code{.cpp}
    *  my_normal_lines = norm.get_normalized_block();
@@ -205,18 +859,238 @@ public:
    *
    * \returns a vector of Normal_line objects or an empty list if the input
    * has been exhaused (all lines consumed).
+   *
+   * \throws std::runtime_error if hyperscan fails to scan the block, or in
+   * place of the end of a compressed input that is corrupt or truncated.
+   * The next call goes on with the following block.
    */
   const Normal_list& get_normalized_block();
 
+  /*!
+   * \brief Same as get_normalized_block() but returns views of the lines
+   *        instead of copies.  See Normal_line_view for how long the views
+   *        stay valid.
+   *
+   * \returns a vector of Normal_line_view objects or an empty list if the
+   * input has been exhausted.
+   */
+  const Normal_view_list& get_normalized_view_block();
+
+  /*!
+   * \brief Same as get_normalized_block() but stores the block in columnar
+   *        form in columns, replacing its contents.  Reusing one
+   *        Normal_block for every call avoids allocating memory per line.
+   *
+   * \code{.cpp}
+   *  Normal_block columns;
+   *  while (norm.get_normalized_block(columns)) {
+   *     ... do something ...
+   *  }
+   * \endcode
+   *
+   * \returns false if the input has been exhausted.
+   */
+  bool get_normalized_block(struct Normal_block& columns);
+
+  /*!
+   * \brief Same as get_normalized_block() but stores the block in lines,
+   *        replacing its contents.  The lines previously in lines are taken
+   *        back and their memory is reused for the lines of later blocks,
+   *        so passing the same Normal_list to every call normalizes without
+   *        allocating memory per line once the first blocks are done.
+   *
+   * \code{.cpp}
+   *  Normal_list lines;
+   *  while (norm.get_normalized_block(lines)) {
+   *     ... do something ...
+   *  }
+   * \endcode
+   *
+   * \returns false if the input has been exhausted.
+   */
+  bool get_normalized_block(Normal_list& lines);
+
+  /*!
+   * \brief Normalizes a batch of messages that are already in memory, such
+   *        as log records received from a collector.  Each message is
+   *        scanned in place as an input of its own, so a match never spans
+   *        two messages and a message without a line end still ends its
+   *        line.  Nothing is copied.
+   *
+   * \code{.cpp}
+   *  std::vector<std::string_view> messages = ...;
+   *  std::vector<size_t> message_lines;
+   *  const auto& lines = norm.normalize_messages(messages, message_lines);
+   *  for (size_t i = 0; i < messages.size(); ++i) {
+   *    for (size_t l = message_lines[i]; l < message_lines[i + 1]; ++l)
+   *      ... lines[l] is a line of message i ...
+   *  }
+   * \endcode
+   *
+   * \param messages the messages to normalize.  Must stay valid while the
+   *        returned views are used.
+   * \param message_lines set to the index of the first line of every
+   *        message, followed by the number of lines.  An empty message has
+   *        no lines.
+   *
+   * \returns the lines of every message as views into the messages.  They
+   *          are valid until the next call that normalizes.
+   *
+   * \throws std::runtime_error if hyperscan fails to scan a message.
+   */
+  const Normal_view_list&
+  normalize_messages(const std::vector<std::string_view>& messages,
+                     std::vector<size_t>& message_lines);
+
+  /*!
+   * \brief Same as normalize_messages() but stores the lines in columnar
+   *        form in columns, replacing its contents.  The bytes of the
+   *        messages are copied into columns.data.
+   */
+  void normalize_messages(const std::vector<std::string_view>& messages,
+                          struct Normal_block& columns,
+                          std::vector<size_t>& message_lines);
+
+  /*!
+   * \brief Sets how sections of the Normal_type nt_id are written by
+   *        get_rendered_block().  By default every section is replaced by
+   *        the replacement string of its Normal_type.
+   */
+  void set_render_policy(size_t nt_id, Render_policy policy)
+  {
+    renderer.set_policy(nt_id, policy);
+  }
+
+  /*!
+   * \brief Provides the renderer used by get_rendered_block(), e.g. to
+   *        render the lines of a Parallel_normalizer.
+   */
+  const Line_renderer& get_renderer() const { return renderer; }
+
+  /*!
+   * \brief Parses one block of the input and writes its normalized form to
+   *        out, replacing its contents.  Line i of the output is
+   *        out[line_offsets[i], line_offsets[i + 1]).
+   *
+   * \code{.cpp}
+   *  std::string text;
+   *  std::vector<size_t> offsets;
+   *  while (norm.get_rendered_block(text, offsets)) {
+   *     ... do something ...
+   *  }
+   * \endcode
+   *
+   * \returns false if the input has been exhausted.
+   */
+  bool get_rendered_block(std::string& out, std::vector<size_t>& line_offsets);
+
   /*!
    * \brief Designate the file, or stream, to normalize.  If stream assumes
    *        the caller is responsible for the stream.
    *
+   * A file compressed with gzip, zstd or lz4 is detected by its magic bytes
+   * and decompressed on a separate thread while blocks are scanned.  See
+   * open_input_file().
+   *
    * \param stream filename or stream for normalizing.
    */
   void set_input_stream(const std::string& stream);
   void set_input_stream(std::istream& stream);
 
+  /*!
+   * \brief Designate a stream to normalize and take ownership of it.
+   */
+  void set_input_stream(std::unique_ptr<std::istream> stream);
+
+  /*!
+   * \brief Designate a file to normalize by mapping it into memory.  Blocks
+   *        are scanned in place, without being copied, and
+   *        get_normalized_view_block() returns lines that point into the
+   *        mapping.  A compressed file cannot be scanned in place, so it
+   *        is read as set_input_stream() reads it instead.
+   *
+   * \param filename file to normalize.
+   *
+   * \returns true if the file was mapped or opened, false otherwise.
+   */
+  bool map_input_file(const std::string& filename);
+
+  /*!
+   * \brief Read blocks of a stream ahead on a background thread, so the
+   *        next block is read while the current one is scanned.  Takes
+   *        effect from the next set_input_stream() call.  A stream given by
+   *        reference must not be used by the caller while it is read.
+   *
+   * \param buffers the number of blocks held at once.  0 or 1 reads each
+   *        block when it is requested, which is the default.
+   */
+  void set_read_ahead(size_t buffers) { read_ahead_buffers = buffers; }
+
+  /*!
+   * \brief The number of blocks held at once by read-ahead.  See
+   *        set_read_ahead().
+   */
+  size_t get_read_ahead() const { return read_ahead_buffers; }
+
+  /*!
+   * \brief Compute the template fingerprint of every line and count lines
+   *        by template and sections by Normal_type.  Off by default.
+   *
+   * The fingerprint hashes the line without its line end, with the text of
+   * every section replaced by the id of its Normal_type.  It is the same
+   * across runs on machines of the same byte order.
+   */
+  void set_statistics(bool enabled) { statistics = enabled; }
+
+  /*!
+   * \brief The counts of the last block returned.
+   */
+  const struct Normal_stats& get_block_statistics() const
+  {
+    return block_stats;
+  }
+
+  /*!
+   * \brief The counts of every block returned since the last
+   *        reset_statistics().
+   */
+  const struct Normal_stats& get_run_statistics() const { return run_stats; }
+  void reset_statistics() { run_stats.clear(); }
+
+  /*!
+   * \brief Keep the resolved sections of recently seen lines in a
+   *        Line_cache holding at most bytes of memory, and reuse them for
+   *        lines repeated byte for byte instead of resolving them again.
+   *        0, the default, disables the cache.
+   *
+   * This is a resolve cache, used when the line end Normal_type is a
+   * newline.  Blocks are still scanned whole by hyperscan before any line
+   * is looked up, so a hit skips only resolving the overlapping matches of
+   * the line, not scanning it.  The sections of a line are the same with or
+   * without the cache.  A line with a match that starts in an earlier line,
+   * and so is dropped, depends on the lines before it; it is neither looked
+   * up nor cached.  Hits, misses, lines too large to cache and evictions
+   * are counted in the metrics.
+   */
+  void set_line_cache(size_t bytes) { line_cache.set_capacity(bytes); }
+
+  /*!
+   * \brief Time the phases of normalization and count bytes, lines and
+   *        matches.  Off by default.  Costs a time stamp counter read per
+   *        match while on, and nothing if NORMALIZOR_NO_METRICS is defined.
+   */
+  void set_metrics(bool enabled)
+  {
+    collect_metrics = metrics_compiled && enabled;
+  }
+
+  /*!
+   * \brief A snapshot of the metrics collected since the last
+   *        reset_metrics().
+   */
+  struct Normal_metrics get_metrics() const { return metrics; }
+  void reset_metrics() { metrics.clear(); }
+
   /*!
    * \brief The ID for the line_end Normal_type.
    */
@@ -225,9 +1099,43 @@ public:
 private:
   /*!
    * \brief build hyperscan database returns true on success / false otherwise.
+   *        Compiles the current Normal_types into a Pattern_set, publishes
+   *        it and takes it at once.
    */
   bool build_hs_database();
 
+  /*!
+   * \brief Takes the last published Pattern_set for the blocks read from
+   *        now on, if it is not the one in use.  Returns false if the
+   *        scratch space cannot be allocated for it.
+   */
+  bool adopt_pattern_set();
+
+  /*!
+   * \brief Builds the plan and databases of set for its Normal_types,
+   *        loading them from the database cache if they are there.
+   *        Returns true on success.
+   */
+  bool compile_databases(struct Pattern_set& set) const;
+
+  /*!
+   * \brief Compiles the Normal_types of types in the filtered database of
+   *        plan, or the other ones.  Returns true on success.
+   */
+  static bool compile_hs_database(
+      const std::map<size_t, struct Normal_type>& types,
+      const struct Scan_plan& plan, bool filtered, hs_database_t** db);
+
+  /*!
+   * \brief Loads or saves the databases for the Normal_types of the given
+   *        hash in the database cache.  filtered is nullptr if there is no
+   *        filtered database.  Returns true on success.
+   */
+  bool load_cached_database(uint64_t hash, hs_database_t** db,
+                            hs_database_t** filtered) const;
+  bool save_cached_database(uint64_t hash, const hs_database_t* db,
+                            const hs_database_t* filtered) const;
+
   /*!
    * \brief Per match function used by hyperscan.
    */
@@ -235,16 +1143,101 @@ private:
                       unsigned long long to, unsigned int, void* ctx);
 
   /*!
-   * \brief Reads a block of data from the inputstream and places it in block.
-   *        Returns number of characters read.
+   * \brief Scans the first length characters of ctx.block with db and adds
+   *        its lines to the output of ctx.  Scratch must have been
+   *        allocated for db and for the filtered database of ctx.plan.
+   */
+  static void scan_text(const hs_database_t* db, hs_scratch_t* scratch,
+                        size_t length, struct Line_context& ctx);
+
+  /*!
+   * \brief Scans the first length characters of ctx.block with db and fills
+   *        ctx.parsed_lines.  Scratch must have been allocated for db and
+   *        for the filtered database of ctx.plan.
+   *
+   * \returns false if hyperscan failed, in which case the lines may lack
+   *          some of their sections.
+   */
+  static bool scan_block(const hs_database_t* db, hs_scratch_t* scratch,
+                         size_t length, struct Line_context& ctx);
+
+  /*!
+   * \brief Per match function of the filtered database.
+   */
+  static int on_filtered_match(unsigned int id, unsigned long long start,
+                               unsigned long long to, unsigned int,
+                               void* ctx);
+
+  /*!
+   * \brief Scans the lines of the block of ctx that hold a literal of the
+   *        plan with its filtered database into ctx.filtered_sections.
+   */
+  static void scan_filtered(hs_scratch_t* scratch, struct Line_context& ctx);
+
+  /*!
+   * \brief Ends every line of ctx that ends at or before offset to of the
+   *        block, when the plan splits lines.
    */
-  size_t read_block();
+  static void end_lines(struct Line_context& ctx, size_t to);
+
+  /*!
+   * \brief Grows the match of the run Normal_type id that ends at offset to
+   *        of the block to the longest run within its line.
+   */
+  static void extend_run(struct Line_context& ctx, unsigned int id,
+                         size_t to);
+
+  /*!
+   * \brief Resolves the sections of the line of ctx that ends at offset to
+   *        of the block, or takes them from ctx.line_cache, and builds its
+   *        output.
+   */
+  static void end_line(struct Line_context& ctx, size_t to);
+
+  /*!
+   * \brief Builds the Normal_line, view or columns for the line of ctx that
+   *        ends at offset to of the block, whose sections are resolved.
+   */
+  static void emit_line(struct Line_context& ctx, size_t to);
+
+  /*!
+   * \brief Appends the value of every section of the line of ctx that ends
+   *        at offset to of the block to the columns of ctx.
+   */
+  static void decode_sections(struct Line_context& ctx, size_t to);
+
+  /*!
+   * \brief Takes the next block of the mapped file, ending on a newline
+   *        unless it is the end of the file, and points data to it.
+   *        Returns number of characters in the block.
+   */
+  size_t next_mapped_block(const char** data);
+
+  /*!
+   * \brief Empties the output of context and sets it up for a new block.
+   */
+  void begin_block();
+
+  /*!
+   * \brief Scans messages one after another into the output of context.
+   */
+  void scan_messages(const std::vector<std::string_view>& messages,
+                     std::vector<size_t>& message_lines);
+
+  /*!
+   * \brief Reads or maps the next block and scans it into context.
+   */
+  void normalize_next_block();
+
+  friend class Parallel_normalizer;
 
   // member variables.
-  std::array<char, blocksize> block;
+  std::vector<char> block;
   struct Line_context context;
-  std::unique_ptr<hs_database_t, decltype(hs_free_database)*> hs_db{
-      nullptr, &hs_free_database};
+  // the set blocks are scanned with, and the last one published, which is
+  // only accessed atomically.
+  std::shared_ptr<const struct Pattern_set> patterns;
+  std::shared_ptr<const struct Pattern_set> published;
   std::map<size_t, struct Normal_type> normal_types = {
       {line_end_id, Normal_type(R"(\n|\r\n)", 0u, "<NL>")},
       {1, Normal_type(R"((((\d{1,2}|\d{4})[-\/\s](\d{1,2}|jan|feb|mar|)"
@@ -267,8 +1260,25 @@ private:
       {8, Normal_type(R"(\W+)", 0u, "<NW>")}};
   std::unique_ptr<hs_scratch_t, decltype(hs_free_scratch)*> hs_scratch{
       nullptr, &hs_free_scratch};
-  std::unique_ptr<std::ifstream> file_to_normalize;
-  std::istream* stream_to_normalize = nullptr;
+  std::unique_ptr<std::istream> file_to_normalize;
+  Block_reader reader{blocksize};
+  std::unique_ptr<Read_ahead> read_ahead;
+  size_t read_ahead_buffers{0};
+  // shared with the jobs of a Parallel_normalizer scanning it.
+  std::shared_ptr<const Mapped_file> mapped_file;
+  size_t mapped_offset{0};
+  Line_renderer renderer;
+  Line_cache line_cache;
+  struct Normal_block rendered_columns;
+  std::string database_cache;
+  struct Normal_stats block_stats;
+  struct Normal_stats run_stats;
+  struct Normal_metrics metrics;
+  uint64_t block_version{0};
+  bool batch_update = false;
+  bool statistics = false;
+  bool collect_metrics = false;
+  char _padding[5]{0};
 };
 
 /*!
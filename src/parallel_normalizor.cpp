@@ -0,0 +1,420 @@
+//===-------- parallel_normalizor.cpp, Multi-threaded file parsing -------===//
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glob.h>
+
+#include <boost/filesystem.hpp>
+#include <hs/hs_common.h>
+#include <hs/hs_runtime.h>
+
+#include "normalizor.h"
+#include "parallel_normalizor.h"
+
+namespace {
+
+/*!
+ * \brief Appends path, or the regular files below it if it is a directory,
+ *        to files.
+ */
+void add_input_path(const std::string& path, std::vector<std::string>& files)
+{
+  namespace fs = boost::filesystem;
+  boost::system::error_code ec;
+  if (!fs::is_directory(path, ec)) {
+    files.push_back(path);
+    return;
+  }
+  std::vector<std::string> found;
+  for (fs::recursive_directory_iterator it(path, ec), end; !ec && it != end;
+       it.increment(ec)) {
+    if (fs::is_regular_file(it->path(), ec))
+      found.push_back(it->path().string());
+  }
+  std::sort(found.begin(), found.end());
+  files.insert(files.end(), found.begin(), found.end());
+}
+
+} // namespace
+
+std::vector<std::string>
+expand_input_files(const std::vector<std::string>& paths)
+{
+  std::vector<std::string> files;
+  for (const auto& path : paths) {
+    if (path.find_first_of("*?[") == std::string::npos) {
+      add_input_path(path, files);
+      continue;
+    }
+    glob_t matches;
+    if (::glob(path.c_str(), 0, nullptr, &matches) == 0) {
+      for (size_t i = 0; i < matches.gl_pathc; ++i)
+        add_input_path(matches.gl_pathv[i], files);
+    }
+    globfree(&matches);
+  }
+  return files;
+}
+
+Parallel_normalizer::Block_job::Block_job() : block(blocksize)
+{
+  context.parsed_lines.reserve(base_lines);
+}
+
+Parallel_normalizer::Parallel_normalizer(size_t threads)
+{
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  // Two jobs per worker keep every worker busy while the caller reads the
+  // next blocks and consumes the finished ones.
+  jobs.resize(threads * 2);
+  for (auto& job : jobs)
+    job = std::make_unique<Block_job>();
+  // Every scratch is cloned before a worker starts, so a failure leaves no
+  // thread to stop.
+  std::vector<std::unique_ptr<hs_scratch_t, decltype(hs_free_scratch)*>>
+      scratches;
+  scratches.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    hs_scratch_t* scratch = nullptr;
+    if (norm.hs_scratch &&
+        hs_clone_scratch(norm.hs_scratch.get(), &scratch) != HS_SUCCESS)
+      throw std::runtime_error("cannot allocate hyperscan scratch");
+    scratches.emplace_back(scratch, &hs_free_scratch);
+  }
+  workers.reserve(threads);
+  for (auto& scratch : scratches) {
+    workers.emplace_back(&Parallel_normalizer::work, this, scratch.release(),
+                         norm.patterns ? norm.patterns->version : 0);
+  }
+}
+
+Parallel_normalizer::~Parallel_normalizer()
+{
+  {
+    std::lock_guard<std::mutex> lock(job_mutex);
+    stopping = true;
+  }
+  job_ready.notify_all();
+  for (auto& worker : workers)
+    worker.join();
+}
+
+void Parallel_normalizer::work(hs_scratch_t* scratch_ptr, uint64_t version)
+{
+  std::unique_ptr<hs_scratch_t, decltype(hs_free_scratch)*> scratch(
+      scratch_ptr, &hs_free_scratch);
+  // the version of the Pattern_set scratch was allocated for, or 0 if
+  // there is no scratch.  Versions are never reused, unlike the addresses
+  // of freed databases.
+  uint64_t scratch_version = scratch ? version : 0;
+  Line_cache cache;
+  for (;;) {
+    Block_job* job = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(job_mutex);
+      job_ready.wait(lock, [this] { return stopping || !pending.empty(); });
+      if (stopping)
+        return;
+      job = pending.front();
+      pending.pop_front();
+    }
+    // The Normal_types changed since the scratch was allocated, so it may
+    // be too small for the new database.
+    const uint64_t job_version = job->patterns->version;
+    if (job_version != scratch_version) {
+      hs_scratch_t* grown = scratch.release();
+      scratch_version = alloc_job_scratch(*job, &grown) ? job_version : 0;
+      scratch.reset(grown);
+    }
+    cache.set_capacity(job->line_cache_bytes);
+    cache.set_pattern_version(job_version);
+    job->context.line_cache = job->line_cache_bytes > 0 ? &cache : nullptr;
+    if (!scan_job(*job, scratch_version ? scratch.get() : nullptr) &&
+        scratch_version) {
+      // hyperscan rejected the scratch, so replace it with one allocated
+      // for the databases of the job and scan the block again.
+      hs_scratch_t* fresh = nullptr;
+      scratch_version = alloc_job_scratch(*job, &fresh) ? job_version : 0;
+      scratch.reset(fresh);
+      scan_job(*job, scratch_version ? scratch.get() : nullptr);
+    }
+    {
+      std::lock_guard<std::mutex> lock(job_mutex);
+      job->done = true;
+    }
+    job_done.notify_all();
+  }
+}
+
+bool Parallel_normalizer::scan_job(Block_job& job, hs_scratch_t* scratch)
+{
+  auto& ctx = job.context;
+  ctx.columns = &job.columns;
+  job.columns.clear();
+  job.stats.clear();
+  job.metrics.clear();
+  job.error.clear();
+  if (!scratch || !Line_normalizer::scan_block(job.patterns->db.get(),
+                                               scratch, job.length, ctx)) {
+    job.error = "hyperscan failed to scan a block";
+    // Lines without all their sections are not returned.
+    ctx.recycle_lines(ctx.parsed_lines);
+    ctx.parsed_views.clear();
+    job.columns.clear();
+    job.stats.clear();
+    return false;
+  }
+  if (ctx.output == Line_output::columns)
+    job.columns.data.assign(ctx.block, ctx.block + ctx.last_boundary);
+  return true;
+}
+
+bool Parallel_normalizer::alloc_job_scratch(const Block_job& job,
+                                            hs_scratch_t** scratch)
+{
+  if (hs_alloc_scratch(job.patterns->db.get(), scratch) != HS_SUCCESS)
+    return false;
+  const auto* filtered = job.patterns->plan.filtered_db.get();
+  return !filtered || hs_alloc_scratch(filtered, scratch) == HS_SUCCESS;
+}
+
+void Parallel_normalizer::fill_jobs()
+{
+  while (!input_done && in_flight < jobs.size()) {
+    auto& job = jobs[(head + in_flight) % jobs.size()];
+    {
+      Phase_timer timer(norm.collect_metrics ? &run_metrics : nullptr,
+                        Phase::read);
+      job->mapping = norm.mapped_file;
+      if (job->mapping) {
+        job->length = norm.next_mapped_block(&job->context.block);
+      } else {
+        job->length = norm.reader.read(job->block);
+        job->context.block = job->block.data();
+      }
+    }
+    if (job->length == 0) {
+      auto error = norm.file_to_normalize
+                       ? input_error(*norm.file_to_normalize)
+                       : std::string();
+      if (!error.empty()) {
+        // The end of a damaged compressed input is reported in input
+        // order, by a job that is not scanned.
+        norm.reader.set_stream(nullptr);
+        norm.file_to_normalize.reset();
+        job->error = error;
+        job->input = reading_input;
+        job->offset = reading_offset;
+        job->context.recycle_lines(job->context.parsed_lines);
+        job->columns.clear();
+        job->stats.clear();
+        job->metrics.clear();
+        {
+          std::lock_guard<std::mutex> lock(job_mutex);
+          job->done = true;
+        }
+        ++in_flight;
+        continue;
+      }
+      if (next_file < input_files.size()) {
+        reading_input = next_file;
+        reading_offset = 0;
+        open_input_file(input_files[next_file++]);
+        continue;
+      }
+      input_done = true;
+      break;
+    }
+    job->line_cache_bytes = line_cache_bytes / workers.size();
+    job->input = reading_input;
+    job->offset = reading_offset;
+    reading_offset += job->length;
+    job->context.output = output;
+    job->context.fingerprints = norm.statistics;
+    job->context.stats = norm.statistics ? &job->stats : nullptr;
+    job->context.metrics = norm.collect_metrics ? &job->metrics : nullptr;
+    // The job holds the set it is scanned with, so a set published while it
+    // is queued or scanned stays alive until the job is reused.
+    job->patterns = norm.patterns;
+    job->context.plan = &job->patterns->plan;
+    {
+      std::lock_guard<std::mutex> lock(job_mutex);
+      job->done = false;
+      pending.push_back(job.get());
+    }
+    job_ready.notify_one();
+    ++in_flight;
+  }
+}
+
+void Parallel_normalizer::drain_jobs()
+{
+  std::unique_lock<std::mutex> lock(job_mutex);
+  job_done.wait(lock, [this] {
+    for (size_t i = 0; i < in_flight; ++i) {
+      if (!jobs[(head + i) % jobs.size()]->done)
+        return false;
+    }
+    return true;
+  });
+  head = 0;
+  in_flight = 0;
+  returned_head = false;
+}
+
+Parallel_normalizer::Block_job* Parallel_normalizer::next_job(Line_output mode)
+{
+  if (returned_head) {
+    head = (head + 1) % jobs.size();
+    --in_flight;
+    returned_head = false;
+  }
+  output = mode;
+  // Blocks read from here on are scanned with the last published set.
+  norm.adopt_pattern_set();
+  if (norm.patterns)
+    fill_jobs();
+  if (in_flight == 0)
+    return nullptr;
+  Block_job* job = jobs[head].get();
+  {
+    std::unique_lock<std::mutex> lock(job_mutex);
+    job_done.wait(lock, [job] { return job->done; });
+  }
+  returned_head = true;
+  returned_input = job->input;
+  returned_offset = job->offset;
+  if (job->context.output != mode && job->length > 0) {
+    // The caller switched between lines and columns after this block was
+    // queued, so scan it again here.
+    job->context.output = mode;
+    // The cache belongs to the worker that scanned the job.
+    job->context.line_cache = nullptr;
+    hs_scratch_t* scratch = caller_scratch.release();
+    bool allocated = alloc_job_scratch(*job, &scratch);
+    caller_scratch.reset(scratch);
+    scan_job(*job, allocated ? caller_scratch.get() : nullptr);
+  }
+  // The next call goes on with the following job.
+  if (!job->error.empty())
+    throw std::runtime_error(job->error);
+  if (job->context.stats)
+    run_stats.merge(job->stats);
+  if (job->context.metrics)
+    run_metrics.merge(job->metrics);
+  return job;
+}
+
+struct Normal_metrics Parallel_normalizer::get_metrics() const
+{
+  // The database is built by norm, blocks are read and scanned here.
+  auto snapshot = norm.get_metrics();
+  snapshot.merge(run_metrics);
+  return snapshot;
+}
+
+void Parallel_normalizer::reset_metrics()
+{
+  norm.reset_metrics();
+  run_metrics.clear();
+}
+
+const Normal_list& Parallel_normalizer::get_normalized_block()
+{
+  Block_job* job = next_job(Line_output::lines);
+  return job ? job->context.parsed_lines : empty_list;
+}
+
+bool Parallel_normalizer::get_normalized_block(Normal_list& lines)
+{
+  Block_job* job = next_job(Line_output::lines);
+  if (!job) {
+    lines.clear();
+    return false;
+  }
+  // The job recycles the lines handed back when it scans its next block.
+  std::swap(lines, job->context.parsed_lines);
+  return true;
+}
+
+bool Parallel_normalizer::get_normalized_block(struct Normal_block& columns)
+{
+  Block_job* job = next_job(Line_output::columns);
+  if (!job) {
+    columns.clear();
+    return false;
+  }
+  std::swap(columns, job->columns);
+  return true;
+}
+
+void Parallel_normalizer::reset_input()
+{
+  drain_jobs();
+  input_done = false;
+  input_files.clear();
+  next_file = 0;
+  reading_input = 0;
+  reading_offset = 0;
+  returned_input = 0;
+  returned_offset = 0;
+}
+
+void Parallel_normalizer::open_input_file(const std::string& file)
+{
+  boost::system::error_code ec;
+  if (!boost::filesystem::is_regular_file(file, ec) ||
+      !norm.map_input_file(file))
+    norm.set_input_stream(file);
+}
+
+void Parallel_normalizer::set_input_stream(const std::string& stream)
+{
+  reset_input();
+  norm.set_input_stream(stream);
+}
+
+void Parallel_normalizer::set_input_stream(std::istream& stream)
+{
+  reset_input();
+  norm.set_input_stream(stream);
+}
+
+void Parallel_normalizer::set_input_stream(std::unique_ptr<std::istream> stream)
+{
+  reset_input();
+  norm.set_input_stream(std::move(stream));
+}
+
+void Parallel_normalizer::set_input_files(std::vector<std::string> files)
+{
+  reset_input();
+  input_files = std::move(files);
+  if (input_files.empty()) {
+    norm.set_input_stream(std::make_unique<std::istringstream>());
+    return;
+  }
+  open_input_file(input_files[0]);
+  next_file = 1;
+}
+
+bool Parallel_normalizer::map_input_file(const std::string& filename)
+{
+  reset_input();
+  return norm.map_input_file(filename);
+}
@@ -0,0 +1,368 @@
+//===-------- parallel_normalizor.h, Multi-threaded file parsing ---------===//
+
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ *
+ * \brief parallel_normalizor normalizes the blocks of one input on a pool of
+ *        worker threads.
+ *
+ * The input is split into blocks on newline boundaries exactly as
+ * Line_normalizer does.  Each block is handed to a worker, which scans it
+ * with the hyperscan database shared read-only by all workers and with its
+ * own scratch space.  Each block holds the Pattern_set it was read with, so
+ * patterns can be updated while blocks are in flight.  Blocks are returned
+ * to the caller in input order, so the results are identical to those of a
+ * Line_normalizer reading the same input.
+ */
+#ifndef PARALLEL_NORMALIZOR_H
+#define PARALLEL_NORMALIZOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hs/hs_common.h>
+#include <hs/hs_runtime.h>
+
+#include "normalizor.h"
+
+/*!
+ * \brief Expands paths into the list of files they name, for
+ *        Parallel_normalizer::set_input_files().  A directory names every
+ *        regular file below it, in sorted order, and a path holding *, ? or
+ *        [ is a glob pattern naming the paths it matches.  Other paths are
+ *        kept as they are.
+ */
+std::vector<std::string>
+expand_input_files(const std::vector<std::string>& paths);
+
+/*!
+ * \brief The Parallel_normalizer normalizes one input with several threads.
+ *
+ * \code{.cpp}
+ * Parallel_normalizer norm(8);
+ * norm.set_input_stream(my_file_name);
+ * auto lines = norm.get_normalized_block();
+ * while (!lines.empty()) {
+ *   ... do something ...
+ *   lines = norm.get_normalized_block();
+ * }
+ * \endcode
+ */
+class Parallel_normalizer {
+public:
+  /*!
+   * \param threads the number of worker threads.  Zero uses one thread per
+   *        hardware thread.
+   */
+  explicit Parallel_normalizer(size_t threads = 0);
+  Parallel_normalizer(const Parallel_normalizer&) = delete;
+  Parallel_normalizer& operator=(const Parallel_normalizer&) = delete;
+  ~Parallel_normalizer();
+
+  /*!
+   * \brief See Line_normalizer::get_current_normal_types().
+   */
+  const std::map<size_t, struct Normal_type>& get_current_normal_types() const
+  {
+    return norm.get_current_normal_types();
+  }
+
+  /*!
+   * \brief See Line_normalizer::modify_current_normal_types().  Blocks that
+   *        were already read keep the Normal_types they were read with.
+   */
+  void modify_current_normal_types(size_t nt_id, struct Normal_type nt)
+  {
+    norm.modify_current_normal_types(nt_id, std::move(nt));
+  }
+
+  /*!
+   * \brief See Line_normalizer::begin_normal_types_update().
+   */
+  void begin_normal_types_update() { norm.begin_normal_types_update(); }
+
+  /*!
+   * \brief See Line_normalizer::commit_normal_types_update().
+   */
+  bool commit_normal_types_update()
+  {
+    return norm.commit_normal_types_update();
+  }
+
+  /*!
+   * \brief See Line_normalizer::update_normal_types().  May be called from
+   *        any thread.  Blocks that were already read finish with the set
+   *        they were read with, and the blocks read after the next call
+   *        that returns a block are scanned with the new one.
+   */
+  bool update_normal_types(std::map<size_t, struct Normal_type> types)
+  {
+    return norm.update_normal_types(std::move(types));
+  }
+
+  /*!
+   * \brief See Line_normalizer::get_pattern_set().
+   */
+  std::shared_ptr<const struct Pattern_set> get_pattern_set() const
+  {
+    return norm.get_pattern_set();
+  }
+
+  /*!
+   * \brief The version of the Pattern_set the last block returned was
+   *        scanned with.
+   */
+  uint64_t get_block_pattern_version() const
+  {
+    return returned_head ? jobs[head]->patterns->version : 0;
+  }
+
+  /*!
+   * \brief See Line_normalizer::normal_types_hash().
+   */
+  uint64_t normal_types_hash() const { return norm.normal_types_hash(); }
+
+  /*!
+   * \brief See Line_normalizer::set_database_cache().
+   */
+  bool set_database_cache(const std::string& dir)
+  {
+    return norm.set_database_cache(dir);
+  }
+
+  /*!
+   * \brief See Line_normalizer::set_statistics().  Blocks that were already
+   *        read are counted as they were read.
+   */
+  void set_statistics(bool enabled) { norm.set_statistics(enabled); }
+
+  /*!
+   * \brief The counts of the last block returned.
+   */
+  const struct Normal_stats& get_block_statistics() const
+  {
+    return returned_head ? jobs[head]->stats : empty_stats;
+  }
+
+  /*!
+   * \brief The counts of every block returned since the last
+   *        reset_statistics().
+   */
+  const struct Normal_stats& get_run_statistics() const { return run_stats; }
+  void reset_statistics() { run_stats.clear(); }
+
+  /*!
+   * \brief See Line_normalizer::set_line_cache().  Each worker has a cache
+   *        of its own, and bytes is shared out evenly among them.  Takes
+   *        effect from the blocks read after the call.
+   */
+  void set_line_cache(size_t bytes) { line_cache_bytes = bytes; }
+
+  /*!
+   * \brief See Line_normalizer::set_metrics().  Workers time their own
+   *        blocks, so phase times add up the time of every thread.
+   */
+  void set_metrics(bool enabled) { norm.set_metrics(enabled); }
+
+  /*!
+   * \brief A snapshot of the metrics of every block returned since the last
+   *        reset_metrics().
+   */
+  struct Normal_metrics get_metrics() const;
+  void reset_metrics();
+
+  /*!
+   * \brief Returns the next block of the input in input order.  The
+   *        returned list stays valid until the next call.  See
+   *        Line_normalizer::get_normalized_block().
+   *
+   * \throws std::runtime_error if a worker could not scan the block, or in
+   *         place of the end of a compressed input that is corrupt or
+   *         truncated, as the get_normalized_block() overloads below also
+   *         do.  The next call goes on with the following block.
+   */
+  const Normal_list& get_normalized_block();
+
+  /*!
+   * \brief Same as get_normalized_block() but stores the block in columnar
+   *        form.  The contents of columns are exchanged with the result, so
+   *        passing the same Normal_block to every call reuses its memory.
+   *
+   * \returns false once the input has been exhausted.
+   */
+  bool get_normalized_block(struct Normal_block& columns);
+
+  /*!
+   * \brief Same as get_normalized_block() but stores the block in lines.
+   *        The contents of lines are exchanged with the result and reused
+   *        by the workers, so passing the same Normal_list to every call
+   *        reuses its memory.  See Line_normalizer::get_normalized_block().
+   *
+   * \returns false once the input has been exhausted.
+   */
+  bool get_normalized_block(Normal_list& lines);
+
+  /*!
+   * \brief Designate the file, or stream, to normalize.  Blocks of the
+   *        previous input that were not returned yet are discarded.
+   */
+  void set_input_stream(const std::string& stream);
+  void set_input_stream(std::istream& stream);
+  void set_input_stream(std::unique_ptr<std::istream> stream);
+
+  /*!
+   * \brief Designate several files to normalize one after another.  The
+   *        blocks of later files are read and scanned while those of
+   *        earlier ones are still being returned, so a set of small files
+   *        is normalized in parallel as well.  Every block holds lines of
+   *        one file only.  Regular files that are not compressed are mapped,
+   *        so a large file is split into blocks ending on newlines that the
+   *        workers scan in place.  Blocks are still read and split on
+   *        the calling thread, into one queue shared by all workers in
+   *        input order; the files are not divided among the workers, and
+   *        idle workers do not steal from busy ones.  Reading a mapped
+   *        block only looks for its last newline, so the workers wait on
+   *        the caller mostly for compressed or unmapped inputs.  See
+   *        expand_input_files() for directories and globs.
+   */
+  void set_input_files(std::vector<std::string> files);
+
+  /*!
+   * \brief The index, in the list given to set_input_files(), of the file
+   *        the last returned block belongs to.  0 for other inputs.
+   */
+  size_t current_input() const { return returned_input; }
+
+  /*!
+   * \brief The byte offset, in its input, of the first line of the last
+   *        returned block.  Offsets into compressed files count
+   *        decompressed bytes.
+   */
+  size_t current_offset() const { return returned_offset; }
+
+  /*!
+   * \brief Designate a file to normalize by mapping it into memory.  The
+   *        workers scan the mapping in place.  See
+   *        Line_normalizer::map_input_file().
+   */
+  bool map_input_file(const std::string& filename);
+
+  /*!
+   * \brief The number of worker threads.
+   */
+  size_t threads() const { return workers.size(); }
+
+private:
+  /*!
+   * \brief One block of input and its result.  Jobs are used as a ring so
+   *        that results come back in the order the blocks were read.
+   */
+  struct Block_job {
+    Block_job();
+    std::vector<char> block;
+    struct Line_context context;
+    struct Normal_block columns;
+    struct Normal_stats stats;
+    struct Normal_metrics metrics;
+    std::shared_ptr<const struct Pattern_set> patterns;
+    // the mapping block points into, if the input is mapped.
+    std::shared_ptr<const Mapped_file> mapping;
+    size_t length{0};
+    size_t input{0};
+    size_t offset{0};
+    // capacity of the line cache of the worker scanning the job.
+    size_t line_cache_bytes{0};
+    // why the block could not be scanned or its input ended early, or
+    // empty.
+    std::string error;
+    bool done{false};
+    char _padding[7]{0};
+  };
+
+  /*!
+   * \brief Scans the block of job into the output its context asks for.
+   *        Returns false and sets the error of the job, leaving it
+   *        without lines, if scratch is nullptr or hyperscan fails to scan
+   *        the block.
+   */
+  static bool scan_job(Block_job& job, hs_scratch_t* scratch);
+
+  /*!
+   * \brief Grows scratch for the databases of job.  Returns true on success.
+   */
+  static bool alloc_job_scratch(const Block_job& job, hs_scratch_t** scratch);
+
+  /*!
+   * \brief Returns the next finished job in input order with its output in
+   *        the form of mode, or nullptr at the end of the input.  Throws
+   *        std::runtime_error with the error of the job, if it has one.
+   */
+  Block_job* next_job(Line_output mode);
+
+  /*!
+   * \brief Discards what is left of the current input.
+   */
+  void reset_input();
+
+  /*!
+   * \brief Maps file for reading, or opens it as a stream if it cannot be
+   *        mapped.
+   */
+  void open_input_file(const std::string& file);
+
+  /*!
+   * \brief Body of each worker thread.  The worker owns scratch, which was
+   *        allocated for the Pattern_set of the given version.
+   */
+  void work(hs_scratch_t* scratch, uint64_t version);
+
+  /*!
+   * \brief Reads blocks into free jobs, on the calling thread, and queues
+   *        them in input order for the first idle worker.
+   */
+  void fill_jobs();
+
+  /*!
+   * \brief Waits for the jobs in flight and marks every job free.
+   */
+  void drain_jobs();
+
+  // member variables.
+  Line_normalizer norm;
+  std::vector<std::unique_ptr<Block_job>> jobs;
+  std::vector<std::thread> workers;
+  std::deque<Block_job*> pending;
+  std::mutex job_mutex;
+  std::condition_variable job_ready;
+  std::condition_variable job_done;
+  Normal_list empty_list;
+  struct Normal_stats empty_stats;
+  struct Normal_stats run_stats;
+  struct Normal_metrics run_metrics;
+  std::vector<std::string> input_files;
+  std::unique_ptr<hs_scratch_t, decltype(hs_free_scratch)*> caller_scratch{
+      nullptr, &hs_free_scratch};
+  size_t line_cache_bytes{0};
+  size_t next_file{0};
+  size_t reading_input{0};
+  size_t reading_offset{0};
+  size_t returned_input{0};
+  size_t returned_offset{0};
+  size_t head{0};
+  size_t in_flight{0};
+  Line_output output{Line_output::lines};
+  bool returned_head{false};
+  bool input_done{false};
+  bool stopping{false};
+  char _padding[4]{0};
+};
+
+#endif /*PARALLEL_NORMALIZOR_H*/
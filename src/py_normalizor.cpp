@@ -4,9 +4,17 @@
  * All rights reserved.
  */
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <istream>
 #include <map>
+#include <memory>
+#include <sstream>
+#include <streambuf>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 #include <boost/python.hpp>
@@ -19,7 +27,9 @@
 #include <boost/python/to_python_converter.hpp>
 #include <boost/python/tuple.hpp>
 
+#include "normal_file.h"
 #include "normalizor.h"
+#include "parallel_normalizor.h"
 
 using namespace boost::python;
 
@@ -44,7 +54,6 @@ template <typename T1, typename T2> struct std_pair_to_python_converter {
 
 PyObject* section2dict(Sections& section)
 {
-  Py_Initialize();
   dict x;
   for (const auto& s : section) {
     x[s.first] = s.second;
@@ -58,21 +67,534 @@ PyObject* str2bytes(Normal_line& data)
   return PyMemoryView_FromMemory(&data.line[0], dataSize, PyBUF_READ);
 }
 
+/*! \brief The metrics of norm as a dict.  Each phase maps to a tuple of
+ *         seconds and calls; bytes, lines, matches, type_matches and the
+ *         line cache counters hold the counters.
+ */
+dict get_metrics(const Line_normalizer& norm)
+{
+  auto metrics = norm.get_metrics();
+  dict result;
+  for (size_t i = 0; i < phase_count; ++i) {
+    auto phase = static_cast<Phase>(i);
+    result[phase_name(phase)] =
+        make_tuple(metrics.seconds(phase), metrics.calls(phase));
+  }
+  result["bytes"] = metrics.bytes;
+  result["lines"] = metrics.lines;
+  result["matches"] = metrics.matches;
+  result["line_cache_hits"] = metrics.line_cache_hits;
+  result["line_cache_misses"] = metrics.line_cache_misses;
+  result["line_cache_too_large"] = metrics.line_cache_too_large;
+  result["line_cache_evictions"] = metrics.line_cache_evictions;
+  list type_matches;
+  for (auto count : metrics.type_matches)
+    type_matches.append(count);
+  result["type_matches"] = type_matches;
+  return result;
+}
+
+/*! \brief Releases the GIL for its lifetime, so other Python threads run
+ *         while a block is read and scanned.
+ */
+class Gil_release {
+public:
+  Gil_release() : state(PyEval_SaveThread()) {}
+  Gil_release(const Gil_release&) = delete;
+  Gil_release& operator=(const Gil_release&) = delete;
+  ~Gil_release() { PyEval_RestoreThread(state); }
+
+private:
+  PyThreadState* state;
+};
+
+/*! \brief Holds the GIL for its lifetime.  Used by code that may run
+ *         while the GIL is released, possibly on another thread.
+ */
+class Gil_hold {
+public:
+  Gil_hold() : state(PyGILState_Ensure()) {}
+  Gil_hold(const Gil_hold&) = delete;
+  Gil_hold& operator=(const Gil_hold&) = delete;
+  ~Gil_hold() { PyGILState_Release(state); }
+
+private:
+  PyGILState_STATE state;
+};
+
+/*! \brief Raises StopIteration.
+ */
+[[noreturn]] static void stop_iteration()
+{
+  PyErr_SetNone(PyExc_StopIteration);
+  throw error_already_set();
+}
+
+/*! \brief A streambuf reading a Python file object opened in binary mode,
+ *         or in text mode, whose text is encoded as UTF-8.  An exception
+ *         raised by read() ends the input and is reported as unraisable.
+ */
+class Python_file_buf : public std::streambuf {
+public:
+  explicit Python_file_buf(object f) : file(std::move(f)), buffer(65536) {}
+  Python_file_buf(const Python_file_buf&) = delete;
+  Python_file_buf& operator=(const Python_file_buf&) = delete;
+  ~Python_file_buf() override
+  {
+    Gil_hold gil;
+    file = object();
+  }
+
+protected:
+  int_type underflow() override
+  {
+    if (gptr() < egptr())
+      return traits_type::to_int_type(*gptr());
+    Gil_hold gil;
+    Py_ssize_t length = 0;
+    try {
+      object chunk = file.attr("read")(buffer.size());
+      if (PyUnicode_Check(chunk.ptr()))
+        chunk = chunk.attr("encode")("utf-8");
+      Py_buffer view;
+      if (PyObject_GetBuffer(chunk.ptr(), &view, PyBUF_SIMPLE) != 0)
+        throw_error_already_set();
+      length = std::min(view.len, static_cast<Py_ssize_t>(buffer.size()));
+      std::memcpy(buffer.data(), view.buf, static_cast<size_t>(length));
+      PyBuffer_Release(&view);
+    } catch (const error_already_set&) {
+      PyErr_WriteUnraisable(file.ptr());
+      return traits_type::eof();
+    }
+    if (length == 0)
+      return traits_type::eof();
+    setg(buffer.data(), buffer.data(), buffer.data() + length);
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  object file;
+  std::vector<char> buffer;
+};
+
+/*! \brief An istream that owns its Python_file_buf.
+ */
+class Python_file_stream : public std::istream {
+public:
+  explicit Python_file_stream(object file)
+      : std::istream(nullptr), buf(std::move(file))
+  {
+    rdbuf(&buf);
+  }
+
+private:
+  Python_file_buf buf;
+};
+
+/*! \brief Designates the input of norm: a file name, a bytes-like object,
+ *         whose contents are copied, or a file object with a read method.
+ *         A file object is always read on demand, since a read-ahead
+ *         thread would need the GIL to read it while the thread waiting
+ *         for or stopping the read-ahead holds it.
+ */
+void set_input(Line_normalizer& norm, object source)
+{
+  if (PyUnicode_Check(source.ptr())) {
+    norm.set_input_stream(std::string(extract<std::string>(source)));
+    return;
+  }
+  if (PyObject_CheckBuffer(source.ptr())) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(source.ptr(), &view, PyBUF_SIMPLE) != 0)
+      throw_error_already_set();
+    std::string data(static_cast<const char*>(view.buf),
+                     static_cast<size_t>(view.len));
+    PyBuffer_Release(&view);
+    norm.set_input_stream(std::make_unique<std::istringstream>(data));
+    return;
+  }
+  if (!PyObject_HasAttrString(source.ptr(), "read")) {
+    PyErr_SetString(PyExc_TypeError,
+                    "input must be a file name, bytes or a file object");
+    throw_error_already_set();
+  }
+  auto buffers = norm.get_read_ahead();
+  norm.set_read_ahead(0);
+  norm.set_input_stream(std::make_unique<Python_file_stream>(source));
+  norm.set_read_ahead(buffers);
+}
+
+/*! \brief Renders the next block and returns a tuple of the rendered bytes
+ *         and a list of line offsets in those bytes.  The bytes are empty
+ *         once the input is exhausted.
+ */
+tuple get_rendered_block(Line_normalizer& norm)
+{
+  std::string out;
+  std::vector<size_t> line_offsets;
+  {
+    Gil_release unlocked;
+    norm.get_rendered_block(out, line_offsets);
+  }
+  list offsets;
+  for (auto offset : line_offsets)
+    offsets.append(offset);
+  object bytes(handle<>(PyBytes_FromStringAndSize(
+      out.data(), static_cast<Py_ssize_t>(out.size()))));
+  return make_tuple(bytes, offsets);
+}
+
+/*! \brief A read-only buffer over memory owned by another Python object.
+ *         memoryview() of it keeps the owner alive, so the memory of a
+ *         Normal_block can be shared without copying it.
+ */
+struct Block_buffer {
+  PyObject_HEAD PyObject* owner;
+  const void* data;
+  const char* format;
+  Py_ssize_t count;
+  Py_ssize_t itemsize;
+};
+
+static PyTypeObject* block_buffer_type = nullptr;
+
+static int block_buffer_get(PyObject* self, Py_buffer* view, int flags)
+{
+  auto* buf = reinterpret_cast<Block_buffer*>(self);
+  if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "Normal_block buffers are read-only");
+    view->obj = nullptr;
+    return -1;
+  }
+  view->obj = self;
+  Py_INCREF(self);
+  view->buf = const_cast<void*>(buf->data);
+  view->len = buf->count * buf->itemsize;
+  view->readonly = 1;
+  view->itemsize = buf->itemsize;
+  view->format = (flags & PyBUF_FORMAT) == PyBUF_FORMAT
+                     ? const_cast<char*>(buf->format)
+                     : nullptr;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &buf->count : nullptr;
+  view->strides =
+      (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &buf->itemsize : nullptr;
+  view->suboffsets = nullptr;
+  view->internal = nullptr;
+  return 0;
+}
+
+static void block_buffer_dealloc(PyObject* self)
+{
+  PyTypeObject* type = Py_TYPE(self);
+  Py_XDECREF(reinterpret_cast<Block_buffer*>(self)->owner);
+  type->tp_free(self);
+  Py_DECREF(type);
+}
+
+static void register_block_buffer()
+{
+  static PyType_Slot slots[] = {
+      {Py_tp_dealloc, reinterpret_cast<void*>(block_buffer_dealloc)},
+      {Py_bf_getbuffer, reinterpret_cast<void*>(block_buffer_get)},
+      {0, nullptr}};
+  static PyType_Spec spec = {"normalizor.Block_buffer", sizeof(Block_buffer),
+                             0, Py_TPFLAGS_DEFAULT, slots};
+  block_buffer_type = reinterpret_cast<PyTypeObject*>(PyType_FromSpec(&spec));
+  if (!block_buffer_type)
+    throw_error_already_set();
+}
+
+/*! \brief The struct module format of T, which NumPy understands too.
+ */
+template <typename T> constexpr const char* buffer_format()
+{
+  static_assert(std::is_integral_v<T> && (sizeof(T) == 1 || sizeof(T) == 4 ||
+                                          sizeof(T) == 8),
+                "no buffer format for this type");
+  if constexpr (sizeof(T) == 1)
+    return "B";
+  else if constexpr (sizeof(T) == 4)
+    return std::is_signed_v<T> ? "i" : "I";
+  else
+    return std::is_signed_v<T> ? "q" : "Q";
+}
+
+/*! \brief Returns a read-only memoryview of values, which belongs to the
+ *         Normal_block wrapped by owner.
+ */
+template <typename T>
+object block_view(object owner, const std::vector<T>& values)
+{
+  auto* buf = PyObject_New(Block_buffer, block_buffer_type);
+  if (!buf)
+    throw_error_already_set();
+  buf->owner = incref(owner.ptr());
+  buf->data = values.data();
+  buf->format = buffer_format<T>();
+  buf->count = static_cast<Py_ssize_t>(values.size());
+  buf->itemsize = static_cast<Py_ssize_t>(sizeof(T));
+  object exporter(handle<>(reinterpret_cast<PyObject*>(buf)));
+  return object(handle<>(PyMemoryView_FromObject(exporter.ptr())));
+}
+
+object block_data(object self)
+{
+  return block_view(self, extract<Normal_block&>(self)().data);
+}
+
+object block_line_offsets(object self)
+{
+  return block_view(self, extract<Normal_block&>(self)().line_offsets);
+}
+
+object block_section_offsets(object self)
+{
+  return block_view(self, extract<Normal_block&>(self)().section_offsets);
+}
+
+object block_section_starts(object self)
+{
+  return block_view(self, extract<Normal_block&>(self)().section_starts);
+}
+
+object block_section_ends(object self)
+{
+  return block_view(self, extract<Normal_block&>(self)().section_ends);
+}
+
+object block_section_ids(object self)
+{
+  return block_view(self, extract<Normal_block&>(self)().section_ids);
+}
+
+object block_section_values(object self)
+{
+  return block_view(self, extract<Normal_block&>(self)().section_values);
+}
+
+object block_fingerprints(object self)
+{
+  return block_view(self, extract<Normal_block&>(self)().fingerprints);
+}
+
+/*! \brief The templates of a Normal_stats as a dict of fingerprint to the
+ *         number of lines.
+ */
+dict stats_templates(const Normal_stats& stats)
+{
+  dict templates;
+  for (const auto& tmpl : stats.templates)
+    templates[tmpl.first] = tmpl.second;
+  return templates;
+}
+
+/*! \brief The number of sections of each Normal_type id as a list.
+ */
+list stats_type_matches(const Normal_stats& stats)
+{
+  list matches;
+  for (auto count : stats.type_matches)
+    matches.append(count);
+  return matches;
+}
+
+/*! \brief Normalizes the next block into a new Normal_block, without
+ *         holding the GIL while the block is read and scanned.  The block
+ *         is empty once the input is exhausted.
+ */
+object get_normalized_columns(Line_normalizer& norm)
+{
+  object result{Normal_block()};
+  Normal_block& block = extract<Normal_block&>(result);
+  {
+    Gil_release unlocked;
+    norm.get_normalized_block(block);
+  }
+  return result;
+}
+
+/*! \brief Reads the next block of a normalized file into a new
+ *         Normal_block.  The block is empty at the end of the file.
+ */
+object read_normal_block(Normal_file_reader& reader)
+{
+  object result{Normal_block()};
+  Normal_block& block = extract<Normal_block&>(result);
+  {
+    Gil_release unlocked;
+    reader.read_block(block);
+  }
+  return result;
+}
+
+/*! \brief Holds the buffers of a list of bytes-like objects so they can be
+ *         read without the GIL.
+ */
+class Message_buffers {
+public:
+  explicit Message_buffers(list items)
+  {
+    auto count = len(items);
+    buffers.reserve(static_cast<size_t>(count));
+    views.reserve(static_cast<size_t>(count));
+    for (decltype(count) i = 0; i < count; ++i) {
+      Py_buffer view;
+      object item = items[i];
+      if (PyObject_GetBuffer(item.ptr(), &view, PyBUF_SIMPLE) != 0) {
+        release();
+        throw_error_already_set();
+      }
+      buffers.push_back(view);
+      views.emplace_back(static_cast<const char*>(view.buf),
+                         static_cast<size_t>(view.len));
+    }
+  }
+  Message_buffers(const Message_buffers&) = delete;
+  Message_buffers& operator=(const Message_buffers&) = delete;
+  ~Message_buffers() { release(); }
+
+  std::vector<std::string_view> views;
+
+private:
+  void release()
+  {
+    for (auto& view : buffers)
+      PyBuffer_Release(&view);
+    buffers.clear();
+  }
+
+  std::vector<Py_buffer> buffers;
+};
+
+/*! \brief Normalizes a list of bytes-like messages into a new Normal_block
+ *         and returns a tuple of the block and a list with the index of
+ *         the first line of every message, followed by the number of lines.
+ */
+tuple normalize_messages(Line_normalizer& norm, object messages)
+{
+  Message_buffers buffers{list(messages)};
+  object result{Normal_block()};
+  Normal_block& block = extract<Normal_block&>(result);
+  std::vector<size_t> message_lines;
+  {
+    Gil_release unlocked;
+    norm.normalize_messages(buffers.views, block, message_lines);
+  }
+  list first_lines;
+  for (auto line : message_lines)
+    first_lines.append(line);
+  return make_tuple(result, first_lines);
+}
+
+/*! \brief Compiles a dict of Normal_type id to Normal_type and publishes
+ *         it, without holding the GIL while it compiles, so another thread
+ *         can keep normalizing.
+ */
+bool update_normal_types(Line_normalizer& norm, dict types)
+{
+  std::map<size_t, Normal_type> new_types;
+  list items = types.items();
+  auto count = len(items);
+  for (decltype(count) i = 0; i < count; ++i) {
+    size_t id = extract<size_t>(items[i][0]);
+    new_types[id] = extract<Normal_type>(items[i][1]);
+  }
+  Gil_release unlocked;
+  return norm.update_normal_types(std::move(new_types));
+}
+
+/*! \brief The version of the last published pattern set.
+ */
+uint64_t get_pattern_version(const Line_normalizer& norm)
+{
+  auto set = norm.get_pattern_set();
+  return set ? set->version : 0;
+}
+
+/*! \brief Iterates over the blocks of a Line_normalizer as Normal_blocks.
+ */
+struct Block_iterator {
+  object norm;
+};
+
+Block_iterator iterate_blocks(object norm) { return Block_iterator{norm}; }
+
+object next_block(Block_iterator& it)
+{
+  object block = get_normalized_columns(extract<Line_normalizer&>(it.norm));
+  if (extract<Normal_block&>(block)().empty())
+    stop_iteration();
+  return block;
+}
+
+object pass_through(object self) { return self; }
+
+/*! \brief Normalizes a list of files, directories and glob patterns on a
+ *         pool of native threads and iterates over (file name,
+ *         Normal_block) tuples in input order.
+ */
+class File_set {
+public:
+  File_set(list names, size_t threads) : norm(threads)
+  {
+    std::vector<std::string> paths;
+    auto count = len(names);
+    for (decltype(count) i = 0; i < count; ++i)
+      paths.push_back(extract<std::string>(names[i]));
+    paths = expand_input_files(paths);
+    for (const auto& path : paths)
+      files.append(path);
+    norm.set_input_files(std::move(paths));
+  }
+
+  object next()
+  {
+    object result{Normal_block()};
+    Normal_block& block = extract<Normal_block&>(result);
+    bool found;
+    {
+      Gil_release unlocked;
+      found = norm.get_normalized_block(block);
+    }
+    if (!found)
+      stop_iteration();
+    return make_tuple(files[norm.current_input()], result);
+  }
+
+  /*! \brief The byte offset in its file of the last block returned.
+   */
+  size_t offset() const { return norm.current_offset(); }
+
+private:
+  list files;
+  Parallel_normalizer norm;
+};
+
+File_set* normalize_files(object files, size_t threads)
+{
+  return new File_set(list(files), threads);
+}
+
 /*! \brief This declares the python module.  The name must match the library
  *  name exactly!
  */
 BOOST_PYTHON_MODULE(normalizor)
 {
+  register_block_buffer();
   def("section2dict", section2dict);
   def("str2bytes", str2bytes);
+  def("normalize_files", normalize_files,
+      (arg("files"), arg("threads") = 0),
+      return_value_policy<manage_new_object>());
   std_pair_to_python_converter<int, size_t>();
 
   /*! \brief Provides a means to simplify function overloading.  In this case
    *         This allows python to know which function to use given that
-   *         set_input_stream has two possible choices.
+   *         get_normalized_block has several possible choices.
    */
-  void (Line_normalizer::*s1)(const std::string&) =
-      &Line_normalizer::set_input_stream;
+  const Normal_list& (Line_normalizer::*g1)() =
+      &Line_normalizer::get_normalized_block;
 
   /*! \brief The following 2 classes are for facilitating conversion of data
    *         types to and from python.  Both of these data types are typedefed
@@ -82,12 +604,38 @@ BOOST_PYTHON_MODULE(normalizor)
 
   class_<Normal_list>("Normal_list").def(vector_indexing_suite<Normal_list>());
 
+  enum_<Render_policy>("Render_policy")
+      .value("replace", Render_policy::replace)
+      .value("keep", Render_policy::keep)
+      .value("drop", Render_policy::drop);
+
+  enum_<Match_mode>("Match_mode")
+      .value("leftmost", Match_mode::leftmost)
+      .value("greedy_extend", Match_mode::greedy_extend);
+
+  enum_<Value_decoder>("Value_decoder")
+      .value("none", Value_decoder::none)
+      .value("ipv4", Value_decoder::ipv4)
+      .value("timestamp", Value_decoder::timestamp)
+      .value("decimal", Value_decoder::decimal)
+      .value("hex", Value_decoder::hex)
+      .value("version", Value_decoder::version);
+  scope().attr("no_value") = no_value;
+
   /*! \brief Exposes Normal_type to python.
    */
   class_<Normal_type>("Normal_type",
                       init<std::string, unsigned int, std::string>())
+      .def(init<std::string, unsigned int, std::string, Match_mode>())
+      .def(init<std::string, unsigned int, std::string, Match_mode,
+                std::string>())
+      .def(init<std::string, unsigned int, std::string, Match_mode,
+                std::string, Value_decoder>())
       .def_readonly("regex", &Normal_type::regex)
       .def_readonly("flags", &Normal_type::flags)
+      .def_readonly("mode", &Normal_type::mode)
+      .def_readonly("required_literal", &Normal_type::required_literal)
+      .def_readonly("decoder", &Normal_type::decoder)
       .def_readonly("replacement", &Normal_type::replacement);
 
   /*! \brief Exposes Normal_line to python.
@@ -95,7 +643,52 @@ BOOST_PYTHON_MODULE(normalizor)
   class_<Normal_line, boost::noncopyable>("Normal_line",
                                           init<std::string, Sections&>())
       .def_readonly("line", &Normal_line::line)
-      .def_readonly("sections", &Normal_line::sections);
+      .def_readonly("sections", &Normal_line::sections)
+      .def_readonly("fingerprint", &Normal_line::fingerprint);
+
+  /*! \brief Exposes Normal_block to python.  Its columns are read-only
+   *         memoryviews of the C++ vectors, which can be wrapped by
+   *         numpy.asarray() without copying.
+   */
+  class_<Normal_block>("Normal_block", init<>())
+      .def("__len__", &Normal_block::size)
+      .add_property("data", block_data)
+      .add_property("line_offsets", block_line_offsets)
+      .add_property("section_offsets", block_section_offsets)
+      .add_property("section_starts", block_section_starts)
+      .add_property("section_ends", block_section_ends)
+      .add_property("section_ids", block_section_ids)
+      .add_property("section_values", block_section_values)
+      .add_property("fingerprints", block_fingerprints);
+
+  /*! \brief Exposes Normal_stats to python.
+   */
+  class_<Normal_stats>("Normal_stats")
+      .def_readonly("lines", &Normal_stats::lines)
+      .add_property("templates", stats_templates)
+      .add_property("type_matches", stats_type_matches);
+
+  class_<Block_iterator>("Block_iterator", no_init)
+      .def("__iter__", pass_through)
+      .def("__next__", next_block);
+
+  class_<File_set, boost::noncopyable>("File_set", no_init)
+      .def("__iter__", pass_through)
+      .def("__next__", &File_set::next)
+      .add_property("offset", &File_set::offset);
+
+  /*! \brief Exposes the binary file of normalized blocks to python.
+   */
+  class_<Normal_file_writer, boost::noncopyable>("Normal_file_writer")
+      .def("open", &Normal_file_writer::open)
+      .def("write_block", &Normal_file_writer::write_block)
+      .def("close", &Normal_file_writer::close);
+
+  class_<Normal_file_reader, boost::noncopyable>("Normal_file_reader")
+      .def("open", &Normal_file_reader::open)
+      .def("normal_types_hash", &Normal_file_reader::normal_types_hash)
+      .def("read_block", read_normal_block)
+      .def("rewind", &Normal_file_reader::rewind);
 
   /*! \brief Exposes Line_normalizer to python.
    */
@@ -105,8 +698,35 @@ BOOST_PYTHON_MODULE(normalizor)
            return_value_policy<reference_existing_object>())
       .def("modify_current_normal_types",
            &Line_normalizer::modify_current_normal_types)
-      .def("get_normalized_block", &Line_normalizer::get_normalized_block,
+      .def("begin_normal_types_update",
+           &Line_normalizer::begin_normal_types_update)
+      .def("commit_normal_types_update",
+           &Line_normalizer::commit_normal_types_update)
+      .def("set_database_cache", &Line_normalizer::set_database_cache)
+      .def("normal_types_hash", &Line_normalizer::normal_types_hash)
+      .def("update_normal_types", update_normal_types)
+      .def("get_pattern_version", get_pattern_version)
+      .def("get_block_pattern_version",
+           &Line_normalizer::get_block_pattern_version)
+      .def("get_normalized_block", g1,
+           return_value_policy<copy_const_reference>())
+      .def("set_render_policy", &Line_normalizer::set_render_policy)
+      .def("get_normalized_columns", get_normalized_columns)
+      .def("get_rendered_block", get_rendered_block)
+      .def("normalize_messages", normalize_messages)
+      .def("set_input_stream", set_input)
+      .def("__iter__", iterate_blocks)
+      .def("map_input_file", &Line_normalizer::map_input_file)
+      .def("set_read_ahead", &Line_normalizer::set_read_ahead)
+      .def("set_line_cache", &Line_normalizer::set_line_cache)
+      .def("set_statistics", &Line_normalizer::set_statistics)
+      .def("get_block_statistics", &Line_normalizer::get_block_statistics,
+           return_value_policy<copy_const_reference>())
+      .def("get_run_statistics", &Line_normalizer::get_run_statistics,
            return_value_policy<copy_const_reference>())
-      .def("set_input_stream", s1)
+      .def("reset_statistics", &Line_normalizer::reset_statistics)
+      .def("set_metrics", &Line_normalizer::set_metrics)
+      .def("get_metrics", get_metrics)
+      .def("reset_metrics", &Line_normalizer::reset_metrics)
       .def_readonly("line_end_id", &Line_normalizer::line_end_id);
 }
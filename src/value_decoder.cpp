@@ -0,0 +1,441 @@
+//===-------- value_decoder.cpp, Typed values of sections ----------------===//
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "value_decoder.h"
+
+namespace {
+
+constexpr uint64_t bytes_of(uint64_t byte) { return 0x0101010101010101 * byte; }
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+bool is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+
+/*!
+ * \brief Loads 8 bytes so that the first is in the highest byte, as the
+ *        most significant digit of a number is.
+ */
+uint64_t load_big_endian(const char* p)
+{
+  uint64_t chunk;
+  std::memcpy(&chunk, p, sizeof(chunk));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  chunk = __builtin_bswap64(chunk);
+#endif
+  return chunk;
+}
+
+/*!
+ * \brief Parses 8 decimal digits at once.  Returns false if one of them is
+ *        not a digit.
+ */
+bool parse_eight_digits(const char* p, uint64_t& value)
+{
+  uint64_t chunk = load_big_endian(p);
+  // Every byte is 0x30 to 0x39: its high nibble is 3, and still is once 6
+  // is added to it.
+  if (((chunk & bytes_of(0xf0)) |
+       (((chunk + bytes_of(0x06)) & bytes_of(0xf0)) >> 4)) != bytes_of(0x33))
+    return false;
+  chunk -= bytes_of('0');
+  // Combines neighbouring digits into lanes of 2, 4 and 8 digits.
+  chunk = ((chunk >> 8) * 10 + chunk) & 0x00ff00ff00ff00ff;
+  chunk = ((chunk >> 16) * 100 + chunk) & 0x0000ffff0000ffff;
+  value = (chunk >> 32) * 10000 + (chunk & 0xffffffff);
+  return true;
+}
+
+/*!
+ * \brief Flags the bytes of x between low and high, exclusive, with their
+ *        top bit.  low and high must be below 128.
+ */
+constexpr uint64_t bytes_between(uint64_t x, uint64_t low, uint64_t high)
+{
+  uint64_t seven_bits = x & bytes_of(0x7f);
+  return (bytes_of(127 + high) - seven_bits) & ~x &
+         (seven_bits + bytes_of(127 - low)) & bytes_of(0x80);
+}
+
+/*!
+ * \brief Parses 8 hexadecimal digits at once.  Returns false if one of
+ *        them is not a digit.
+ */
+bool parse_eight_hex_digits(const char* p, uint64_t& value)
+{
+  uint64_t chunk = load_big_endian(p);
+  // Letters are compared in lower case.
+  uint64_t letters = bytes_between(chunk | bytes_of(0x20), 'a' - 1, 'f' + 1);
+  if ((bytes_between(chunk, '0' - 1, '9' + 1) | letters) != bytes_of(0x80))
+    return false;
+  chunk = (chunk & bytes_of(0x0f)) + (letters >> 7) * 9;
+  chunk = (chunk | chunk >> 4) & 0x00ff00ff00ff00ff;
+  chunk = (chunk | chunk >> 8) & 0x0000ffff0000ffff;
+  value = (chunk | chunk >> 16) & 0xffffffff;
+  return true;
+}
+
+int hex_digit(char c)
+{
+  if (is_digit(c))
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/*!
+ * \brief Reads at least one and at most max_digits decimal digits at pos,
+ *        moving pos past them.  Returns the number of digits read.
+ */
+size_t read_number(std::string_view text, size_t& pos, size_t max_digits,
+                   uint64_t& value)
+{
+  size_t start = pos;
+  value = 0;
+  for (; pos < text.size() && pos - start < max_digits && is_digit(text[pos]);
+       ++pos)
+    value = value * 10 + static_cast<uint64_t>(text[pos] - '0');
+  return pos - start;
+}
+
+bool read_char(std::string_view text, size_t& pos, char c)
+{
+  if (pos >= text.size() || text[pos] != c)
+    return false;
+  ++pos;
+  return true;
+}
+
+bool read_space(std::string_view text, size_t& pos)
+{
+  if (pos >= text.size() || !is_space(text[pos]))
+    return false;
+  ++pos;
+  return true;
+}
+
+/*!
+ * \brief Reads the '-', '/' or white space between the fields of a date.
+ */
+bool read_date_separator(std::string_view text, size_t& pos)
+{
+  return read_char(text, pos, '-') || read_char(text, pos, '/') ||
+         read_space(text, pos);
+}
+
+bool matches_caseless(std::string_view text, size_t pos, std::string_view word)
+{
+  if (text.size() - pos < word.size())
+    return false;
+  for (size_t i = 0; i < word.size(); ++i) {
+    if ((text[pos + i] | 0x20) != word[i])
+      return false;
+  }
+  return true;
+}
+
+/*!
+ * \brief Reads the English name of a month, or its first three letters, at
+ *        pos.  Returns the month from 1 to 12, or 0 if there is none.
+ */
+int64_t read_month(std::string_view text, size_t& pos)
+{
+  static constexpr std::array<std::string_view, 12> names = {
+      "january", "february", "march",     "april",   "may",      "june",
+      "july",    "august",   "september", "october", "november", "december"};
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!matches_caseless(text, pos, names[i].substr(0, 3)))
+      continue;
+    pos += matches_caseless(text, pos, names[i]) ? names[i].size() : 3;
+    return static_cast<int64_t>(i) + 1;
+  }
+  return 0;
+}
+
+int64_t expand_year(uint64_t year, size_t digits)
+{
+  if (digits > 2)
+    return static_cast<int64_t>(year);
+  return static_cast<int64_t>(year) + (year < 70 ? 2000 : 1900);
+}
+
+bool is_valid_date(int64_t year, int64_t month, int64_t day)
+{
+  static constexpr std::array<int64_t, 12> days = {31, 29, 31, 30, 31, 30,
+                                                   31, 31, 30, 31, 30, 31};
+  if (month < 1 || month > 12 || day < 1 ||
+      day > days[static_cast<size_t>(month - 1)])
+    return false;
+  bool leap = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+  return month != 2 || day < 29 || leap;
+}
+
+/*!
+ * \brief The days from 1970-01-01 to the given date of the proleptic
+ *        Gregorian calendar.
+ */
+int64_t days_from_civil(int64_t year, int64_t month, int64_t day)
+{
+  year -= month <= 2 ? 1 : 0;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int64_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 +
+                        day - 1;
+  int64_t day_of_era = year_of_era * 365 + year_of_era / 4 -
+                       year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+/*!
+ * \brief Reads the date at the start of text into year, month and day.
+ */
+bool read_date(std::string_view text, size_t& pos, int64_t& year,
+               int64_t& month, int64_t& day)
+{
+  uint64_t first = 0;
+  size_t first_digits = read_number(text, pos, 4, first);
+  if (first_digits == 0) {
+    // "Mon D" or "Mon D YYYY"
+    month = read_month(text, pos);
+    if (month == 0 || !read_space(text, pos))
+      return false;
+    read_space(text, pos);
+    uint64_t number = 0;
+    if (read_number(text, pos, 2, number) == 0)
+      return false;
+    day = static_cast<int64_t>(number);
+    size_t year_pos = pos;
+    if (read_space(text, year_pos) &&
+        read_number(text, year_pos, 4, number) == 4) {
+      year = static_cast<int64_t>(number);
+      pos = year_pos;
+    }
+    return true;
+  }
+  if (first_digits == 3 || !read_date_separator(text, pos))
+    return false;
+  uint64_t second = 0;
+  int64_t named_month = read_month(text, pos);
+  if ((named_month == 0 && read_number(text, pos, 2, second) == 0) ||
+      !read_date_separator(text, pos))
+    return false;
+  uint64_t third = 0;
+  size_t third_digits = read_number(text, pos, 4, third);
+  if (third_digits == 0 || third_digits == 3)
+    return false;
+  if (first_digits == 4) {
+    if (third_digits > 2)
+      return false;
+    year = static_cast<int64_t>(first);
+    month = named_month ? named_month : static_cast<int64_t>(second);
+    day = static_cast<int64_t>(third);
+  } else if (named_month) {
+    year = expand_year(third, third_digits);
+    month = named_month;
+    day = static_cast<int64_t>(first);
+  } else {
+    year = expand_year(third, third_digits);
+    month = static_cast<int64_t>(first);
+    day = static_cast<int64_t>(second);
+  }
+  return true;
+}
+
+/*!
+ * \brief Reads the optional time of day and offset after a date into
+ *        seconds, the seconds since midnight in UTC.
+ */
+bool read_time(std::string_view text, size_t& pos, int64_t& seconds)
+{
+  seconds = 0;
+  if (pos == text.size())
+    return true;
+  if (!read_char(text, pos, ':') && !read_space(text, pos))
+    return false;
+  uint64_t hour = 0;
+  uint64_t minute = 0;
+  uint64_t second = 0;
+  if (read_number(text, pos, 2, hour) != 2 || !read_char(text, pos, ':') ||
+      read_number(text, pos, 2, minute) != 2 || !read_char(text, pos, ':') ||
+      read_number(text, pos, 2, second) != 2 || minute > 59 || second > 60)
+    return false;
+  if (pos < text.size()) {
+    if (!read_space(text, pos))
+      return false;
+    if (matches_caseless(text, pos, "am") ||
+        matches_caseless(text, pos, "pm")) {
+      if (hour < 1 || hour > 12)
+        return false;
+      hour = (hour % 12) + ((text[pos] | 0x20) == 'p' ? 12u : 0u);
+      pos += 2;
+    } else if (text[pos] == '+' || text[pos] == '-') {
+      bool ahead = text[pos++] == '+';
+      uint64_t offset = 0;
+      size_t digits = read_number(text, pos, 4, offset);
+      uint64_t minutes = 0;
+      if (digits == 2) {
+        if (!read_char(text, pos, ':') ||
+            read_number(text, pos, 2, minutes) != 2)
+          return false;
+        offset = offset * 100 + minutes;
+      } else if (digits < 3) {
+        return false;
+      }
+      if (offset % 100 > 59)
+        return false;
+      auto shift =
+          static_cast<int64_t>(offset / 100 * 3600 + offset % 100 * 60);
+      seconds -= ahead ? shift : -shift;
+    } else {
+      return false;
+    }
+  }
+  if (hour > 23)
+    return false;
+  seconds += static_cast<int64_t>(hour * 3600 + minute * 60 + second);
+  return true;
+}
+
+} // namespace
+
+int64_t decode_ipv4(std::string_view text)
+{
+  size_t pos = 0;
+  uint64_t address = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (i > 0) {
+      if (pos >= text.size() || (text[pos] != '.' && text[pos] != '-'))
+        return no_value;
+      ++pos;
+    }
+    uint64_t octet = 0;
+    if (read_number(text, pos, 3, octet) == 0 || octet > 255)
+      return no_value;
+    address = address << 8 | octet;
+  }
+  if (read_char(text, pos, '/')) {
+    uint64_t prefix = 0;
+    if (read_number(text, pos, 2, prefix) == 0 || prefix > 32)
+      return no_value;
+    address |= (prefix + 1) << 32;
+  }
+  return pos == text.size() ? static_cast<int64_t>(address) : no_value;
+}
+
+int64_t decode_timestamp(std::string_view text)
+{
+  size_t pos = 0;
+  int64_t year = 1970;
+  int64_t month = 0;
+  int64_t day = 0;
+  int64_t seconds = 0;
+  if (!read_date(text, pos, year, month, day) ||
+      !is_valid_date(year, month, day) || !read_time(text, pos, seconds) ||
+      pos != text.size())
+    return no_value;
+  return days_from_civil(year, month, day) * 86400 + seconds;
+}
+
+int64_t decode_decimal(std::string_view text)
+{
+  bool negative = !text.empty() && text[0] == '-';
+  if (!text.empty() && (text[0] == '-' || text[0] == '+'))
+    text.remove_prefix(1);
+  if (text.empty() || text.size() > 18)
+    return no_value;
+  const char* p = text.data();
+  size_t digits = text.size();
+  uint64_t value = 0;
+  for (; digits >= 8; digits -= 8, p += 8) {
+    uint64_t eight = 0;
+    if (!parse_eight_digits(p, eight))
+      return no_value;
+    value = value * 100000000 + eight;
+  }
+  for (; digits > 0; --digits, ++p) {
+    if (!is_digit(*p))
+      return no_value;
+    value = value * 10 + static_cast<uint64_t>(*p - '0');
+  }
+  auto signed_value = static_cast<int64_t>(value);
+  return negative ? -signed_value : signed_value;
+}
+
+int64_t decode_hex(std::string_view text)
+{
+  if (text.size() > 2 && (text[0] == '0' || text[0] == '\\') &&
+      (text[1] | 0x20) == 'x')
+    text.remove_prefix(2);
+  else if (!text.empty() && text[0] == '%')
+    text.remove_prefix(1);
+  if (text.empty() || text.size() > 16)
+    return no_value;
+  const char* p = text.data();
+  size_t digits = text.size();
+  uint64_t value = 0;
+  for (; digits >= 8; digits -= 8, p += 8) {
+    uint64_t eight = 0;
+    if (!parse_eight_hex_digits(p, eight))
+      return no_value;
+    value = value << 32 | eight;
+  }
+  for (; digits > 0; --digits, ++p) {
+    int nibble = hex_digit(*p);
+    if (nibble < 0)
+      return no_value;
+    value = value << 4 | static_cast<uint64_t>(nibble);
+  }
+  return static_cast<int64_t>(value);
+}
+
+int64_t decode_version(std::string_view text)
+{
+  size_t pos = 0;
+  uint64_t value = 0;
+  for (int parts = 1;; ++parts) {
+    uint64_t part = 0;
+    if (read_number(text, pos, 5, part) == 0 || part > 0xffff ||
+        (parts == 1 && part > 0x7fff))
+      return no_value;
+    value = value << 16 | part;
+    if (pos == text.size())
+      return static_cast<int64_t>(value << (16 * (4 - parts)));
+    if (parts == 4 || (text[pos] != '.' && text[pos] != '_'))
+      return no_value;
+    ++pos;
+  }
+}
+
+int64_t decode_value(Value_decoder decoder, std::string_view text)
+{
+  switch (decoder) {
+  case Value_decoder::none:
+    return no_value;
+  case Value_decoder::ipv4:
+    return decode_ipv4(text);
+  case Value_decoder::timestamp:
+    return decode_timestamp(text);
+  case Value_decoder::decimal:
+    return decode_decimal(text);
+  case Value_decoder::hex:
+    return decode_hex(text);
+  case Value_decoder::version:
+    return decode_version(text);
+  }
+  return no_value;
+}
@@ -0,0 +1,69 @@
+//===-------- value_decoder.h, Typed values of sections ------------------===//
+
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ *
+ * \brief value_decoder turns the text of a section into a 64-bit integer,
+ *        so callers get epoch seconds, addresses and numbers without parsing
+ *        the sections again.
+ */
+#ifndef VALUE_DECODER_H
+#define VALUE_DECODER_H
+
+#include <cstdint>
+#include <limits>
+#include <string_view>
+
+/*!
+ * \brief How the text of the sections of a Normal_type is decoded.
+ */
+enum class Value_decoder : char {
+  none, //!< not decoded.
+  /*!
+   * four decimal octets separated by '.' or '-', with an optional "/n"
+   * prefix length.  The low 32 bits of the value are the address, and the
+   * bits above them the prefix length plus one, or 0 without a prefix.
+   */
+  ipv4,
+  /*!
+   * the dates of the default timestamp Normal_type: Y-M-D, M/D/Y, D-Mon-Y
+   * and "Mon D [Y]", followed by an optional hh:mm:ss, am/pm and +hhmm or
+   * +hh:mm offset.  The value is seconds since the epoch, taking a time
+   * without an offset as UTC.  Dates without a year are in 1970.
+   */
+  timestamp,
+  decimal, //!< an optional sign and up to 18 decimal digits.
+  /*!
+   * up to 16 hexadecimal digits, after an optional "0x", "\x" or "%", as
+   * the bits of a uint64_t.  0x8000000000000000 cannot be told apart from
+   * no_value.
+   */
+  hex,
+  /*!
+   * up to four numbers separated by '.' or '_', each stored in 16 bits
+   * with the first in the highest, so values compare as versions do.  The
+   * first is at most 32767.
+   */
+  version
+};
+
+/*!
+ * \brief The value of a section that is not decoded or does not parse.
+ */
+constexpr int64_t no_value = std::numeric_limits<int64_t>::min();
+
+/*!
+ * \brief Decodes text with decoder.
+ *
+ * \returns the value, or no_value.
+ */
+int64_t decode_value(Value_decoder decoder, std::string_view text);
+
+int64_t decode_ipv4(std::string_view text);
+int64_t decode_timestamp(std::string_view text);
+int64_t decode_decimal(std::string_view text);
+int64_t decode_hex(std::string_view text);
+int64_t decode_version(std::string_view text);
+
+#endif /*VALUE_DECODER_H*/
@@ -1,13 +1,28 @@
+#include <cstdio>
 #include <ctime>
 #include <fstream>
 #include <istream>
+#include <iterator>
 #include <ostream>
+#include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
 #include <gtest/gtest.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
+#include "compressed_input.h"
+#include "normal_file.h"
 #include "normalizor.h"
+#include "parallel_normalizor.h"
 
 static void build_log_file(const std::string& fname, size_t total_lines)
 {
@@ -79,6 +94,123 @@ TEST(test_basic_normaliztion, test_sections)
   }
 }
 
+TEST(test_basic_normaliztion, test_flat_sections)
+{
+  std::string my_line = "12/31/1999 12:59:59 an ip 4.56.789.0 a;base64,0A1B a "
+                        "hex \\x0b and a vn v1.2_3 a num 123 lala\n";
+  Line_normalizer norm;
+  std::istringstream in(my_line + my_line);
+  norm.set_input_stream(in);
+  auto views = norm.get_normalized_view_block();
+  ASSERT_EQ(views.size(), 2);
+  std::vector<int> sec_ids = {1, 8, 8, 8, 2, 8, 3, 8, 8, 6,
+                              8, 8, 8, 8, 5, 8, 8, 8, 7, 8};
+  for (const auto& view : views) {
+    EXPECT_EQ(view.line, my_line);
+    ASSERT_EQ(view.sections.size(), sec_ids.size());
+    size_t prev_end = 0;
+    for (size_t i = 0; i < sec_ids.size(); ++i) {
+      EXPECT_EQ(view.sections[i].id, sec_ids[i]);
+      EXPECT_GE(view.sections[i].start, prev_end);
+      EXPECT_GT(view.sections[i].end, view.sections[i].start);
+      prev_end = view.sections[i].end;
+    }
+  }
+  EXPECT_EQ(views.front().sections[0].start, 0);
+  EXPECT_EQ(views.front().sections[0].end, 19);
+  EXPECT_EQ(views.back().sections[0].start, 0);
+  EXPECT_EQ(views.back().sections[0].end, 19);
+}
+
+/*!
+ * \brief The overlap resolution of the original map based implementation,
+ *        kept as the reference for resolve_sections.
+ */
+static Sections
+reference_sections(const std::vector<struct Normal_section>& matches)
+{
+  Sections secs;
+  for (const auto& m : matches) {
+    auto it = secs.find(m.start);
+    if (it == secs.end() || it->second.second < m.end ||
+        (it->second.second == m.end && it->second.first > m.id))
+      secs[m.start] = std::make_pair(m.id, m.end);
+  }
+  if (secs.empty())
+    return secs;
+  size_t longest = secs.begin()->second.second;
+  auto sec_it = std::next(secs.begin());
+  while (sec_it != secs.end()) {
+    if (sec_it->first < longest) {
+      if (sec_it->second.second < longest) {
+        sec_it = secs.erase(sec_it);
+      } else {
+        auto prev_it = std::prev(sec_it);
+        if (prev_it->second.second - prev_it->first >
+                sec_it->second.second - sec_it->first ||
+            (prev_it->second.second - prev_it->first ==
+                 sec_it->second.second - sec_it->first &&
+             prev_it->second.first < sec_it->second.first)) {
+          sec_it = secs.erase(sec_it);
+        } else {
+          sec_it = secs.erase(prev_it);
+          ++sec_it;
+        }
+      }
+    } else {
+      longest = sec_it->second.second;
+      ++sec_it;
+    }
+  }
+  return secs;
+}
+
+static Sections resolved_sections(std::vector<struct Normal_section> matches)
+{
+  resolve_sections(matches);
+  Sections secs;
+  for (const auto& sec : matches)
+    secs.emplace(sec.start, std::make_pair(sec.id, sec.end));
+  return secs;
+}
+
+TEST(test_basic_normaliztion, test_resolve_sections)
+{
+  // Every set of up to three matches on a line of six characters.
+  std::vector<struct Normal_section> all;
+  for (size_t end = 1; end <= 6; ++end)
+    for (size_t start = 0; start < end; ++start)
+      for (int id = 1; id <= 3; ++id)
+        all.push_back(Normal_section{start, end, id});
+  size_t checked = 0;
+  for (size_t i = 0; i < all.size(); ++i) {
+    for (size_t j = i; j < all.size(); ++j) {
+      for (size_t k = j; k < all.size(); ++k) {
+        std::vector<struct Normal_section> matches = {all[i]};
+        if (j > i)
+          matches.push_back(all[j]);
+        if (k > j)
+          matches.push_back(all[k]);
+        ASSERT_EQ(resolved_sections(matches), reference_sections(matches));
+        ++checked;
+      }
+    }
+  }
+  EXPECT_GT(checked, 40000);
+
+  // Many matches per line, in random order.
+  std::mt19937 rng(7);
+  for (int line = 0; line < 2000; ++line) {
+    std::vector<struct Normal_section> matches(rng() % 60);
+    for (auto& m : matches) {
+      m.start = rng() % 40;
+      m.end = m.start + 1 + rng() % 12;
+      m.id = static_cast<int>(1 + rng() % 8);
+    }
+    ASSERT_EQ(resolved_sections(matches), reference_sections(matches));
+  }
+}
+
 TEST(test_basic_normaliztion, test_sections2)
 {
   std::string my_log_file = "my_test.log";
@@ -112,6 +244,1277 @@ TEST(test_basic_normalization, test_non_ascii)
   }
 }
 
+/*!
+ * \brief A stream buffer that cannot seek, like a pipe.
+ */
+class Pipe_buf : public std::stringbuf {
+public:
+  explicit Pipe_buf(const std::string& s) : std::stringbuf(s) {}
+
+protected:
+  pos_type seekoff(off_type, std::ios_base::seekdir,
+                   std::ios_base::openmode) override
+  {
+    return pos_type(off_type(-1));
+  }
+  pos_type seekpos(pos_type, std::ios_base::openmode) override
+  {
+    return pos_type(off_type(-1));
+  }
+};
+
+/*!
+ * \brief Creates the named pipe fifo and writes contents into it on a
+ *        thread of its own, which is returned.
+ */
+static std::thread write_fifo(const std::string& fifo,
+                              const std::string& contents)
+{
+  remove(fifo.c_str());
+  EXPECT_EQ(mkfifo(fifo.c_str(), 0600), 0);
+  return std::thread([fifo, contents] {
+    std::ofstream out(fifo, std::ios_base::binary);
+    out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+  });
+}
+
+TEST(test_basic_normalization, test_forward_only)
+{
+  std::string my_log_file = "my_pipe_test.log";
+  size_t total_lines = 60000;
+  build_log_file(my_log_file, total_lines);
+  std::ifstream log_in(my_log_file);
+  std::string contents((std::istreambuf_iterator<char>(log_in)),
+                       std::istreambuf_iterator<char>());
+  remove(my_log_file.c_str());
+
+  std::istringstream seekable(contents);
+  Line_normalizer norm;
+  norm.set_input_stream(seekable);
+  Normal_list expected;
+  auto lines = norm.get_normalized_block();
+  size_t blocks = 0;
+  while (!lines.empty()) {
+    expected.insert(expected.end(), lines.begin(), lines.end());
+    ++blocks;
+    lines = norm.get_normalized_block();
+  }
+  EXPECT_GT(blocks, 1);
+  EXPECT_EQ(expected.size(), total_lines);
+
+  Pipe_buf pipe(contents);
+  std::istream pipe_in(&pipe);
+  norm.set_input_stream(pipe_in);
+  Normal_list piped;
+  lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    piped.insert(piped.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+  EXPECT_EQ(piped, expected);
+
+  Pipe_buf pipe_ahead(contents);
+  std::istream pipe_ahead_in(&pipe_ahead);
+  norm.set_read_ahead(3);
+  norm.set_input_stream(pipe_ahead_in);
+  Normal_list read_ahead;
+  lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    read_ahead.insert(read_ahead.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+  EXPECT_EQ(read_ahead, expected);
+  EXPECT_TRUE(norm.get_normalized_block().empty());
+
+  // A named pipe is read by name from its first byte.
+  std::string my_fifo = "my_pipe_test.fifo";
+  auto writer = write_fifo(my_fifo, contents);
+  norm.set_read_ahead(0);
+  norm.set_input_stream(my_fifo);
+  Normal_list fifo_lines;
+  lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    fifo_lines.insert(fifo_lines.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+  writer.join();
+  remove(my_fifo.c_str());
+  EXPECT_EQ(fifo_lines, expected);
+}
+
+TEST(test_basic_normalization, test_unterminated_and_long_lines)
+{
+  std::string long_line(blocksize + blocksize / 2, 'x');
+  std::string my_input = "first 1234\n" + long_line + "\nlast 567";
+  Line_normalizer norm;
+  Pipe_buf pipe(my_input);
+  std::istream pipe_in(&pipe);
+  norm.set_input_stream(pipe_in);
+  std::vector<std::string> texts;
+  auto lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    for (const auto& l : lines)
+      texts.push_back(l.line);
+    if (lines.back().line == "last 567") {
+      ASSERT_EQ(lines.back().sections.size(), 2);
+      EXPECT_EQ(lines.back().sections.rbegin()->second.first, 7);
+    }
+    lines = norm.get_normalized_block();
+  }
+  ASSERT_EQ(texts.size(), 3);
+  EXPECT_EQ(texts[0], "first 1234\n");
+  EXPECT_EQ(texts[1], long_line + "\n");
+  EXPECT_EQ(texts[2], "last 567");
+
+  std::string my_log_file = "my_long_line_test.log";
+  {
+    std::ofstream out(my_log_file);
+    out << my_input;
+  }
+  ASSERT_TRUE(norm.map_input_file(my_log_file));
+  texts.clear();
+  auto views = norm.get_normalized_view_block();
+  while (!views.empty()) {
+    for (const auto& v : views)
+      texts.emplace_back(v.line);
+    views = norm.get_normalized_view_block();
+  }
+  remove(my_log_file.c_str());
+  ASSERT_EQ(texts.size(), 3);
+  EXPECT_EQ(texts[1], long_line + "\n");
+  EXPECT_EQ(texts[2], "last 567");
+}
+
+#ifdef HAVE_ZLIB
+static void write_gzip(const std::string& fname, const std::string& contents)
+{
+  // Two members, as produced by concatenating .gz files.
+  size_t half = contents.size() / 2;
+  for (size_t begin : {size_t(0), half}) {
+    gzFile gz = gzopen(fname.c_str(), begin == 0 ? "wb" : "ab");
+    ASSERT_NE(gz, nullptr);
+    size_t end = begin == 0 ? half : contents.size();
+    gzwrite(gz, contents.data() + begin, static_cast<unsigned>(end - begin));
+    gzclose(gz);
+  }
+}
+
+TEST(test_basic_normalization, test_gzip_input)
+{
+  std::string my_log_file = "my_gzip_test.log";
+  size_t total_lines = 30000;
+  build_log_file(my_log_file, total_lines);
+  std::ifstream log_in(my_log_file);
+  std::string contents((std::istreambuf_iterator<char>(log_in)),
+                       std::istreambuf_iterator<char>());
+  remove(my_log_file.c_str());
+  EXPECT_EQ(detect_compression(contents.data(), contents.size()),
+            Compression::none);
+
+  std::istringstream plain(contents);
+  Line_normalizer norm;
+  norm.set_input_stream(plain);
+  Normal_list expected;
+  auto lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    expected.insert(expected.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+  ASSERT_EQ(expected.size(), total_lines);
+
+  std::string my_gz_file = my_log_file + ".gz";
+  write_gzip(my_gz_file, contents);
+  ASSERT_TRUE(compression_supported(Compression::gzip));
+  norm.set_input_stream(my_gz_file);
+  Normal_list decompressed;
+  lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    decompressed.insert(decompressed.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+  EXPECT_EQ(decompressed, expected);
+
+  // A compressed file cannot be mapped and is read as a stream instead.
+  ASSERT_TRUE(norm.map_input_file(my_gz_file));
+  size_t views = 0;
+  auto view_lines = norm.get_normalized_view_block();
+  while (!view_lines.empty()) {
+    views += view_lines.size();
+    view_lines = norm.get_normalized_view_block();
+  }
+  EXPECT_EQ(views, total_lines);
+
+  std::ifstream gz_in(my_gz_file, std::ios_base::binary);
+  std::string compressed((std::istreambuf_iterator<char>(gz_in)),
+                         std::istreambuf_iterator<char>());
+  EXPECT_EQ(detect_compression(compressed.data(), compressed.size()),
+            Compression::gzip);
+
+  // The format of a named pipe is detected without seeking back.
+  std::string my_fifo = my_gz_file + ".fifo";
+  auto writer = write_fifo(my_fifo, compressed);
+  norm.set_input_stream(my_fifo);
+  Normal_list piped;
+  lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    piped.insert(piped.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+  writer.join();
+  remove(my_fifo.c_str());
+  EXPECT_EQ(piped, expected);
+
+  // A truncated file returns what comes before the damage, then raises
+  // the error once in place of the end of the input.
+  {
+    std::ofstream out(my_gz_file, std::ios_base::binary);
+    out.write(compressed.data(),
+              static_cast<std::streamsize>(compressed.size() / 4));
+  }
+  norm.set_input_stream(my_gz_file);
+  size_t truncated = 0;
+  std::string error;
+  try {
+    lines = norm.get_normalized_block();
+    while (!lines.empty()) {
+      truncated += lines.size();
+      lines = norm.get_normalized_block();
+    }
+  } catch (const std::runtime_error& e) {
+    error = e.what();
+  }
+  EXPECT_EQ(error, "truncated compressed input");
+  EXPECT_GT(truncated, 0);
+  EXPECT_LT(truncated, total_lines);
+  EXPECT_TRUE(norm.get_normalized_block().empty());
+
+  Parallel_normalizer par_norm(2);
+  par_norm.set_input_files({my_gz_file});
+  Normal_list par_lines;
+  size_t par_truncated = 0;
+  EXPECT_THROW(
+      {
+        while (par_norm.get_normalized_block(par_lines))
+          par_truncated += par_lines.size();
+      },
+      std::runtime_error);
+  EXPECT_EQ(par_truncated, truncated);
+  EXPECT_FALSE(par_norm.get_normalized_block(par_lines));
+  remove(my_gz_file.c_str());
+}
+#endif
+
+TEST(test_basic_normalization, test_batch_update)
+{
+  std::string my_line = "abc 1234 def\n";
+  Line_normalizer norm;
+  norm.begin_normal_types_update();
+  norm.modify_current_normal_types(7, Normal_type(R"(\d{2,})", 0u, "<DEC>"));
+  norm.modify_current_normal_types(9, Normal_type(R"(abc)", 0u, "<ABC>"));
+  EXPECT_TRUE(norm.commit_normal_types_update());
+  std::istringstream in(my_line);
+  norm.set_input_stream(in);
+  auto lines = norm.get_normalized_block();
+  ASSERT_EQ(lines.size(), 1);
+  ASSERT_FALSE(lines.front().sections.empty());
+  EXPECT_EQ(lines.front().sections.begin()->first, 0);
+  EXPECT_EQ(lines.front().sections.begin()->second.first, 9);
+  EXPECT_EQ(lines.front().sections.begin()->second.second, 3);
+}
+
+TEST(test_basic_normalization, test_greedy_extend)
+{
+  std::string my_lines =
+      "12/31/1999 12:59:59 an ip 4.56.789.0 a;base64,0A1B a hex \\x0b and a "
+      "vn v1.2_3 a num 123 lala\n"
+      "lala ησε lala ×ÀÃæ 1234 πεμας lala deadbeef... ññ !!\r\n"
+      "x\n"
+      "\n"
+      "last line without an end 98765";
+  Line_normalizer leftmost;
+  std::istringstream in(my_lines);
+  leftmost.set_input_stream(in);
+  auto expected = leftmost.get_normalized_block();
+  ASSERT_EQ(expected.size(), 5);
+
+  Line_normalizer norm;
+  norm.begin_normal_types_update();
+  for (size_t id : {4, 7, 8}) {
+    auto nt = norm.get_current_normal_types().at(id);
+    norm.modify_current_normal_types(
+        id, Normal_type(nt.regex, nt.flags, nt.replacement,
+                        Match_mode::greedy_extend));
+  }
+  EXPECT_TRUE(norm.commit_normal_types_update());
+  EXPECT_EQ(norm.get_current_normal_types().at(8).mode,
+            Match_mode::greedy_extend);
+  std::istringstream greedy_in(my_lines);
+  norm.set_input_stream(greedy_in);
+  auto lines = norm.get_normalized_block();
+  EXPECT_EQ(lines, expected);
+
+  // A run at the start of a line is found even though the line end before
+  // it is \W as well.
+  std::istringstream leading("a\n-- b\n");
+  norm.set_input_stream(leading);
+  lines = norm.get_normalized_block();
+  ASSERT_EQ(lines.size(), 2);
+  Sections secs = {{0, {8, 3}}};
+  EXPECT_EQ(lines[1].sections, secs);
+
+  std::istringstream xyz("ab XyZ12 [xyz] zz\n");
+  norm.modify_current_normal_types(
+      9, Normal_type(R"([x-z\d]{3,})", HS_FLAG_CASELESS, "<XYZ>",
+                     Match_mode::greedy_extend));
+  norm.set_input_stream(xyz);
+  lines = norm.get_normalized_block();
+  ASSERT_EQ(lines.size(), 1);
+  ASSERT_EQ(lines[0].sections.count(3), 1);
+  EXPECT_EQ(lines[0].sections.at(3), std::make_pair(9, size_t(8)));
+  ASSERT_EQ(lines[0].sections.count(10), 1);
+  EXPECT_EQ(lines[0].sections.at(10), std::make_pair(9, size_t(13)));
+  EXPECT_EQ(lines[0].sections.count(15), 0);
+
+  // Only runs of one character class can be grown.
+  norm.begin_normal_types_update();
+  norm.modify_current_normal_types(
+      9, Normal_type(R"(ab+)", 0u, "<AB>", Match_mode::greedy_extend));
+  EXPECT_FALSE(norm.commit_normal_types_update());
+}
+
+TEST(test_basic_normalization, test_database_cache)
+{
+  std::string my_line = "12/31/1999 12:59:59 an ip 4.56.789.0 lala\n";
+  std::string cache_dir = "my_test_db_cache";
+  Line_normalizer norm;
+  ASSERT_TRUE(norm.set_database_cache(cache_dir));
+  char hash[17];
+  std::snprintf(hash, sizeof(hash), "%016llx",
+                static_cast<unsigned long long>(norm.normal_types_hash()));
+  std::string cache_file = norm.database_cache_file();
+  EXPECT_EQ(cache_file.find(cache_dir + "/" + hash + "-"), 0);
+  std::ifstream cached(cache_file);
+  EXPECT_TRUE(cached.good());
+
+  Line_normalizer cached_norm;
+  ASSERT_TRUE(cached_norm.set_database_cache(cache_dir));
+  EXPECT_EQ(cached_norm.normal_types_hash(), norm.normal_types_hash());
+  std::istringstream in(my_line);
+  norm.set_input_stream(in);
+  std::istringstream cached_in(my_line);
+  cached_norm.set_input_stream(cached_in);
+  auto lines = norm.get_normalized_block();
+  auto cached_lines = cached_norm.get_normalized_block();
+  EXPECT_FALSE(lines.empty());
+  EXPECT_EQ(lines, cached_lines);
+
+  cached_norm.modify_current_normal_types(9,
+                                          Normal_type("lala", 0u, "<LA>"));
+  EXPECT_NE(cached_norm.normal_types_hash(), norm.normal_types_hash());
+  remove(cache_file.c_str());
+  remove(cached_norm.database_cache_file().c_str());
+  remove(cache_dir.c_str());
+}
+
+TEST(test_basic_normalization, test_required_literal)
+{
+  std::string my_lines = "12/31/1999 12:59:59 an ip 4.56.789.0 lala\n"
+                         "no time here, only a date jan 12 1999\n"
+                         "nothing at all\n"
+                         "x 1.2.3.4\r\n"
+                         "dec 31 23:59:59 host 10.0.0.1/24";
+  Line_normalizer norm;
+  std::istringstream in(my_lines);
+  norm.set_input_stream(in);
+  auto expected = norm.get_normalized_block();
+  ASSERT_EQ(expected.size(), 5);
+
+  // Every timestamp with a time holds a colon, and every IP address a dot.
+  std::string cache_dir = "my_test_literal_cache";
+  Line_normalizer filtered;
+  ASSERT_TRUE(filtered.set_database_cache(cache_dir));
+  auto default_cache_file = filtered.database_cache_file();
+  filtered.begin_normal_types_update();
+  for (auto literal : {std::make_pair(1, ":"), std::make_pair(2, ".")}) {
+    auto nt = filtered.get_current_normal_types().at(literal.first);
+    filtered.modify_current_normal_types(
+        literal.first, Normal_type(nt.regex, nt.flags, nt.replacement,
+                                   Match_mode::leftmost, literal.second));
+  }
+  ASSERT_TRUE(filtered.commit_normal_types_update());
+  EXPECT_EQ(filtered.get_current_normal_types().at(1).required_literal, ":");
+  std::istringstream filtered_in(my_lines);
+  filtered.set_input_stream(filtered_in);
+  auto lines = filtered.get_normalized_block();
+  ASSERT_EQ(lines.size(), 5);
+  for (size_t i = 0; i < lines.size(); ++i) {
+    if (i != 1) {
+      EXPECT_EQ(lines[i], expected[i]);
+    }
+  }
+  // The date without a time is no longer a timestamp.
+  EXPECT_EQ(expected[1].sections.rbegin()->second.first, 1);
+  EXPECT_NE(lines[1].sections.rbegin()->second.first, 1);
+
+  // Both databases are loaded from the cache.
+  Line_normalizer cached;
+  cached.begin_normal_types_update();
+  for (const auto& nt : filtered.get_current_normal_types())
+    cached.modify_current_normal_types(nt.first, nt.second);
+  cached.commit_normal_types_update();
+  ASSERT_TRUE(cached.set_database_cache(cache_dir));
+  std::istringstream cached_in(my_lines);
+  cached.set_input_stream(cached_in);
+  EXPECT_EQ(cached.get_normalized_block(), lines);
+  remove(cached.database_cache_file().c_str());
+  remove(default_cache_file.c_str());
+  remove(cache_dir.c_str());
+
+  // Lines are split by the line end type when it is not a newline.
+  Line_normalizer semicolons;
+  semicolons.modify_current_normal_types(
+      Line_normalizer::line_end_id, Normal_type(R"(;)", 0u, "<SC>"));
+  std::istringstream semicolon_in("a 12:00:00 b;c 1.2.3.4\n;");
+  semicolons.set_input_stream(semicolon_in);
+  lines = semicolons.get_normalized_block();
+  ASSERT_EQ(lines.size(), 2);
+  EXPECT_EQ(lines[1].line, "c 1.2.3.4\n;");
+}
+
+TEST(test_basic_normalization, test_mapped_views)
+{
+  std::string my_log_file = "my_mapped_test.log";
+  size_t total_lines = 10000;
+  build_log_file(my_log_file, total_lines);
+  Line_normalizer norm;
+  norm.set_input_stream(my_log_file);
+  Normal_list expected;
+  auto lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    expected.insert(expected.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+
+  Line_normalizer mapped_norm;
+  ASSERT_TRUE(mapped_norm.map_input_file(my_log_file));
+  auto expected_it = expected.begin();
+  auto views = mapped_norm.get_normalized_view_block();
+  while (!views.empty()) {
+    for (const auto& view : views) {
+      ASSERT_NE(expected_it, expected.end());
+      EXPECT_EQ(view.line, expected_it->line);
+      EXPECT_EQ(view.sections.to_sections(), expected_it->sections);
+      ++expected_it;
+    }
+    views = mapped_norm.get_normalized_view_block();
+  }
+  EXPECT_EQ(expected_it, expected.end());
+
+  Parallel_normalizer par_norm(2);
+  ASSERT_TRUE(par_norm.map_input_file(my_log_file));
+  Normal_list parallel;
+  lines = par_norm.get_normalized_block();
+  while (!lines.empty()) {
+    parallel.insert(parallel.end(), lines.begin(), lines.end());
+    lines = par_norm.get_normalized_block();
+  }
+  EXPECT_EQ(parallel, expected);
+  remove(my_log_file.c_str());
+
+  EXPECT_FALSE(mapped_norm.map_input_file("no_such_file.log"));
+  EXPECT_TRUE(mapped_norm.get_normalized_view_block().empty());
+}
+
+TEST(test_basic_normalization, test_columns)
+{
+  std::string my_log_file = "my_columns_test.log";
+  size_t total_lines = 10000;
+  build_log_file(my_log_file, total_lines);
+  Line_normalizer norm;
+  norm.set_input_stream(my_log_file);
+  Normal_list expected;
+  auto lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    expected.insert(expected.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+
+  Line_normalizer col_norm;
+  col_norm.set_input_stream(my_log_file);
+  Normal_block columns;
+  auto expected_it = expected.begin();
+  while (col_norm.get_normalized_block(columns)) {
+    ASSERT_EQ(columns.line_offsets.size(), columns.size() + 1);
+    ASSERT_EQ(columns.section_offsets.size(), columns.size() + 1);
+    ASSERT_EQ(columns.section_starts.size(), columns.section_ends.size());
+    ASSERT_EQ(columns.section_starts.size(), columns.section_ids.size());
+    EXPECT_EQ(columns.line_offsets.back(), columns.data.size());
+    for (size_t i = 0; i < columns.size(); ++i, ++expected_it) {
+      ASSERT_NE(expected_it, expected.end());
+      EXPECT_EQ(columns.line(i), expected_it->line);
+      Sections secs;
+      for (size_t s = columns.section_offsets[i];
+           s < columns.section_offsets[i + 1]; ++s) {
+        secs[columns.section_starts[s]] =
+            std::make_pair(columns.section_ids[s], columns.section_ends[s]);
+      }
+      EXPECT_EQ(secs, expected_it->sections);
+    }
+  }
+  EXPECT_EQ(expected_it, expected.end());
+  EXPECT_TRUE(columns.empty());
+  remove(my_log_file.c_str());
+}
+
+TEST(test_basic_normalization, test_recycled_lines)
+{
+  std::string my_log_file = "my_recycled_test.log";
+  size_t total_lines = 60000;
+  build_log_file(my_log_file, total_lines);
+  Line_normalizer norm;
+  norm.set_input_stream(my_log_file);
+  Normal_list expected;
+  auto lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    expected.insert(expected.end(), lines.begin(), lines.end());
+    lines = norm.get_normalized_block();
+  }
+
+  Normal_list recycled;
+  Normal_list block;
+  size_t blocks = 0;
+  norm.set_input_stream(my_log_file);
+  while (norm.get_normalized_block(block)) {
+    recycled.insert(recycled.end(), block.begin(), block.end());
+    ++blocks;
+  }
+  EXPECT_GT(blocks, 1);
+  EXPECT_TRUE(block.empty());
+  EXPECT_EQ(recycled, expected);
+
+  Parallel_normalizer par_norm(4);
+  par_norm.set_input_stream(my_log_file);
+  recycled.clear();
+  while (par_norm.get_normalized_block(block))
+    recycled.insert(recycled.end(), block.begin(), block.end());
+  EXPECT_EQ(recycled, expected);
+  remove(my_log_file.c_str());
+
+  // A line handed back is reused by the same line of the next block.
+  std::istringstream first("a line long enough to be on the heap 1234\n");
+  norm.set_input_stream(first);
+  ASSERT_TRUE(norm.get_normalized_block(block));
+  const char* data = block[0].line.data();
+  std::istringstream second("another line, shorter than the first 99\n");
+  norm.set_input_stream(second);
+  ASSERT_TRUE(norm.get_normalized_block(block));
+  EXPECT_EQ(block[0].line, "another line, shorter than the first 99\n");
+  EXPECT_EQ(block[0].line.data(), data);
+  EXPECT_EQ(block[0].sections.begin()->second.first, 8);
+}
+
+TEST(test_basic_normalization, test_messages)
+{
+  std::vector<std::string> texts = {"12/31/1999 12:59:59 ip 4.56.789.0",
+                                    "", "two\nlines 1234\n", "x y"};
+  std::vector<std::string_view> messages(texts.begin(), texts.end());
+  Line_normalizer norm;
+  std::vector<size_t> message_lines;
+  const auto& views = norm.normalize_messages(messages, message_lines);
+  ASSERT_EQ(message_lines, std::vector<size_t>({0, 1, 1, 3, 4}));
+  ASSERT_EQ(views.size(), 4);
+
+  // The views point into the messages, and every message is normalized as
+  // if it were an input of its own.
+  Normal_list expected;
+  for (const auto& text : texts) {
+    std::istringstream in(text);
+    norm.set_input_stream(in);
+    auto lines = norm.get_normalized_block();
+    expected.insert(expected.end(), lines.begin(), lines.end());
+  }
+  ASSERT_EQ(expected.size(), 4);
+  EXPECT_EQ(views[0].line.data(), texts[0].data());
+  EXPECT_EQ(views[2].line.data(), texts[2].data() + 4);
+  Normal_block columns;
+  norm.normalize_messages(messages, columns, message_lines);
+  ASSERT_EQ(message_lines, std::vector<size_t>({0, 1, 1, 3, 4}));
+  ASSERT_EQ(columns.size(), 4);
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(columns.line(i), expected[i].line);
+    Sections secs;
+    for (size_t s = columns.section_offsets[i];
+         s < columns.section_offsets[i + 1]; ++s) {
+      secs[columns.section_starts[s]] =
+          std::make_pair(columns.section_ids[s], columns.section_ends[s]);
+    }
+    EXPECT_EQ(secs, expected[i].sections);
+  }
+  const auto& again = norm.normalize_messages(messages, message_lines);
+  ASSERT_EQ(again.size(), 4);
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(again[i].line, expected[i].line);
+    EXPECT_EQ(again[i].sections.to_sections(), expected[i].sections);
+  }
+}
+
+TEST(test_basic_normalization, test_pattern_update)
+{
+  Line_normalizer norm;
+  auto first = norm.get_pattern_set();
+  ASSERT_TRUE(first);
+  std::vector<std::string_view> messages = {"abc 1234 def\n"};
+  std::vector<size_t> message_lines;
+  norm.normalize_messages(messages, message_lines);
+  EXPECT_EQ(norm.get_block_pattern_version(), first->version);
+
+  auto types = norm.get_current_normal_types();
+  types[9] = Normal_type(R"(abc)", 0u, "<ABC>");
+  std::thread updater(
+      [&norm, &types] { EXPECT_TRUE(norm.update_normal_types(types)); });
+  updater.join();
+  auto second = norm.get_pattern_set();
+  EXPECT_GT(second->version, first->version);
+  // The normalizer takes the new set at the start of its next block.
+  EXPECT_EQ(norm.get_current_normal_types().count(9), 0);
+  const auto& lines = norm.normalize_messages(messages, message_lines);
+  EXPECT_EQ(norm.get_block_pattern_version(), second->version);
+  EXPECT_EQ(norm.get_current_normal_types().count(9), 1);
+  ASSERT_EQ(lines.size(), 1);
+  EXPECT_EQ(lines[0].sections[0].id, 9);
+  EXPECT_EQ(first->normal_types.count(9), 0);
+
+  // Types that do not compile are not published.
+  types[10] = Normal_type(R"(()", 0u, "<BAD>");
+  EXPECT_FALSE(norm.update_normal_types(types));
+  EXPECT_EQ(norm.get_pattern_set(), second);
+}
+
+TEST(test_basic_normalization, test_line_cache)
+{
+  std::string my_lines;
+  for (size_t i = 0; i < 300; ++i) {
+    my_lines += "heartbeat from 10.0.0.1 ok\n";
+    my_lines += "GET /health 200 0x1f2e\n";
+    my_lines += "request " + std::to_string(i * 7919) + " done.\n";
+  }
+  my_lines += "last line 12/31/1999 12:59:59";
+  Line_normalizer norm;
+  std::istringstream in(my_lines);
+  norm.set_input_stream(in);
+  auto expected = norm.get_normalized_block();
+
+  Line_normalizer cached;
+  cached.set_line_cache(1 << 20);
+  cached.set_metrics(true);
+  std::istringstream cached_in(my_lines);
+  cached.set_input_stream(cached_in);
+  EXPECT_EQ(cached.get_normalized_block(), expected);
+  auto metrics = cached.get_metrics();
+  EXPECT_EQ(metrics.line_cache_hits, 2 * 299);
+  EXPECT_EQ(metrics.line_cache_misses, 300 + 2 + 1);
+  EXPECT_EQ(metrics.line_cache_too_large, 0);
+  EXPECT_EQ(metrics.lines, expected.size());
+  EXPECT_EQ(metrics.bytes, my_lines.size());
+  std::istringstream view_in(my_lines);
+  cached.set_input_stream(view_in);
+  const auto& views = cached.get_normalized_view_block();
+  ASSERT_EQ(views.size(), expected.size());
+  for (size_t i = 0; i < views.size(); ++i) {
+    EXPECT_EQ(views[i].line, expected[i].line);
+    EXPECT_EQ(views[i].sections.to_sections(), expected[i].sections);
+  }
+
+  // New Normal_types empty the cache.
+  auto types = cached.get_current_normal_types();
+  types[9] = Normal_type(R"(heartbeat)", 0u, "<HB>");
+  ASSERT_TRUE(cached.update_normal_types(types));
+  std::istringstream updated_in(my_lines);
+  cached.set_input_stream(updated_in);
+  const auto& lines = cached.get_normalized_block();
+  ASSERT_EQ(lines.size(), expected.size());
+  EXPECT_EQ(lines[0].sections.begin()->second.first, 9);
+
+  Parallel_normalizer par_norm(2);
+  par_norm.set_line_cache(1 << 20);
+  std::istringstream par_in(my_lines);
+  par_norm.set_input_stream(par_in);
+  Normal_block columns;
+  ASSERT_TRUE(par_norm.get_normalized_block(columns));
+  ASSERT_EQ(columns.size(), expected.size());
+  EXPECT_EQ(columns.line(3), expected[3].line);
+  EXPECT_EQ(columns.section_offsets[4] - columns.section_offsets[3],
+            expected[3].sections.size());
+
+  // Lines too large for a small cache are counted apart from misses.
+  Line_normalizer small;
+  small.set_line_cache(1024);
+  small.set_metrics(true);
+  std::string long_line(200, 'x');
+  std::istringstream small_in(long_line + "\n" + long_line + "\nok\nok\n");
+  small.set_input_stream(small_in);
+  EXPECT_EQ(small.get_normalized_block().size(), 4);
+  metrics = small.get_metrics();
+  EXPECT_EQ(metrics.line_cache_too_large, 2);
+  EXPECT_EQ(metrics.line_cache_misses, 1);
+  EXPECT_EQ(metrics.line_cache_hits, 1);
+
+  // Lines are evicted to stay within the capacity, and lines hit since the
+  // clock hand last passed are kept.
+  Line_cache cache(4096);
+  std::vector<Normal_section> secs = {Normal_section{0, 3, 7}};
+  cache.insert("kept\n", 1, secs);
+  size_t evicted = 0;
+  for (uint64_t i = 2; i < 200; ++i) {
+    std::string line = "line " + std::to_string(i) + "\n";
+    evicted += cache.insert(line, i, secs);
+    ASSERT_NE(cache.find("kept\n", 1), nullptr);
+    EXPECT_LE(cache.memory(), 4096);
+  }
+  EXPECT_GT(evicted, 0);
+  EXPECT_EQ(cache.find("line 2\n", 2), nullptr);
+  ASSERT_NE(cache.find("line 199\n", 199), nullptr);
+  EXPECT_EQ(*cache.find("line 199\n", 199), secs);
+  EXPECT_EQ(cache.find("other\n", 199), nullptr);
+  cache.set_pattern_version(2);
+  EXPECT_EQ(cache.size(), 0);
+}
+
+TEST(test_basic_normalization, test_line_cache_boundaries)
+{
+  // Runs of non-word characters and numbers that continue across line
+  // ends, so matches start in the line before the one they end in.
+  std::string my_lines;
+  for (size_t i = 0; i < 50; ++i) {
+    my_lines += "ok...\n";
+    my_lines += "--> retry 12.\n";
+    my_lines += "34.56 ms\n";
+    my_lines += "#### " + std::to_string(i % 3) + "\n";
+  }
+  Line_normalizer norm;
+  std::istringstream in(my_lines);
+  norm.set_input_stream(in);
+  auto expected = norm.get_normalized_block();
+
+  Line_normalizer cached;
+  cached.set_line_cache(1 << 20);
+  cached.set_metrics(true);
+  std::istringstream cached_in(my_lines);
+  cached.set_input_stream(cached_in);
+  EXPECT_EQ(cached.get_normalized_block(), expected);
+  EXPECT_GT(cached.get_metrics().line_cache_hits, 0);
+
+  Parallel_normalizer par_norm(2);
+  par_norm.set_line_cache(1 << 20);
+  std::istringstream par_in(my_lines);
+  par_norm.set_input_stream(par_in);
+  Normal_list par_lines;
+  ASSERT_TRUE(par_norm.get_normalized_block(par_lines));
+  EXPECT_EQ(par_lines, expected);
+}
+
+TEST(test_basic_normalization, test_normal_file)
+{
+  std::string my_lines = "10.0.0.1 - GET /a 200\n"
+                         "no numbers here\n"
+                         "\n"
+                         "at 12/31/1999 12:59:59 from 0x1f2e\n";
+  std::string my_file = "my_test_normal_file.bin";
+  Line_normalizer norm;
+  Normal_file_writer writer;
+  ASSERT_TRUE(writer.open(my_file, norm.normal_types_hash()));
+  std::vector<Normal_list> expected;
+  for (size_t i = 0; i < 2; ++i) {
+    std::istringstream in(my_lines + std::to_string(i));
+    norm.set_input_stream(in);
+    expected.push_back(norm.get_normalized_block());
+    std::istringstream block_in(my_lines + std::to_string(i));
+    norm.set_input_stream(block_in);
+    Normal_block columns;
+    ASSERT_TRUE(norm.get_normalized_block(columns));
+    ASSERT_TRUE(writer.write_block(columns));
+  }
+  ASSERT_TRUE(writer.close());
+
+  Normal_file_reader reader;
+  ASSERT_TRUE(reader.open(my_file));
+  EXPECT_EQ(reader.normal_types_hash(), norm.normal_types_hash());
+  for (const auto& lines : expected) {
+    const auto& views = reader.read_view_block();
+    ASSERT_EQ(views.size(), lines.size());
+    for (size_t i = 0; i < views.size(); ++i) {
+      EXPECT_EQ(views[i].line, lines[i].line);
+      EXPECT_EQ(views[i].sections.to_sections(), lines[i].sections);
+    }
+  }
+  EXPECT_TRUE(reader.read_view_block().empty());
+  reader.rewind();
+  Normal_block columns;
+  ASSERT_TRUE(reader.read_block(columns));
+  ASSERT_EQ(columns.size(), expected[0].size());
+  EXPECT_EQ(columns.line(3), expected[0][3].line);
+  EXPECT_EQ(columns.section_offsets[4] - columns.section_offsets[3],
+            expected[0][3].sections.size());
+  ASSERT_TRUE(reader.read_block(columns));
+  EXPECT_FALSE(reader.read_block(columns));
+
+  // A block cut short is not returned, and the blocks before it are.
+  std::ifstream in(my_file, std::ios_base::binary);
+  std::string bytes((std::istreambuf_iterator<char>(in)),
+                    std::istreambuf_iterator<char>());
+  in.close();
+  std::ofstream(my_file, std::ios_base::binary)
+      << bytes.substr(0, bytes.size() - 1);
+  ASSERT_TRUE(reader.open(my_file));
+  EXPECT_EQ(reader.read_view_block().size(), expected[0].size());
+  EXPECT_TRUE(reader.read_view_block().empty());
+  std::ofstream(my_file, std::ios_base::binary) << "NRMZ" << bytes.substr(4);
+  ASSERT_TRUE(reader.open(my_file));
+  std::ofstream(my_file, std::ios_base::binary) << "XRMZ" << bytes.substr(4);
+  EXPECT_FALSE(reader.open(my_file));
+
+  // Blocks with sections outside their line or with ids that are not an
+  // int are rejected.
+  const std::vector<Normal_section> corrupt = {
+      Normal_section{5, 6, 1}, Normal_section{2, 9, 1},
+      Normal_section{1, 2, -1}};
+  for (const auto& sec : corrupt) {
+    Normal_block block;
+    block.data = {'a', 'b', 'c', '\n'};
+    block.line_offsets = {0, 4};
+    block.section_offsets = {0, 1};
+    block.section_starts = {static_cast<uint32_t>(sec.start)};
+    block.section_ends = {static_cast<uint32_t>(sec.end)};
+    block.section_ids = {sec.id};
+    ASSERT_TRUE(writer.open(my_file, norm.normal_types_hash()));
+    ASSERT_TRUE(writer.write_block(block));
+    ASSERT_TRUE(writer.close());
+    ASSERT_TRUE(reader.open(my_file));
+    EXPECT_FALSE(reader.read_block(columns));
+    reader.rewind();
+    EXPECT_TRUE(reader.read_view_block().empty());
+  }
+
+  // Nested and overlapping sections round trip.
+  std::string nested = "abc1.2.33 x\n";
+  std::istringstream nested_in(nested);
+  norm.set_input_stream(nested_in);
+  auto nested_lines = norm.get_normalized_block();
+  ASSERT_EQ(nested_lines.size(), 1);
+  ASSERT_EQ(nested_lines[0].sections.size(), 5);
+  std::istringstream nested_block_in(nested);
+  norm.set_input_stream(nested_block_in);
+  ASSERT_TRUE(norm.get_normalized_block(columns));
+  ASSERT_TRUE(writer.open(my_file, norm.normal_types_hash()));
+  ASSERT_TRUE(writer.write_block(columns));
+  ASSERT_TRUE(writer.close());
+  ASSERT_TRUE(reader.open(my_file));
+  const auto& nested_views = reader.read_view_block();
+  ASSERT_EQ(nested_views.size(), 1);
+  EXPECT_EQ(nested_views[0].line, nested_lines[0].line);
+  EXPECT_EQ(nested_views[0].sections.to_sections(), nested_lines[0].sections);
+
+  // Sections that are not sorted by start are not written.
+  std::swap(columns.section_starts[0], columns.section_starts[1]);
+  std::swap(columns.section_ends[0], columns.section_ends[1]);
+  ASSERT_TRUE(writer.open(my_file, norm.normal_types_hash()));
+  EXPECT_FALSE(writer.write_block(columns));
+  ASSERT_TRUE(writer.close());
+  std::remove(my_file.c_str());
+}
+
+TEST(test_basic_normalization, test_value_decoders)
+{
+  EXPECT_EQ(decode_timestamp("12/31/1999 12:59:59"), 946645199);
+  EXPECT_EQ(decode_timestamp("1999-12-31 23:59:59"), 946684799);
+  EXPECT_EQ(decode_timestamp("31-Dec-1999 23:59:59"), 946684799);
+  EXPECT_EQ(decode_timestamp("December 31 1999 11:59:59 pm"), 946684799);
+  EXPECT_EQ(decode_timestamp("Jan  1 00:00:10"), 10);
+  EXPECT_EQ(decode_timestamp("2000-01-01 01:00:00 +0100"), 946684800);
+  EXPECT_EQ(decode_timestamp("2000-01-01 01:00:00 -01:30"), 946693800);
+  EXPECT_EQ(decode_timestamp("2000-02-30 01:00:00"), no_value);
+  EXPECT_EQ(decode_timestamp("1999-12-31 24:00:00"), no_value);
+  EXPECT_EQ(decode_ipv4("10.0.0.1"), 0x0a000001);
+  EXPECT_EQ(decode_ipv4("192.168-1.0/24"), 0x19c0a80100);
+  EXPECT_EQ(decode_ipv4("10.0.0.256"), no_value);
+  EXPECT_EQ(decode_decimal("1234567890123456"), 1234567890123456);
+  EXPECT_EQ(decode_decimal("-42"), -42);
+  EXPECT_EQ(decode_decimal("1234567x"), no_value);
+  EXPECT_EQ(decode_decimal("1234567890123456789"), no_value);
+  EXPECT_EQ(decode_hex("DEADbeef0001"), 0xdeadbeef0001);
+  EXPECT_EQ(decode_hex("0x1f"), 0x1f);
+  EXPECT_EQ(decode_hex("%2F"), 0x2f);
+  EXPECT_EQ(decode_hex("deadbeeg"), no_value);
+  EXPECT_EQ(decode_version("1.2.3"), 0x0001000200030000);
+  EXPECT_EQ(decode_version("10_0"), 0x000a000000000000);
+  EXPECT_EQ(decode_version("1.2.3.4.5"), no_value);
+
+  std::string my_lines = "at 12/31/1999 12:59:59 from 10.0.0.1 took 12 "
+                         "ms in v1.2.3 id abcdef\n";
+  Line_normalizer norm;
+  auto db = norm.get_pattern_set()->db;
+  auto types = norm.get_current_normal_types();
+  types[1].decoder = Value_decoder::timestamp;
+  types[2].decoder = Value_decoder::ipv4;
+  types[4].decoder = Value_decoder::hex;
+  types[5].decoder = Value_decoder::version;
+  types[7].decoder = Value_decoder::decimal;
+  ASSERT_TRUE(norm.update_normal_types(types));
+  // Decoders are not compiled, so the database is shared.
+  EXPECT_EQ(norm.get_pattern_set()->db, db);
+  std::istringstream in(my_lines + my_lines);
+  norm.set_input_stream(in);
+  Normal_block columns;
+  ASSERT_TRUE(norm.get_normalized_block(columns));
+  ASSERT_EQ(columns.section_values.size(), columns.section_ids.size());
+  std::map<int32_t, int64_t> values;
+  for (size_t s = columns.section_offsets[0]; s < columns.section_offsets[1];
+       ++s)
+    values[columns.section_ids[s]] = columns.section_values[s];
+  EXPECT_EQ(values[1], 946645199);
+  EXPECT_EQ(values[2], 0x0a000001);
+  EXPECT_EQ(values[4], 0xabcdef);
+  EXPECT_EQ(values[5], 0x0001000200030000);
+  EXPECT_EQ(values[7], 12);
+  EXPECT_EQ(values[8], no_value);
+
+  Parallel_normalizer par_norm(2);
+  ASSERT_TRUE(par_norm.update_normal_types(types));
+  std::istringstream par_in(my_lines);
+  par_norm.set_input_stream(par_in);
+  Normal_block par_columns;
+  ASSERT_TRUE(par_norm.get_normalized_block(par_columns));
+  columns.section_values.resize(columns.section_offsets[1]);
+  EXPECT_EQ(par_columns.section_values, columns.section_values);
+
+  // Without decoders, no values are stored.
+  Line_normalizer plain;
+  std::istringstream plain_in(my_lines);
+  plain.set_input_stream(plain_in);
+  ASSERT_TRUE(plain.get_normalized_block(columns));
+  EXPECT_TRUE(columns.section_values.empty());
+}
+
+TEST(test_basic_normalization, test_render)
+{
+  std::string my_line = "ip 10.0.0.1 at 12/31/1999 12:59:59 x\n";
+  Line_normalizer norm;
+  std::istringstream in(my_line + my_line);
+  norm.set_input_stream(in);
+  std::string text;
+  std::vector<size_t> offsets;
+  ASSERT_TRUE(norm.get_rendered_block(text, offsets));
+  std::string rendered = "ip<NW><IP><NW>at<NW><TS><NW>x\n";
+  EXPECT_EQ(text, rendered + rendered);
+  EXPECT_EQ(offsets, std::vector<size_t>({0, rendered.size(),
+                                          2 * rendered.size()}));
+  EXPECT_FALSE(norm.get_rendered_block(text, offsets));
+  EXPECT_TRUE(text.empty());
+
+  Line_renderer renderer(norm.get_current_normal_types());
+  renderer.set_policy(8, Render_policy::keep);
+  renderer.set_policy(1, Render_policy::drop);
+  std::istringstream in2(my_line);
+  norm.set_input_stream(in2);
+  auto lines = norm.get_normalized_block();
+  ASSERT_EQ(lines.size(), 1);
+  std::string line_text;
+  renderer.render_line(lines.front(), line_text);
+  EXPECT_EQ(line_text, "ip <IP> at  x\n");
+
+  std::istringstream in3(my_line);
+  norm.set_input_stream(in3);
+  Normal_block columns;
+  ASSERT_TRUE(norm.get_normalized_block(columns));
+  std::ostringstream out;
+  renderer.render_block(columns, out);
+  EXPECT_EQ(out.str(), line_text);
+
+  // Sections nested in one already rendered are dropped.
+  std::string nested_line = "abc1.2.33 x\n";
+  std::istringstream in4(nested_line);
+  norm.set_input_stream(in4);
+  lines = norm.get_normalized_block();
+  ASSERT_EQ(lines.size(), 1);
+  ASSERT_EQ(lines.front().sections.size(), 5);
+  EXPECT_EQ(lines.front().sections.at(4), std::make_pair(8, size_t{5}));
+  std::istringstream in5(nested_line);
+  norm.set_input_stream(in5);
+  ASSERT_TRUE(norm.get_rendered_block(text, offsets));
+  EXPECT_EQ(text, "abc<VN><NW>x\n");
+  line_text.clear();
+  renderer.render_line(lines.front(), line_text);
+  EXPECT_EQ(line_text, "abc<VN> x\n");
+}
+
+TEST(test_basic_normalization, test_statistics)
+{
+  std::string my_input = "a 10.0.0.1\na 10.0.0.2\nb 10.0.0.3\na 10.0.0.9";
+  std::istringstream in(my_input);
+  Line_normalizer norm;
+  norm.set_statistics(true);
+  norm.set_input_stream(in);
+  auto lines = norm.get_normalized_block();
+  ASSERT_EQ(lines.size(), 4);
+  EXPECT_EQ(lines[0].fingerprint, lines[1].fingerprint);
+  EXPECT_EQ(lines[0].fingerprint, lines[3].fingerprint);
+  EXPECT_NE(lines[0].fingerprint, lines[2].fingerprint);
+  auto stats = norm.get_block_statistics();
+  EXPECT_EQ(stats.lines, 4);
+  ASSERT_EQ(stats.templates.size(), 2);
+  EXPECT_EQ(stats.templates.at(lines[0].fingerprint), 3);
+  ASSERT_GT(stats.type_matches.size(), 2);
+  EXPECT_EQ(stats.type_matches[2], 4);
+  EXPECT_TRUE(norm.get_normalized_block().empty());
+  EXPECT_EQ(norm.get_block_statistics().lines, 0);
+  EXPECT_EQ(norm.get_run_statistics().lines, 4);
+
+  std::istringstream in_columns(my_input);
+  norm.set_input_stream(in_columns);
+  Normal_block columns;
+  ASSERT_TRUE(norm.get_normalized_block(columns));
+  ASSERT_EQ(columns.fingerprints.size(), 4);
+  EXPECT_EQ(columns.fingerprints[2], lines[2].fingerprint);
+  EXPECT_EQ(norm.get_run_statistics().lines, 8);
+  norm.reset_statistics();
+  EXPECT_EQ(norm.get_run_statistics().lines, 0);
+
+  norm.set_statistics(false);
+  std::istringstream in_off(my_input);
+  norm.set_input_stream(in_off);
+  EXPECT_EQ(norm.get_normalized_block().front().fingerprint, 0);
+  EXPECT_EQ(norm.get_run_statistics().lines, 0);
+
+  // Sections nested in an earlier one do not change the template.
+  norm.set_statistics(true);
+  std::istringstream in_nested("abc1.2.33 x\nabc4.5.66 x\nabc7 x\n");
+  norm.set_input_stream(in_nested);
+  const auto& nested = norm.get_normalized_block();
+  ASSERT_EQ(nested.size(), 3);
+  ASSERT_EQ(nested[0].sections.size(), 5);
+  EXPECT_EQ(nested[0].fingerprint, nested[1].fingerprint);
+  EXPECT_NE(nested[0].fingerprint, nested[2].fingerprint);
+  EXPECT_EQ(norm.get_block_statistics().templates.size(), 2);
+  norm.reset_statistics();
+
+  Parallel_normalizer par_norm(2);
+  par_norm.set_statistics(true);
+  std::istringstream in_parallel(my_input);
+  par_norm.set_input_stream(in_parallel);
+  EXPECT_EQ(par_norm.get_normalized_block().size(), 4);
+  EXPECT_EQ(par_norm.get_block_statistics().templates, stats.templates);
+  EXPECT_TRUE(par_norm.get_normalized_block().empty());
+  EXPECT_EQ(par_norm.get_run_statistics().lines, 4);
+}
+
+TEST(test_basic_normalization, test_metrics)
+{
+  std::string my_input = "a 10.0.0.1\nb 10.0.0.2 1234\nc";
+  std::istringstream in(my_input);
+  Line_normalizer norm;
+  norm.set_metrics(true);
+  norm.set_input_stream(in);
+  while (!norm.get_normalized_block().empty()) {
+  }
+  auto metrics = norm.get_metrics();
+  if (!metrics_compiled) {
+    EXPECT_EQ(metrics.lines, 0);
+    return;
+  }
+  EXPECT_EQ(metrics.bytes, my_input.size());
+  EXPECT_EQ(metrics.lines, 3);
+  EXPECT_EQ(metrics.calls(Phase::scan), 1);
+  EXPECT_EQ(metrics.calls(Phase::read), 2);
+  EXPECT_EQ(metrics.calls(Phase::resolve), 3);
+  EXPECT_EQ(metrics.calls(Phase::build_database), 0);
+  EXPECT_GT(metrics.seconds(Phase::scan), 0);
+  ASSERT_GT(metrics.type_matches.size(), 7);
+  EXPECT_EQ(metrics.type_matches[2], 2);
+  // Every match hyperscan reports is counted, including those removed by
+  // overlap resolution: the digits of the IPs and 1234 also match DEC.
+  EXPECT_EQ(metrics.type_matches[4], 1);
+  EXPECT_GT(metrics.type_matches[7], 1);
+
+  norm.reset_metrics();
+  norm.modify_current_normal_types(9, Normal_type(R"(abc)", 0u, "<ABC>"));
+  EXPECT_EQ(norm.get_metrics().calls(Phase::build_database), 1);
+
+  Parallel_normalizer par_norm(2);
+  par_norm.set_metrics(true);
+  std::istringstream in_parallel(my_input);
+  par_norm.set_input_stream(in_parallel);
+  while (!par_norm.get_normalized_block().empty()) {
+  }
+  auto par_metrics = par_norm.get_metrics();
+  EXPECT_EQ(par_metrics.lines, 3);
+  EXPECT_EQ(par_metrics.type_matches, metrics.type_matches);
+}
+
+TEST(test_parallel_normalization, test_parallel_order)
+{
+  std::string my_log_file = "my_parallel_test.log";
+  size_t total_lines = 60000;
+  build_log_file(my_log_file, total_lines);
+  Line_normalizer norm;
+  norm.set_input_stream(my_log_file);
+  Normal_list expected;
+  auto lines = norm.get_normalized_block();
+  size_t blocks = 0;
+  while (!lines.empty()) {
+    expected.insert(expected.end(), lines.begin(), lines.end());
+    ++blocks;
+    lines = norm.get_normalized_block();
+  }
+  EXPECT_GT(blocks, 1);
+  EXPECT_EQ(expected.size(), total_lines);
+
+  Parallel_normalizer par_norm(4);
+  EXPECT_EQ(par_norm.threads(), 4);
+  par_norm.set_input_stream(my_log_file);
+  Normal_list parallel;
+  auto par_lines = par_norm.get_normalized_block();
+  while (!par_lines.empty()) {
+    parallel.insert(parallel.end(), par_lines.begin(), par_lines.end());
+    par_lines = par_norm.get_normalized_block();
+  }
+  EXPECT_EQ(parallel, expected);
+  remove(my_log_file.c_str());
+
+  std::string my_line = "abc 1234 def\n";
+  std::istringstream in(my_line);
+  par_norm.modify_current_normal_types(9,
+                                       Normal_type(R"(abc)", 0u, "<ABC>"));
+  par_norm.set_input_stream(in);
+  par_lines = par_norm.get_normalized_block();
+  ASSERT_EQ(par_lines.size(), 1);
+  EXPECT_EQ(par_lines.front().sections.begin()->second.first, 9);
+  EXPECT_TRUE(par_norm.get_normalized_block().empty());
+}
+
+TEST(test_parallel_normalization, test_parallel_pattern_update)
+{
+  std::string my_log_file = "my_pattern_test.log";
+  {
+    std::ofstream out(my_log_file);
+    for (size_t i = 0; i < 600000; ++i)
+      out << "log entry line\n";
+  }
+  Parallel_normalizer par_norm(1);
+  par_norm.begin_normal_types_update();
+  for (const auto& nt : par_norm.get_current_normal_types()) {
+    if (nt.first != Line_normalizer::line_end_id)
+      par_norm.modify_current_normal_types(nt.first,
+                                           Normal_type(R"(zzz)", 0u, "<Z>"));
+  }
+  ASSERT_TRUE(par_norm.commit_normal_types_update());
+  auto types = par_norm.get_current_normal_types();
+  auto first = par_norm.get_pattern_set()->version;
+  par_norm.set_input_stream(my_log_file);
+  ASSERT_FALSE(par_norm.get_normalized_block().empty());
+  EXPECT_EQ(par_norm.get_block_pattern_version(), first);
+
+  // Blocks already read finish with the old set while the new one is
+  // published from another thread.
+  types[9] = Normal_type(R"(entry)", 0u, "<E>");
+  std::thread updater([&par_norm, &types] {
+    EXPECT_TRUE(par_norm.update_normal_types(types));
+  });
+  updater.join();
+  auto second = par_norm.get_pattern_set()->version;
+  EXPECT_GT(second, first);
+  size_t old_blocks = 0;
+  size_t new_blocks = 0;
+  for (auto lines = par_norm.get_normalized_block(); !lines.empty();
+       lines = par_norm.get_normalized_block()) {
+    auto version = par_norm.get_block_pattern_version();
+    bool updated = lines.front().sections.begin()->second.first == 9;
+    if (version == first) {
+      EXPECT_EQ(new_blocks, 0);
+      EXPECT_FALSE(updated);
+      ++old_blocks;
+    } else {
+      EXPECT_EQ(version, second);
+      EXPECT_TRUE(updated);
+      ++new_blocks;
+    }
+  }
+  EXPECT_GT(old_blocks, 0);
+  EXPECT_GT(new_blocks, 0);
+  remove(my_log_file.c_str());
+}
+
+TEST(test_parallel_normalization, test_parallel_files)
+{
+  std::vector<std::string> files = {"my_files_test0.log", "my_files_test1.log",
+                                    "my_files_test2.log"};
+  std::vector<std::string> contents = {"a 1234\nb 99\n", "",
+                                       "c 10.0.0.1\n"};
+  for (size_t i = 0; i < files.size(); ++i) {
+    std::ofstream out(files[i]);
+    out << contents[i];
+  }
+  Parallel_normalizer par_norm(2);
+  par_norm.set_input_files(files);
+  auto lines = par_norm.get_normalized_block();
+  ASSERT_EQ(lines.size(), 2);
+  EXPECT_EQ(lines[1].line, "b 99\n");
+  EXPECT_EQ(par_norm.current_input(), 0);
+  // Switching to columns rescans the blocks that were already queued.
+  Normal_block columns;
+  ASSERT_TRUE(par_norm.get_normalized_block(columns));
+  ASSERT_EQ(columns.size(), 1);
+  EXPECT_EQ(columns.line(0), "c 10.0.0.1\n");
+  EXPECT_EQ(columns.section_ids[1], 2);
+  EXPECT_EQ(par_norm.current_input(), 2);
+  EXPECT_FALSE(par_norm.get_normalized_block(columns));
+  EXPECT_TRUE(columns.empty());
+
+  par_norm.set_input_files({});
+  EXPECT_TRUE(par_norm.get_normalized_block().empty());
+  for (const auto& file : files)
+    remove(file.c_str());
+}
+
+TEST(test_parallel_normalization, test_parallel_directory)
+{
+  std::string dir = "my_inputs_test";
+  boost::filesystem::create_directories(dir + "/rotated");
+  {
+    std::ofstream big(dir + "/big.log");
+    for (size_t i = 0; i < 250000; ++i)
+      big << "a 10.0.0.1\n";
+    for (size_t i = 0; i < 3; ++i)
+      std::ofstream(dir + "/rotated/small.log." + std::to_string(i))
+          << "b " << i << "\n";
+  }
+  auto files = expand_input_files({dir});
+  ASSERT_EQ(files.size(), 4);
+  EXPECT_EQ(files[0], dir + "/big.log");
+  EXPECT_EQ(files[3], dir + "/rotated/small.log.2");
+  EXPECT_EQ(expand_input_files({dir + "/rotated/*.log.[01]"}),
+            std::vector<std::string>(files.begin() + 1, files.begin() + 3));
+
+  Parallel_normalizer par_norm(2);
+  par_norm.set_input_files(files);
+  std::vector<size_t> file_lines(files.size());
+  std::vector<size_t> file_bytes(files.size());
+  size_t big_blocks = 0;
+  for (auto lines = par_norm.get_normalized_block(); !lines.empty();
+       lines = par_norm.get_normalized_block()) {
+    auto input = par_norm.current_input();
+    // Each block starts where the previous block of its file ended.
+    EXPECT_EQ(par_norm.current_offset(), file_bytes[input]);
+    for (const auto& line : lines)
+      file_bytes[input] += line.line.size();
+    file_lines[input] += lines.size();
+    big_blocks += input == 0;
+  }
+  EXPECT_GT(big_blocks, 1);
+  EXPECT_EQ(file_lines, std::vector<size_t>({250000, 1, 1, 1}));
+  EXPECT_EQ(file_bytes[0], 250000 * 11);
+  boost::filesystem::remove_all(dir);
+}
+
 TEST(test_basic_normalization, test_py_normalizor)
 {
   std::string my_log_file = "my_test.log";
@@ -1,5 +1,8 @@
+import gzip
+import io
 import os
 import sys
+import time
 
 
 def main():
@@ -20,14 +23,15 @@ def main():
     assert b0.find(b'This is my log entry 0\n') > 0
     filename = 'test.log'
     with open(filename, 'w') as fo:
-        fo.write(r'68.5.15.145 - - [30/May/2014:22:54:08 -0700] "GET /10.0-STABLE/amd64/m/e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855.gz HTTP/1.1" 200 20 "-" "freebsd-update (fetch, 10.0-STABLE)"\n')
+        fo.write(r'68.5.15.145 - - [30/May/2014:22:54:08 -0700] "GET /10.0-STABLE/amd64/m/e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855.gz HTTP/1.1" 200 20 "-" "freebsd-update (fetch, 10.0-STABLE)"' + '\n')
         fo.write(
-            r'24.12.222.2 - - [26/May/2014:14:52:12 -0700] "\x80w\x01\x03\x01\x00N\x00\x00\x00 \x00\x009\x00\x008\x00\x005\x00\x00\x16\x00\x00\x13\x00\x00" 400 172 "-" "-"\n')
+            r'24.12.222.2 - - [26/May/2014:14:52:12 -0700] "\x80w\x01\x03\x01\x00N\x00\x00\x00 \x00\x009\x00\x008\x00\x005\x00\x00\x16\x00\x00\x13\x00\x00" 400 172 "-" "-"' + '\n')
     myln = norm.Line_normalizer()
     myln.set_input_stream(filename)
     mylines = myln.get_normalized_block()
+    assert len(mylines) == 2
     ans = [[b'GET', b'STABLE', b'amd', b'gz', b'HTTP',
-            b'freebsd', b'update', b'fetch', b'STABLE'], []]
+            b'freebsd', b'update', b'fetch', b'STABLE'], [b'] "']]
     for i, l in enumerate(mylines):
         section = norm.section2dict(l.sections)
         sections = [[ss[0], ss[1][1]] for ss in section.items()]
@@ -37,7 +41,162 @@ def main():
                       for i, s in enumerate(sections[1:]))
         tokens.append(line[sections[-1][1]: -1])
         assert [tk for tk in tokens if len(tk) >= 2] == ans[i]
+    with open(filename, 'w') as fo:
+        fo.write('ip 10.0.0.1 at 12/31/1999 12:59:59 x\n')
+    myln = norm.Line_normalizer()
+    myln.set_render_policy(8, norm.Render_policy.keep)
+    myln.set_input_stream(filename)
+    text, offsets = myln.get_rendered_block()
+    assert text == b'ip <IP> at <TS> x\n'
+    assert offsets == [0, len(text)]
+    text, offsets = myln.get_rendered_block()
+    assert text == b'' and offsets == [0]
+    myln = norm.Line_normalizer()
+    myln.set_input_stream(filename)
+    expected = norm.section2dict(myln.get_normalized_block()[0].sections)
+    myln = norm.Line_normalizer()
+    myln.modify_current_normal_types(8, norm.Normal_type(
+        r'\W+', 0, '<NW>', norm.Match_mode.greedy_extend))
+    myln.set_input_stream(filename)
+    greedy = myln.get_normalized_block()
+    assert norm.section2dict(greedy[0].sections) == expected
+    myln = norm.Line_normalizer()
+    myln.modify_current_normal_types(2, norm.Normal_type(
+        r'\d{1,3}[-.]\d{1,3}[-.]\d{1,3}[-.]\d{1,3}(\/\d{1,2})?', 0, '<IP>',
+        norm.Match_mode.leftmost, '.'))
+    myln.set_input_stream(filename)
+    filtered = myln.get_normalized_block()
+    assert norm.section2dict(filtered[0].sections) == expected
+    block, first_lines = myln.normalize_messages(
+        [b'ip 10.0.0.1 at 12/31/1999 12:59:59 x', b'', bytearray(b'a\nb')])
+    assert first_lines == [0, 1, 1, 3]
+    assert len(block) == 3
+    assert bytes(block.data)[:11] == b'ip 10.0.0.1'
+    version = myln.get_pattern_version()
+    assert myln.update_normal_types({
+        0: norm.Normal_type(r'\n', 0, '<NL>'),
+        9: norm.Normal_type('ip', 0, '<WORD>')})
+    assert myln.get_pattern_version() > version
+    block, first_lines = myln.normalize_messages([b'ip x'])
+    assert myln.get_block_pattern_version() == myln.get_pattern_version()
+    assert list(block.section_ids) == [9]
+    os.remove(filename)
+    with open(filename, 'w') as fo:
+        fo.write('ip 10.0.0.1 at 12/31/1999 12:59:59 x\n')
+        fo.write('no sections\n')
+    myln = norm.Line_normalizer()
+    myln.set_input_stream(filename)
+    block = myln.get_normalized_columns()
+    assert len(block) == 2
+    data = block.data
+    assert data.readonly and data.format == 'B'
+    assert block.line_offsets.tolist() == [0, 37, 49]
+    assert bytes(data[37:49]) == b'no sections\n'
+    first, last = block.section_offsets.tolist()[0:2]
+    ids = block.section_ids.tolist()[first:last]
+    starts = block.section_starts.tolist()[first:last]
+    ends = block.section_ends.tolist()[first:last]
+    assert (ids[1], starts[1], ends[1]) == (2, 3, 11)
+    assert bytes(data[starts[4]:ends[4]]) == b'12/31/1999 12:59:59'
+    assert len(myln.get_normalized_columns()) == 0
+    # the views keep the block alive after the normalizer is gone.
+    ids = block.section_ids
+    del myln, block
+    assert ids.tolist()[0:2] == [8, 2]
+    os.remove(filename)
+    contents = b'a 1234\nb 10.0.0.1\n'
+    for source in [contents, io.BytesIO(contents),
+                   io.StringIO(contents.decode())]:
+        myln = norm.Line_normalizer()
+        myln.set_input_stream(source)
+        blocks = [bytes(block.data) for block in myln]
+        assert blocks == [contents]
+    # file objects dropped while being read, with read-ahead asked for.
+    contents = b'abc 10.0.0.1\n' * 400000
+    for _ in range(20):
+        myln = norm.Line_normalizer()
+        myln.set_read_ahead(3)
+        myln.set_input_stream(io.BytesIO(contents))
+        time.sleep(0.001)
+        myln.set_input_stream(io.BytesIO(contents))
+        time.sleep(0.001)
+        del myln
+    myln = norm.Line_normalizer()
+    myln.set_read_ahead(3)
+    myln.set_input_stream(io.BytesIO(contents))
+    assert len(myln.get_normalized_columns()) > 0
+    del myln
+    myln = norm.Line_normalizer()
+    myln.set_statistics(True)
+    myln.set_input_stream(b'a 10.0.0.1\na 10.0.0.2\nb 1.2.3.4\n')
+    block = myln.get_normalized_columns()
+    fps = block.fingerprints.tolist()
+    assert fps[0] == fps[1] and fps[0] != fps[2]
+    stats = myln.get_run_statistics()
+    assert stats.lines == 3
+    assert stats.templates == {fps[0]: 2, fps[2]: 1}
+    assert stats.type_matches[2] == 3
+    myln = norm.Line_normalizer()
+    myln.set_metrics(True)
+    myln.set_input_stream(b'a 10.0.0.1\nb 1.2.3.4\n')
+    for block in myln:
+        pass
+    metrics = myln.get_metrics()
+    assert metrics['bytes'] == 21 and metrics['lines'] == 2
+    assert metrics['scan'][1] == 1 and metrics['scan'][0] > 0
+    assert metrics['type_matches'][2] == 2
+    myln.set_line_cache(1 << 20)
+    myln.reset_metrics()
+    myln.set_input_stream(b'a 10.0.0.1\na 10.0.0.1\n')
+    for block in myln:
+        pass
+    metrics = myln.get_metrics()
+    assert metrics['line_cache_hits'] == 1
+    assert metrics['line_cache_misses'] == 1
+    assert metrics['line_cache_too_large'] == 0
+    names = ['test0.log', 'test1.log', 'test2.log']
+    for i, name in enumerate(names):
+        with open(name, 'wb') as fo:
+            fo.write(b'line %d 10.0.0.%d\n' % (i, i) * (i + 1))
+    results = [(name, len(block))
+               for name, block in norm.normalize_files(names, threads=2)]
+    assert results == [('test0.log', 1), ('test1.log', 2), ('test2.log', 3)]
+    files = norm.normalize_files(['test[0-2].log'], threads=2)
+    assert [(name, files.offset) for name, _ in files] == [
+        ('test0.log', 0), ('test1.log', 0), ('test2.log', 0)]
+    for name in names:
+        os.remove(name)
+    filename = 'test.log.gz'
+    with gzip.open(filename, 'wb') as fo:
+        fo.write(b'ip 10.0.0.1 at 12/31/1999 12:59:59 x\n')
+    myln = norm.Line_normalizer()
+    myln.set_input_stream(filename)
+    text, offsets = myln.get_rendered_block()
+    assert text == b'ip<NW><IP><NW>at<NW><TS><NW>x\n'
     os.remove(filename)
+    myln.set_input_stream(b'GET 10.0.0.1\nno numbers\n')
+    block = myln.get_normalized_columns()
+    writer = norm.Normal_file_writer()
+    assert writer.open('test.nrm', myln.normal_types_hash())
+    assert writer.write_block(block)
+    assert writer.close()
+    reader = norm.Normal_file_reader()
+    assert reader.open('test.nrm')
+    assert reader.normal_types_hash() == myln.normal_types_hash()
+    saved = reader.read_block()
+    assert bytes(saved.data) == bytes(block.data)
+    assert list(saved.section_ids) == list(block.section_ids)
+    assert len(reader.read_block()) == 0
+    os.remove('test.nrm')
+    myln = norm.Line_normalizer()
+    myln.modify_current_normal_types(2, norm.Normal_type(
+        r'\d{1,3}[-.]\d{1,3}[-.]\d{1,3}[-.]\d{1,3}(\/\d{1,2})?', 0, '<IP>',
+        norm.Match_mode.leftmost, '', norm.Value_decoder.ipv4))
+    myln.set_input_stream(b'from 10.0.0.1 ok\n')
+    block = myln.get_normalized_columns()
+    values = dict(zip(block.section_ids, block.section_values))
+    assert values[2] == 0x0a000001
+    assert values[8] == norm.no_value
 
 
 if __name__ == "__main__":
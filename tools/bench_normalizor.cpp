@@ -0,0 +1,620 @@
+//===-------- bench_normalizor.cpp, benchmarks for normalizor ------------===//
+/*!
+ * Copyright (c) 2017-2018 Petabi, Inc.
+ * All rights reserved.
+ *
+ * \brief Measures normalization of deterministic synthetic corpora.
+ *
+ * Every benchmark reports bytes_per_second and these counters:
+ *   lines_per_second  lines normalized per second.
+ *   allocs_per_line   heap allocations per normalized line.
+ *   peak_rss_mb       peak resident set size of the process so far.
+ *
+ * Run with --benchmark_format=json, or --benchmark_out=<file>, to get
+ * results that tools/compare_bench.py compares against a baseline.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <benchmark/benchmark.h>
+
+#include "normalizor.h"
+#include "parallel_normalizor.h"
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+/*!
+ * \brief Counts an allocation and returns size bytes aligned to align, or
+ *        nullptr if there is no memory.
+ */
+void* counted_alloc(size_t size, size_t align) noexcept
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (size == 0)
+    size = 1;
+  if (align <= alignof(std::max_align_t))
+    return std::malloc(size);
+  void* p = nullptr;
+  return ::posix_memalign(&p, align, size) == 0 ? p : nullptr;
+}
+
+void* counted_new(size_t size, size_t align)
+{
+  if (void* p = counted_alloc(size, align))
+    return p;
+  throw std::bad_alloc();
+}
+
+/*!
+ * \brief Frees memory of counted_alloc().  Not inlined, so the compiler
+ *        does not pair its free() with the new expressions of the callers.
+ */
+[[gnu::noinline]] void counted_free(void* p) noexcept { std::free(p); }
+
+constexpr size_t default_align = alignof(std::max_align_t);
+
+} // namespace
+
+// Every replaceable allocation function is replaced, so each pointer is
+// freed by the counterpart of the function that allocated it.
+void* operator new(size_t size) { return counted_new(size, default_align); }
+void* operator new[](size_t size)
+{
+  return counted_new(size, default_align);
+}
+void* operator new(size_t size, std::align_val_t align)
+{
+  return counted_new(size, static_cast<size_t>(align));
+}
+void* operator new[](size_t size, std::align_val_t align)
+{
+  return counted_new(size, static_cast<size_t>(align));
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+  return counted_alloc(size, default_align);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+  return counted_alloc(size, default_align);
+}
+void* operator new(size_t size, std::align_val_t align,
+                   const std::nothrow_t&) noexcept
+{
+  return counted_alloc(size, static_cast<size_t>(align));
+}
+void* operator new[](size_t size, std::align_val_t align,
+                     const std::nothrow_t&) noexcept
+{
+  return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+  counted_free(p);
+}
+void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+  counted_free(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept
+{
+  counted_free(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+  counted_free(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+  counted_free(p);
+}
+void operator delete(void* p, std::align_val_t,
+                     const std::nothrow_t&) noexcept
+{
+  counted_free(p);
+}
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept
+{
+  counted_free(p);
+}
+
+namespace {
+
+/*!
+ * \brief The kinds of synthetic corpora.
+ */
+enum class Corpus : int {
+  syslog,
+  apache,
+  json,
+  base64,
+  non_ascii,
+  long_lines
+};
+
+const char* corpus_name(Corpus kind)
+{
+  switch (kind) {
+  case Corpus::syslog:
+    return "syslog";
+  case Corpus::apache:
+    return "apache";
+  case Corpus::json:
+    return "json";
+  case Corpus::base64:
+    return "base64";
+  case Corpus::non_ascii:
+    return "non_ascii";
+  case Corpus::long_lines:
+    return "long_lines";
+  }
+  return "unknown";
+}
+
+/*!
+ * \brief Builds one line of the corpus.  The generator is seeded with a
+ *        constant, so every run produces the same corpus.
+ */
+std::string make_line(Corpus kind, std::mt19937_64& rng)
+{
+  static const char* const hosts[] = {"web01", "db-master", "cache3", "lb"};
+  static const char* const words[] = {"connection", "accepted", "closed",
+                                      "timeout",    "user",     "session",
+                                      "opened",     "for",      "from"};
+  auto pick = [&rng](size_t n) { return static_cast<size_t>(rng() % n); };
+  auto num = [&pick](size_t n) { return std::to_string(pick(n)); };
+  auto ip = [&num] {
+    return num(256) + "." + num(256) + "." + num(256) + "." + num(256);
+  };
+  std::string line;
+  switch (kind) {
+  case Corpus::syslog:
+    line = "Jan " + std::to_string(1 + rng() % 28) + " " + num(24) + ":" +
+           num(60) + ":" + num(60) + " " + hosts[pick(4)] + " sshd[" +
+           num(65536) + "]: ";
+    for (size_t i = 0, n = 3 + pick(6); i < n; ++i)
+      line += std::string(words[pick(9)]) + " ";
+    line += ip() + " port " + num(65536);
+    break;
+  case Corpus::apache:
+    line = ip() + " - - [30/May/2014:" + num(24) + ":" + num(60) + ":" +
+           num(60) + " -0700] \"GET /" + words[pick(9)] + "/" +
+           std::to_string(rng()) + ".gz HTTP/1.1\" " +
+           (pick(10) ? "200 " : "404 ") + num(100000) + " \"-\" \"curl/7." +
+           num(60) + "\"";
+    break;
+  case Corpus::json:
+    line = "{\"ts\":\"2018-03-" + std::to_string(10 + rng() % 18) + " " +
+           num(24) + ":" + num(60) + ":" + num(60) + "\",\"host\":\"" +
+           hosts[pick(4)] + "\",\"src\":\"" + ip() + "\",\"id\":\"" +
+           std::to_string(rng()) + "\",\"msg\":\"" + words[pick(9)] + " " +
+           words[pick(9)] + "\",\"version\":\"" + num(10) + "." + num(100) +
+           "." + num(1000) + "\"}";
+    break;
+  case Corpus::base64: {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    line = "POST /upload data:image/png;base64,";
+    for (size_t i = 0, n = 4 * (16 + pick(64)); i < n; ++i)
+      line += alphabet[pick(64)];
+    line += " from " + ip();
+    break;
+  }
+  case Corpus::non_ascii:
+    line = "lala ησε lala ×ÀÃæ " + num(10000) + " πεμας lala " + ip() +
+           " ñandú 😀 " + words[pick(9)];
+    break;
+  case Corpus::long_lines:
+    line = "trace " + ip() + " ";
+    for (size_t i = 0, n = 2000 + pick(2000); i < n; ++i)
+      line += std::string(words[pick(9)]) + "=" + num(1000) + " ";
+    break;
+  }
+  return line + "\n";
+}
+
+/*!
+ * \brief The corpus of kind, about size bytes, built once per run.
+ */
+const std::string& corpus(Corpus kind, size_t size = 16 << 20)
+{
+  static std::map<Corpus, std::string> corpora;
+  auto& text = corpora[kind];
+  if (text.empty()) {
+    std::mt19937_64 rng(static_cast<uint64_t>(kind) + 1);
+    while (text.size() < size)
+      text += make_line(kind, rng);
+  }
+  return text;
+}
+
+size_t count_lines(const std::string& text)
+{
+  size_t lines = 0;
+  for (char c : text)
+    lines += c == '\n';
+  return lines;
+}
+
+/*!
+ * \brief Adds extra Normal_types, literal keywords that rarely match, so
+ *        the database holds extra patterns.
+ */
+template <typename Normalizer>
+void add_patterns(Normalizer& norm, size_t extra)
+{
+  norm.begin_normal_types_update();
+  for (size_t i = 0; i < extra; ++i) {
+    norm.modify_current_normal_types(
+        100 + i, Normal_type("keyword" + std::to_string(i) + "x", 0u,
+                             "<KW" + std::to_string(i) + ">"));
+  }
+  norm.commit_normal_types_update();
+}
+
+/*!
+ * \brief Sets the counters shared by every benchmark.
+ */
+void report(benchmark::State& state, const std::string& text,
+            size_t allocs_before)
+{
+  auto iterations = static_cast<size_t>(state.iterations());
+  size_t lines = count_lines(text) * iterations;
+  state.SetBytesProcessed(static_cast<int64_t>(text.size() * iterations));
+  state.counters["lines_per_second"] = benchmark::Counter(
+      static_cast<double>(lines), benchmark::Counter::kIsRate);
+  state.counters["allocs_per_line"] =
+      static_cast<double>(allocations.load() - allocs_before) /
+      static_cast<double>(lines);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  state.counters["peak_rss_mb"] = static_cast<double>(usage.ru_maxrss) / 1024.0;
+}
+
+/*!
+ * \brief Normalizes a corpus into Normal_lines.  Arguments: corpus kind,
+ *        number of extra patterns.
+ */
+void bm_lines(benchmark::State& state)
+{
+  auto kind = static_cast<Corpus>(state.range(0));
+  const auto& text = corpus(kind);
+  Line_normalizer norm;
+  add_patterns(norm, static_cast<size_t>(state.range(1)));
+  state.SetLabel(corpus_name(kind));
+  size_t allocs_before = allocations.load();
+  for (auto _ : state) {
+    std::istringstream in(text);
+    norm.set_input_stream(in);
+    while (!norm.get_normalized_block().empty()) {
+    }
+  }
+  report(state, text, allocs_before);
+}
+
+/*!
+ * \brief Normalizes a corpus into Normal_lines with the run Normal_types
+ *        (hex, decimal and non-word) in Match_mode::greedy_extend.
+ *        Argument: corpus kind.
+ */
+void bm_greedy_extend(benchmark::State& state)
+{
+  auto kind = static_cast<Corpus>(state.range(0));
+  const auto& text = corpus(kind);
+  Line_normalizer norm;
+  norm.begin_normal_types_update();
+  for (size_t id : {4, 7, 8}) {
+    auto nt = norm.get_current_normal_types().at(id);
+    norm.modify_current_normal_types(
+        id, Normal_type(nt.regex, nt.flags, nt.replacement,
+                        Match_mode::greedy_extend));
+  }
+  norm.commit_normal_types_update();
+  state.SetLabel(corpus_name(kind));
+  size_t allocs_before = allocations.load();
+  for (auto _ : state) {
+    std::istringstream in(text);
+    norm.set_input_stream(in);
+    while (!norm.get_normalized_block().empty()) {
+    }
+  }
+  report(state, text, allocs_before);
+}
+
+/*!
+ * \brief Normalizes a corpus into a Normal_list that is handed back for
+ *        reuse.  Argument: corpus kind.
+ */
+void bm_recycled_lines(benchmark::State& state)
+{
+  auto kind = static_cast<Corpus>(state.range(0));
+  const auto& text = corpus(kind);
+  Line_normalizer norm;
+  Normal_list lines;
+  state.SetLabel(corpus_name(kind));
+  size_t allocs_before = allocations.load();
+  for (auto _ : state) {
+    std::istringstream in(text);
+    norm.set_input_stream(in);
+    while (norm.get_normalized_block(lines)) {
+    }
+  }
+  report(state, text, allocs_before);
+}
+
+/*!
+ * \brief Normalizes the lines of a corpus, without their line ends, as
+ *        batches of in-memory messages.  Arguments: corpus kind, messages
+ *        per batch.
+ */
+void bm_messages(benchmark::State& state)
+{
+  auto kind = static_cast<Corpus>(state.range(0));
+  const auto& text = corpus(kind);
+  std::vector<std::string_view> messages;
+  for (size_t start = 0, end; start < text.size(); start = end + 1) {
+    end = text.find('\n', start);
+    messages.emplace_back(text.data() + start, end - start);
+  }
+  auto batch = static_cast<size_t>(state.range(1));
+  Line_normalizer norm;
+  std::vector<std::string_view> messages_batch;
+  std::vector<size_t> message_lines;
+  state.SetLabel(corpus_name(kind));
+  size_t allocs_before = allocations.load();
+  for (auto _ : state) {
+    for (size_t first = 0; first < messages.size(); first += batch) {
+      messages_batch.assign(
+          messages.begin() + static_cast<std::ptrdiff_t>(first),
+          messages.begin() + static_cast<std::ptrdiff_t>(
+                                 std::min(first + batch, messages.size())));
+      benchmark::DoNotOptimize(
+          norm.normalize_messages(messages_batch, message_lines));
+    }
+  }
+  report(state, text, allocs_before);
+}
+
+/*!
+ * \brief Normalizes a corpus into a reused Normal_block.  Argument: corpus
+ *        kind.
+ */
+void bm_columns(benchmark::State& state)
+{
+  auto kind = static_cast<Corpus>(state.range(0));
+  const auto& text = corpus(kind);
+  Line_normalizer norm;
+  Normal_block columns;
+  state.SetLabel(corpus_name(kind));
+  size_t allocs_before = allocations.load();
+  for (auto _ : state) {
+    std::istringstream in(text);
+    norm.set_input_stream(in);
+    while (norm.get_normalized_block(columns)) {
+    }
+  }
+  report(state, text, allocs_before);
+}
+
+/*!
+ * \brief The Normal_types of a default Line_normalizer with the timestamp,
+ *        IP, hex, version and decimal types decoded.
+ */
+std::map<size_t, Normal_type> decoded_types()
+{
+  Line_normalizer norm;
+  auto types = norm.get_current_normal_types();
+  types[1].decoder = Value_decoder::timestamp;
+  types[2].decoder = Value_decoder::ipv4;
+  types[4].decoder = Value_decoder::hex;
+  types[5].decoder = Value_decoder::version;
+  types[7].decoder = Value_decoder::decimal;
+  return types;
+}
+
+/*!
+ * \brief Normalizes a corpus into a reused Normal_block with or without
+ *        the values of its sections.  Arguments: corpus kind, 1 to decode.
+ */
+void bm_value_decoders(benchmark::State& state)
+{
+  auto kind = static_cast<Corpus>(state.range(0));
+  const auto& text = corpus(kind);
+  Line_normalizer norm;
+  if (state.range(1) != 0)
+    norm.update_normal_types(decoded_types());
+  Normal_block columns;
+  state.SetLabel(corpus_name(kind));
+  size_t allocs_before = allocations.load();
+  for (auto _ : state) {
+    std::istringstream in(text);
+    norm.set_input_stream(in);
+    while (norm.get_normalized_block(columns)) {
+    }
+  }
+  report(state, text, allocs_before);
+}
+
+/*!
+ * \brief Decodes the sections of a corpus found with a Normal_type, without
+ *        scanning.  Argument: Normal_type id.
+ */
+void bm_decode(benchmark::State& state)
+{
+  // The sections of the corpus by Normal_type id, found once.
+  static std::map<int32_t, std::vector<std::string>> typed_sections;
+  if (typed_sections.empty()) {
+    Line_normalizer norm;
+    std::istringstream in(corpus(Corpus::syslog));
+    norm.set_input_stream(in);
+    Normal_block columns;
+    while (norm.get_normalized_block(columns)) {
+      for (size_t i = 0; i < columns.size(); ++i) {
+        auto line = columns.line(i);
+        for (size_t s = columns.section_offsets[i];
+             s < columns.section_offsets[i + 1]; ++s) {
+          typed_sections[columns.section_ids[s]].emplace_back(line.substr(
+              columns.section_starts[s],
+              columns.section_ends[s] - columns.section_starts[s]));
+        }
+      }
+    }
+  }
+  auto id = static_cast<int32_t>(state.range(0));
+  auto decoder = decoded_types().at(static_cast<size_t>(id)).decoder;
+  const auto& sections = typed_sections[id];
+  for (auto _ : state) {
+    for (const auto& section : sections)
+      benchmark::DoNotOptimize(decode_value(decoder, section));
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          static_cast<int64_t>(sections.size()));
+}
+
+/*!
+ * \brief The syslog corpus with the given percentage of its lines replaced
+ *        by a few heartbeat lines, as in logs full of health checks.
+ */
+const std::string& repetitive_corpus(size_t percent)
+{
+  static std::map<size_t, std::string> corpora;
+  auto& text = corpora[percent];
+  if (text.empty()) {
+    static const char* const heartbeats[] = {
+        "Jan 1 00:00:00 lb haproxy[811]: health check 10.0.0.1 ok\n",
+        "Jan 1 00:00:00 web01 app[2001]: GET /status 200 0x1f2e\n",
+        "Jan 1 00:00:00 cache3 redis[42]: heartbeat from 10.0.0.7\n",
+        "Jan 1 00:00:00 db-master pg[5432]: checkpoint complete\n"};
+    std::mt19937_64 rng(percent + 1);
+    const auto& base = corpus(Corpus::syslog);
+    for (size_t start = 0, end; start < base.size(); start = end + 1) {
+      end = base.find('\n', start);
+      if (rng() % 100 < percent)
+        text += heartbeats[rng() % 4];
+      else
+        text.append(base, start, end + 1 - start);
+    }
+  }
+  return text;
+}
+
+/*!
+ * \brief Normalizes a repetitive corpus into a reused Normal_block with or
+ *        without a line cache.  Arguments: percentage of repeated lines,
+ *        cache size in MiB.
+ */
+void bm_line_cache(benchmark::State& state)
+{
+  const auto& text = repetitive_corpus(static_cast<size_t>(state.range(0)));
+  Line_normalizer norm;
+  norm.set_line_cache(static_cast<size_t>(state.range(1)) << 20);
+  Normal_block columns;
+  size_t allocs_before = allocations.load();
+  for (auto _ : state) {
+    std::istringstream in(text);
+    norm.set_input_stream(in);
+    while (norm.get_normalized_block(columns)) {
+    }
+  }
+  report(state, text, allocs_before);
+}
+
+/*!
+ * \brief Normalizes a corpus on several threads.  Arguments: corpus kind,
+ *        number of threads.
+ */
+void bm_parallel(benchmark::State& state)
+{
+  auto kind = static_cast<Corpus>(state.range(0));
+  const auto& text = corpus(kind);
+  Parallel_normalizer norm(static_cast<size_t>(state.range(1)));
+  Normal_block columns;
+  state.SetLabel(corpus_name(kind));
+  size_t allocs_before = allocations.load();
+  for (auto _ : state) {
+    std::istringstream in(text);
+    norm.set_input_stream(in);
+    while (norm.get_normalized_block(columns)) {
+    }
+  }
+  report(state, text, allocs_before);
+}
+
+void corpus_args(benchmark::internal::Benchmark* bench)
+{
+  for (int kind = 0; kind <= static_cast<int>(Corpus::long_lines); ++kind)
+    bench->Args({kind, 0});
+  for (int extra : {16, 256})
+    bench->Args({static_cast<int>(Corpus::syslog), extra});
+}
+
+void thread_args(benchmark::internal::Benchmark* bench)
+{
+  for (int threads : {1, 2, 4, 8})
+    bench->Args({static_cast<int>(Corpus::apache), threads});
+}
+
+} // namespace
+
+BENCHMARK(bm_lines)
+    ->Apply(corpus_args)
+    ->ArgNames({"corpus", "patterns"})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(bm_greedy_extend)
+    ->DenseRange(0, static_cast<int>(Corpus::long_lines))
+    ->ArgName("corpus")
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(bm_recycled_lines)
+    ->DenseRange(0, static_cast<int>(Corpus::long_lines))
+    ->ArgName("corpus")
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(bm_messages)
+    ->Args({static_cast<int>(Corpus::syslog), 4096})
+    ->Args({static_cast<int>(Corpus::json), 4096})
+    ->ArgNames({"corpus", "batch"})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(bm_columns)
+    ->DenseRange(0, static_cast<int>(Corpus::long_lines))
+    ->ArgName("corpus")
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(bm_value_decoders)
+    ->ArgsProduct({{static_cast<int>(Corpus::syslog),
+                    static_cast<int>(Corpus::apache)},
+                   {0, 1}})
+    ->ArgNames({"corpus", "decode"})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(bm_decode)->Arg(1)->Arg(2)->Arg(4)->Arg(5)->Arg(7)->ArgName("type");
+BENCHMARK(bm_line_cache)
+    ->ArgsProduct({{0, 50, 90}, {0, 16}})
+    ->ArgNames({"repeated", "cache_mb"})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(bm_parallel)
+    ->Apply(thread_args)
+    ->ArgNames({"corpus", "threads"})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,55 @@
+"""Compares two bench_normalizor JSON results.
+
+Usage: compare_bench.py baseline.json current.json [--threshold PERCENT]
+
+Prints the change in throughput and allocations per line of every
+benchmark found in both files.  Exits with status 1 if the throughput of
+any benchmark dropped, or its allocations per line grew, by more than the
+threshold (5% by default).
+"""
+import argparse
+import json
+import sys
+
+
+def load(filename):
+    with open(filename) as f:
+        results = json.load(f)['benchmarks']
+    return {r['name']: r for r in results
+            if r.get('run_type', 'iteration') == 'iteration'}
+
+
+def change(old, new):
+    return (new - old) / old * 100.0 if old else 0.0
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('baseline')
+    parser.add_argument('current')
+    parser.add_argument('--threshold', type=float, default=5.0)
+    args = parser.parse_args()
+    baseline = load(args.baseline)
+    current = load(args.current)
+    failed = False
+    print('%-50s %12s %12s %8s %10s' %
+          ('benchmark', 'base MB/s', 'cur MB/s', 'change', 'allocs'))
+    for name, new in current.items():
+        old = baseline.get(name)
+        if old is None:
+            continue
+        old_mbs = old.get('bytes_per_second', 0.0) / 1e6
+        new_mbs = new.get('bytes_per_second', 0.0) / 1e6
+        speed = change(old_mbs, new_mbs)
+        allocs = change(old.get('allocs_per_line', 0.0),
+                        new.get('allocs_per_line', 0.0))
+        regressed = speed < -args.threshold or allocs > args.threshold
+        failed = failed or regressed
+        print('%-50s %12.1f %12.1f %+7.1f%% %+9.1f%%%s' %
+              (name, old_mbs, new_mbs, speed, allocs,
+               '  REGRESSION' if regressed else ''))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
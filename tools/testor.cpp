@@ -5,6 +5,8 @@
  */
 
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
 #include <sys/resource.h>
 #include <sys/stat.h>
@@ -15,26 +17,145 @@
 #include <boost/program_options.hpp>
 #include <gperftools/profiler.h>
 
+#include "normal_file.h"
 #include "normalizor.h"
+#include "parallel_normalizor.h"
 
 namespace po = boost::program_options;
 
+/*!
+ * \brief Reads every block of the input and counts lines and blocks.
+ */
+template <typename Normalizer>
+static void normalize_all(Normalizer& norm, bool debug, size_t& line_count,
+                          size_t& line_blocks)
+{
+  auto lines = norm.get_normalized_block();
+  while (!lines.empty()) {
+    if (debug) {
+      std::cout << "Printing Debug information\n";
+      for (const auto& l : lines) {
+        std::cout << l.line.c_str();
+      }
+    }
+    line_count += lines.size();
+    ++line_blocks;
+    lines = norm.get_normalized_block();
+  }
+}
+
+/*!
+ * \brief Reads every block of the input and writes it to writer.
+ */
+template <typename Normalizer>
+static bool write_all(Normalizer& norm, Normal_file_writer& writer,
+                      size_t& line_count, size_t& line_blocks)
+{
+  struct Normal_block columns;
+  while (norm.get_normalized_block(columns)) {
+    if (!writer.write_block(columns))
+      return false;
+    line_count += columns.size();
+    ++line_blocks;
+  }
+  return true;
+}
+
+/*!
+ * \brief Reads every block of a file written with --output.
+ */
+static void read_all(Normal_file_reader& reader, bool debug,
+                     size_t& line_count, size_t& line_blocks)
+{
+  for (auto* views = &reader.read_view_block(); !views->empty();
+       views = &reader.read_view_block()) {
+    if (debug) {
+      std::cout << "Printing Debug information\n";
+      for (const auto& l : *views)
+        std::cout << l.line;
+    }
+    line_count += views->size();
+    ++line_blocks;
+  }
+}
+
+/*!
+ * \brief Prints the time of every phase and the matches of every
+ *        Normal_type.
+ */
+static void print_metrics(const Normal_metrics& metrics,
+                          const std::map<size_t, Normal_type>& types)
+{
+  std::cout << "Phase Statistics (seconds, calls; phases nest)\n";
+  for (size_t i = 0; i < phase_count; ++i) {
+    auto phase = static_cast<Phase>(i);
+    std::cout << "--" << phase_name(phase) << ": "
+              << std::to_string(metrics.seconds(phase)) << ", "
+              << std::to_string(metrics.calls(phase)) << "\n";
+  }
+  std::cout << "--Bytes scanned: " << std::to_string(metrics.bytes) << "\n";
+  std::cout << "--Lines: " << std::to_string(metrics.lines) << "\n";
+  std::cout << "--Matches: " << std::to_string(metrics.matches) << "\n";
+  uint64_t cached = metrics.line_cache_hits + metrics.line_cache_misses +
+                    metrics.line_cache_too_large;
+  if (cached > 0) {
+    std::cout << "--Line cache hits: "
+              << std::to_string(metrics.line_cache_hits) << " ("
+              << std::to_string(100.0 *
+                                static_cast<double>(metrics.line_cache_hits) /
+                                static_cast<double>(cached))
+              << "%), too large: "
+              << std::to_string(metrics.line_cache_too_large)
+              << ", evictions: "
+              << std::to_string(metrics.line_cache_evictions) << "\n";
+  }
+  std::cout << "Matches per Normal_type (before overlap resolution)\n";
+  for (const auto& nt : types) {
+    uint64_t count = nt.first < metrics.type_matches.size()
+                         ? metrics.type_matches[nt.first]
+                         : 0;
+    std::cout << "--" << std::to_string(nt.first) << " "
+              << nt.second.replacement << ": " << std::to_string(count)
+              << "\n";
+  }
+}
+
 int main(int argc, char* argv[])
 {
   struct rusage start, end;
-  Line_normalizer norm;
-  std::vector<Normal_line> lines;
-  std::string log_file;
+  std::vector<std::string> log_files;
+  size_t threads = 1;
+  size_t read_ahead = 0;
+  size_t line_cache_mb = 0;
+  std::string output;
   po::options_description posargs;
-  posargs.add_options()("log_file", po::value<std::string>(&log_file),
-                        "Log file to normalize.");
+  posargs.add_options()(
+      "log_file", po::value<std::vector<std::string>>(&log_files),
+      "Log files, directories or glob patterns to normalize.");
   po::positional_options_description positions;
-  positions.add("log_file", 1);
+  positions.add("log_file", -1);
   po::options_description optargs("Options");
   optargs.add_options()("help,h", "Print usage information.");
   optargs.add_options()("profile,p",
                         "Dump profile results to normalizor_profile.txt");
   optargs.add_options()("debug,d", "Print all lines parsed.");
+  optargs.add_options()(
+      "threads,t", po::value<size_t>(&threads),
+      "Number of threads normalizing blocks (0 for all hardware threads).");
+  optargs.add_options()(
+      "read-ahead,r", po::value<size_t>(&read_ahead),
+      "Number of blocks read ahead on a background thread (single thread).");
+  optargs.add_options()(
+      "line-cache,c", po::value<size_t>(&line_cache_mb),
+      "MiB of memory caching the sections of repeated lines.");
+  optargs.add_options()(
+      "output,o", po::value<std::string>(&output),
+      "Write the normalized lines to this file in the binary format.");
+  optargs.add_options()(
+      "normalized,n",
+      "Read files written with --output instead of normalizing logs.");
+  optargs.add_options()("stats,s",
+                        "Print the time of each phase and matches per type.");
   po::options_description cliargs;
   cliargs.add(posargs).add(optargs);
   po::options_description cliopts;
@@ -55,23 +176,70 @@ int main(int argc, char* argv[])
   if (args.count("profile")) {
     ProfilerStart("normalizer_profile.txt");
   }
-  norm.set_input_stream(log_file);
+  std::unique_ptr<Line_normalizer> norm;
+  std::unique_ptr<Parallel_normalizer> par_norm;
+  bool stats = args.count("stats") != 0;
+  if (threads == 1) {
+    norm = std::make_unique<Line_normalizer>();
+    norm->set_read_ahead(read_ahead);
+    norm->set_line_cache(line_cache_mb << 20);
+    norm->set_metrics(stats);
+  } else {
+    par_norm = std::make_unique<Parallel_normalizer>(threads);
+    par_norm->set_line_cache(line_cache_mb << 20);
+    par_norm->set_metrics(stats);
+  }
+  auto files = expand_input_files(log_files);
   size_t line_count = 0;
   size_t line_blocks = 0;
+  bool debug = args.count("debug") != 0;
+  Normal_file_writer writer;
+  uint64_t types_hash =
+      norm ? norm->normal_types_hash() : par_norm->normal_types_hash();
+  if (!output.empty() && !writer.open(output, types_hash)) {
+    std::cerr << "cannot write " << output << std::endl;
+    return EXIT_FAILURE;
+  }
+  bool written = true;
   getrusage(RUSAGE_SELF, &start);
-  lines = norm.get_normalized_block();
-  while (!lines.empty()) {
-    if (args.count("debug")) {
-      std::cout << "Printing Debug information\n";
-      for (const auto& l : lines) {
-        std::cout << l.line.c_str();
+  if (args.count("normalized")) {
+    for (const auto& file : files) {
+      Normal_file_reader reader;
+      if (!reader.open(file)) {
+        std::cerr << "not a normalized file: " << file << std::endl;
+        continue;
       }
+      if (reader.normal_types_hash() != types_hash)
+        std::cerr << file << " was normalized with other Normal_types\n";
+      read_all(reader, debug, line_count, line_blocks);
     }
-    line_count += lines.size();
-    ++line_blocks;
-    lines = norm.get_normalized_block();
+  } else if (!output.empty()) {
+    if (norm) {
+      for (const auto& file : files) {
+        norm->set_input_stream(file);
+        written = written && write_all(*norm, writer, line_count, line_blocks);
+      }
+    } else {
+      par_norm->set_input_files(files);
+      written = write_all(*par_norm, writer, line_count, line_blocks);
+    }
+    written = writer.close() && written;
+  } else if (norm) {
+    for (const auto& file : files) {
+      norm->set_input_stream(file);
+      normalize_all(*norm, debug, line_count, line_blocks);
+    }
+  } else {
+    // The files are read one after another while the workers scan the
+    // blocks of every file, so small files are normalized in parallel too.
+    par_norm->set_input_files(files);
+    normalize_all(*par_norm, debug, line_count, line_blocks);
   }
   getrusage(RUSAGE_SELF, &end);
+  if (!written) {
+    std::cerr << "cannot write " << output << std::endl;
+    return EXIT_FAILURE;
+  }
   std::cout << "Normalization Complete!\n";
   if (args.count("profile")) {
     ProfilerFlush();
@@ -83,14 +251,16 @@ int main(int argc, char* argv[])
   timeradd(&total, &diff, &total);
   double total_proc_time = static_cast<double>(total.tv_sec) +
                            (static_cast<double>(total.tv_usec) / 1000000.0);
-  struct stat file_stats;
-  stat(log_file.c_str(), &file_stats);
-  double bytes_per_sec =
-      static_cast<double>(file_stats.st_size) / total_proc_time;
+  double total_bytes = 0;
+  for (const auto& file : files) {
+    struct stat file_stats;
+    if (stat(file.c_str(), &file_stats) == 0)
+      total_bytes += static_cast<double>(file_stats.st_size);
+  }
+  double bytes_per_sec = total_bytes / total_proc_time;
   double avg_lines_per_block =
       static_cast<double>(line_count) / static_cast<double>(line_blocks);
-  double avg_bytes_per_line =
-      static_cast<double>(file_stats.st_size) / static_cast<double>(line_count);
+  double avg_bytes_per_line = total_bytes / static_cast<double>(line_count);
   double rss_mb = static_cast<double>(end.ru_maxrss) / 1024.0 / 1024.0;
 
   std::cout << "Memory Statistics:\n";
@@ -111,5 +281,12 @@ int main(int argc, char* argv[])
   std::cout << "--Bytes per sec: " << std::to_string(bytes_per_sec) << " ("
             << std::to_string(bytes_per_sec / 1024.0 / 1024.0)
             << " MB per sec)\n";
+  if (stats) {
+    if (norm)
+      print_metrics(norm->get_metrics(), norm->get_current_normal_types());
+    else
+      print_metrics(par_norm->get_metrics(),
+                    par_norm->get_current_normal_types());
+  }
   return EXIT_SUCCESS;
 }